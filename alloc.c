@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "bpb.h"
+#include "fat.h"
+#include "dos.h"
+#include "alloc.h"
+#include "bitset.h"
+
+
+/* alloc_init builds the free-cluster bitmap from the FAT.  Returns 0
+   on success, -1 if the bitmap can't be allocated. */
+int alloc_init(struct cluster_alloc *a, uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint32_t i, hint_free, hint_next;
+
+    a->image_buf = image_buf;
+    a->bpb = bpb;
+    a->total_clusters = total_clusters(bpb);
+    a->nwords = BITSET_WORDS(a->total_clusters);
+    a->free_map = bitset_alloc(a->total_clusters);
+    a->nfree = 0;
+    a->next_free = CLUST_FIRST;
+    if (a->free_map == NULL)
+	return -1;
+
+    for (i = CLUST_FIRST; i < a->total_clusters; i++) 
+    {
+	if (get_fat_entry(i, image_buf, bpb) == CLUST_FREE) 
+	{
+	    bitset_set(a->free_map, i);
+	    a->nfree++;
+	}
+    }
+
+    /* on FAT32, carry on from where the last allocation left off */
+    if (get_fsinfo(image_buf, bpb, &hint_free, &hint_next) == 0
+	&& hint_next >= CLUST_FIRST && hint_next < a->total_clusters)
+	a->next_free = hint_next;
+    return 0;
+}
+
+
+void alloc_destroy(struct cluster_alloc *a)
+{
+    free(a->free_map);
+    a->free_map = NULL;
+    a->nfree = 0;
+}
+
+
+/* scan_words looks for the first free cluster in [from, to), skipping
+   over fully allocated words of the bitmap.  Returns 0 if there is
+   none. */
+static uint32_t scan_words(struct cluster_alloc *a, uint32_t from, uint32_t to)
+{
+    uint32_t w, last;
+    uint64_t bits;
+
+    if (from >= to)
+	return 0;
+
+    w = from / BITS_PER_WORD;
+    last = (to - 1) / BITS_PER_WORD;
+
+    /* mask off the clusters below the starting point in the first word */
+    bits = a->free_map[w] & (~0ULL << (from % BITS_PER_WORD));
+    while (1) 
+    {
+	if (bits != 0) 
+	{
+	    uint32_t cluster = w * BITS_PER_WORD + __builtin_ctzll(bits);
+	    return cluster < to ? cluster : 0;
+	}
+	if (++w > last)
+	    return 0;
+	bits = a->free_map[w];
+    }
+}
+
+
+/* alloc_cluster takes the next free cluster at or after the cursor,
+   wrapping around to the start of the disk.  The FAT itself is left
+   alone - the caller links the cluster into its chain.  Returns 0 if
+   the disk is full. */
+uint32_t alloc_cluster(struct cluster_alloc *a)
+{
+    uint32_t cluster;
+
+    if (a->nfree == 0)
+	return 0;
+
+    cluster = scan_words(a, a->next_free, a->total_clusters);
+    if (cluster == 0)
+	cluster = scan_words(a, CLUST_FIRST, a->next_free);
+    if (cluster == 0)
+	return 0;
+
+    bitset_clear(a->free_map, cluster);
+    a->nfree--;
+    a->next_free = cluster + 1;
+    if (a->next_free >= a->total_clusters)
+	a->next_free = CLUST_FIRST;
+    return cluster;
+}
+
+
+/* scan_used finds the first allocated cluster in [from, to), so that
+   [from, result) is a run of free clusters.  Returns to if they're
+   all free. */
+static uint32_t scan_used(struct cluster_alloc *a, uint32_t from, uint32_t to)
+{
+    uint32_t w, last;
+    uint64_t bits;
+
+    if (from >= to)
+	return to;
+
+    w = from / BITS_PER_WORD;
+    last = (to - 1) / BITS_PER_WORD;
+
+    bits = ~a->free_map[w] & (~0ULL << (from % BITS_PER_WORD));
+    while (1) 
+    {
+	if (bits != 0) 
+	{
+	    uint32_t cluster = w * BITS_PER_WORD + __builtin_ctzll(bits);
+	    return cluster < to ? cluster : to;
+	}
+	if (++w > last)
+	    return to;
+	bits = ~a->free_map[w];
+    }
+}
+
+
+/* take_run claims the n free clusters starting at start for
+   alloc_run and alloc_best_run, and moves the cursor past them */
+static uint32_t take_run(struct cluster_alloc *a, uint32_t start, uint32_t n,
+			 uint32_t *len)
+{
+    uint32_t i;
+
+    for (i = start; i < start + n; i++)
+	bitset_clear(a->free_map, i);
+    a->nfree -= n;
+    a->next_free = start + n;
+    if (a->next_free >= a->total_clusters)
+	a->next_free = CLUST_FIRST;
+    *len = n;
+    return start;
+}
+
+
+/* first_fit looks for a free run of at least want clusters starting
+   in [from, to).  Runs may carry on past to.  The longest run too short
+   to use that it passes goes in *big and *big_len, if it beats what's
+   there already.  Returns the start of the run, or 0 if there's none. */
+static uint32_t first_fit(struct cluster_alloc *a, uint32_t from, uint32_t to,
+			  uint32_t want, uint32_t *big, uint32_t *big_len)
+{
+    uint32_t start, end;
+
+    start = scan_words(a, from, to);
+    while (start != 0) 
+    {
+	end = scan_used(a, start, a->total_clusters);
+	if (end - start >= want)
+	    return start;
+	if (end - start > *big_len) 
+	{
+	    *big = start;
+	    *big_len = end - start;
+	}
+	start = scan_words(a, end, to);
+    }
+    return 0;
+}
+
+
+/* alloc_run takes up to want clusters in one contiguous run.  Like
+   alloc_cluster it starts at the cursor and wraps around, taking the
+   first free run that holds all of them; if none does it takes the
+   largest free run there is, so a file ends up in as few pieces as
+   the free space allows.  As with alloc_cluster, the FAT is left to
+   the caller.  Returns the first cluster with the run's length in
+   *len, or 0 if the disk is full. */
+uint32_t alloc_run(struct cluster_alloc *a, uint32_t want, uint32_t *len)
+{
+    uint32_t fit;
+    uint32_t big = 0, big_len = 0;
+
+    *len = 0;
+    if (a->nfree == 0 || want == 0)
+	return 0;
+
+    fit = first_fit(a, a->next_free, a->total_clusters, want, &big, &big_len);
+    if (fit == 0)
+	fit = first_fit(a, CLUST_FIRST, a->next_free, want, &big, &big_len);
+
+    if (fit != 0)
+	return take_run(a, fit, want, len);
+    return take_run(a, big, big_len, len);
+}
+
+
+/* alloc_best_run is alloc_run for when the layout matters more than
+   the time: it looks at every free run and takes the smallest that
+   holds all want clusters, or failing that the largest, so long runs
+   are kept for the chains that need them.  dos_defrag uses it. */
+uint32_t alloc_best_run(struct cluster_alloc *a, uint32_t want, uint32_t *len)
+{
+    uint32_t start, end;
+    uint32_t best = 0, best_len = 0;
+    uint32_t big = 0, big_len = 0;
+
+    *len = 0;
+    if (a->nfree == 0 || want == 0)
+	return 0;
+
+    start = scan_words(a, CLUST_FIRST, a->total_clusters);
+    while (start != 0) 
+    {
+	end = scan_used(a, start, a->total_clusters);
+	if (end - start >= want) 
+	{
+	    if (best == 0 || end - start < best_len) 
+	    {
+		best = start;
+		best_len = end - start;
+		if (best_len == want)
+		    break;		/* can't do better than exact */
+	    }
+	}
+	else if (end - start > big_len) 
+	{
+	    big = start;
+	    big_len = end - start;
+	}
+	start = scan_words(a, end, a->total_clusters);
+    }
+
+    if (best != 0)
+	return take_run(a, best, want, len);
+    return take_run(a, big, big_len, len);
+}
+
+
+/* alloc_take claims one particular cluster.  Returns 0, or -1 if
+   it isn't free. */
+int alloc_take(struct cluster_alloc *a, uint32_t cluster)
+{
+    if (cluster < CLUST_FIRST || cluster >= a->total_clusters
+	|| !bitset_test(a->free_map, cluster))
+	return -1;
+    bitset_clear(a->free_map, cluster);
+    a->nfree--;
+    return 0;
+}
+
+
+/* alloc_release returns a single cluster to the free pool and marks
+   it free in the FAT */
+void alloc_release(struct cluster_alloc *a, uint32_t cluster)
+{
+    if (cluster < CLUST_FIRST || cluster >= a->total_clusters)
+	return;
+    set_fat_entry(cluster, CLUST_FREE, a->image_buf, a->bpb);
+    if (!bitset_test(a->free_map, cluster)) 
+    {
+	bitset_set(a->free_map, cluster);
+	a->nfree++;
+    }
+}
+
+
+/* alloc_release_chain frees every cluster in the chain starting at
+   cluster */
+void alloc_release_chain(struct cluster_alloc *a, uint32_t cluster)
+{
+    uint32_t next;
+
+    while (is_valid_cluster(cluster, a->bpb) && !bitset_test(a->free_map, cluster)) 
+    {
+	next = get_fat_entry(cluster, a->image_buf, a->bpb);
+	alloc_release(a, cluster);
+	cluster = next;
+    }
+}
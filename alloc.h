@@ -0,0 +1,32 @@
+#ifndef __ALLOC_H__
+#define __ALLOC_H__
+
+#include <stdint.h>
+
+/* free-cluster allocator.  The bitmap has one bit per cluster, set
+   when the cluster is free.  nfree and next_free play the same role
+   as fsinfree and fsinxtfree in the FAT32 FSInfo block, and on FAT32
+   next_free starts from the FSInfo hint. */
+struct cluster_alloc {
+    uint8_t *image_buf;
+    struct bpb33 *bpb;
+    uint32_t total_clusters;	/* clusters 2 .. total_clusters-1 are usable */
+    uint32_t nwords;
+    uint64_t *free_map;
+    uint32_t nfree;		/* number of free clusters */
+    uint32_t next_free;		/* next-fit cursor */
+};
+
+/* prototypes for functions in alloc.c */
+
+int alloc_init(struct cluster_alloc *, uint8_t *, struct bpb33 *);
+void alloc_destroy(struct cluster_alloc *);
+
+uint32_t alloc_cluster(struct cluster_alloc *);
+uint32_t alloc_run(struct cluster_alloc *, uint32_t, uint32_t *);
+uint32_t alloc_best_run(struct cluster_alloc *, uint32_t, uint32_t *);
+int alloc_take(struct cluster_alloc *, uint32_t);
+void alloc_release(struct cluster_alloc *, uint32_t);
+void alloc_release_chain(struct cluster_alloc *, uint32_t);
+
+#endif // __ALLOC_H__
@@ -0,0 +1,33 @@
+#ifndef __BITSET_H__
+#define __BITSET_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* heap bitsets, one bit per cluster, kept in 64-bit words so that
+   sweeps can skip a word at a time */
+
+#define BITS_PER_WORD 64
+#define BITSET_WORDS(n) (((n) + BITS_PER_WORD - 1) / BITS_PER_WORD)
+
+static inline uint64_t *bitset_alloc(uint32_t nbits)
+{
+    return calloc(BITSET_WORDS(nbits), sizeof(uint64_t));
+}
+
+static inline void bitset_set(uint64_t *set, uint32_t bit)
+{
+    set[bit / BITS_PER_WORD] |= 1ULL << (bit % BITS_PER_WORD);
+}
+
+static inline void bitset_clear(uint64_t *set, uint32_t bit)
+{
+    set[bit / BITS_PER_WORD] &= ~(1ULL << (bit % BITS_PER_WORD));
+}
+
+static inline int bitset_test(const uint64_t *set, uint32_t bit)
+{
+    return (set[bit / BITS_PER_WORD] >> (bit % BITS_PER_WORD)) & 1;
+}
+
+#endif // __BITSET_H__
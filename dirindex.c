@@ -0,0 +1,344 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/types.h>
+
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "dirindex.h"
+#include "stats.h"
+
+
+/* bumped by dir_index_invalidate, so every thread's cached indexes
+   go stale at once */
+static uint32_t dir_generation = 1;
+
+/* small direct-mapped cache of directory indexes, keyed by volume and
+   first cluster, per thread like the extent map cache.  Writes to the
+   FAT don't make an index stale, since most of them are to files;
+   whoever writes a directory entry says so with dir_index_add. */
+#define DIR_INDEX_SLOTS 64
+
+static __thread struct dir_index dir_cache[DIR_INDEX_SLOTS];
+
+
+/* dirent_name writes the name a path lookup would use for dirent into
+   name, which must have room for 13 characters */
+void dirent_name(struct direntry *dirent, char *name)
+{
+    int i, len = 0, extlen = 3;
+
+    for (i = 0; i < 8 && dirent->deName[i] != ' '; i++)
+	name[len++] = toupper(dirent->deName[i]);
+
+    /* directories are looked up by name alone */
+    if ((dirent->deAttributes & ATTR_DIRECTORY) == 0) 
+    {
+	while (extlen > 0 && dirent->deExtension[extlen-1] == ' ')
+	    extlen--;
+	if (extlen > 0) 
+	{
+	    name[len++] = '.';
+	    for (i = 0; i < extlen; i++)
+		name[len++] = toupper(dirent->deExtension[i]);
+	}
+    }
+    name[len] = '\0';
+}
+
+
+/* normalize a path component the same way: upper case, without a
+   trailing dot.  Returns -1 if it's too long to be an 8.3 name. */
+static int normalize_name(const char *in, size_t len, char *name)
+{
+    size_t i;
+
+    while (len > 0 && in[len-1] == '.')
+	len--;
+    if (len > 12)
+	return -1;
+    for (i = 0; i < len; i++)
+	name[i] = toupper((unsigned char)in[i]);
+    name[len] = '\0';
+    return 0;
+}
+
+
+static uint32_t name_hash(const char *name)
+{
+    uint32_t h = 2166136261u;	/* FNV-1a */
+
+    while (*name) 
+    {
+	h ^= (uint8_t)*name++;
+	h *= 16777619u;
+    }
+    return h;
+}
+
+
+static void free_dir_index(struct dir_index *ix)
+{
+    free(ix->slots);
+    ix->slots = NULL;
+    ix->image_buf = NULL;
+    ix->nslots = 0;
+    ix->nnames = 0;
+}
+
+
+/* add_name puts dirent in the table, unless the name is already there
+   (a linear search would find the first one too).  Returns -1 if out
+   of memory. */
+static int add_name(struct dir_index *ix, struct direntry *dirent)
+{
+    char name[13];
+    uint32_t h, i;
+
+    if (2 * (ix->nnames + 1) > ix->nslots) 
+    {
+	/* keep the table at most half full */
+	struct dir_slot *old = ix->slots;
+	uint32_t oldn = ix->nslots;
+
+	ix->nslots = oldn ? oldn * 2 : 64;
+	ix->slots = calloc(ix->nslots, sizeof(struct dir_slot));
+	if (ix->slots == NULL) 
+	{
+	    ix->slots = old;
+	    ix->nslots = oldn;
+	    return -1;
+	}
+	for (i = 0; i < oldn; i++) 
+	{
+	    uint32_t j;
+	    if (old[i].dirent == NULL)
+		continue;
+	    for (j = old[i].hash & (ix->nslots - 1); ix->slots[j].dirent != NULL;
+		 j = (j + 1) & (ix->nslots - 1))
+		;
+	    ix->slots[j] = old[i];
+	}
+	free(old);
+    }
+
+    dirent_name(dirent, name);
+    h = name_hash(name);
+    for (i = h & (ix->nslots - 1); ix->slots[i].dirent != NULL; 
+	 i = (i + 1) & (ix->nslots - 1)) 
+    {
+	if (ix->slots[i].hash == h && strcmp(ix->slots[i].name, name) == 0)
+	    return 0;
+    }
+    ix->slots[i].hash = h;
+    strcpy(ix->slots[i].name, name);
+    ix->slots[i].dirent = dirent;
+    ix->nnames++;
+    return 0;
+}
+
+
+/* index_entries adds the live entries among n starting at dirent.
+   Returns 1 if it reached the end-of-directory marker, 0 if not, -1
+   if out of memory. */
+static int index_entries(struct dir_index *ix, struct direntry *dirent, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++, dirent++) 
+    {
+	uint8_t c = dirent->deName[0];
+
+	STATS_ADD(dirents, 1);
+	if (c == SLOT_EMPTY)
+	    return 1;
+	if (c == SLOT_DELETED || c == '.')
+	    continue;
+	if ((dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN)
+	    continue;
+	if (add_name(ix, dirent) < 0)
+	    return -1;
+    }
+    return 0;
+}
+
+
+/* build_dir_index reads the whole directory starting at cluster into
+   ix.  Returns 0, or -1 if out of memory. */
+static int build_dir_index(struct dir_index *ix, uint32_t cluster,
+			   uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint32_t steps = 0, max_clusters = total_clusters(bpb);
+    int nents, rv;
+
+    ix->cluster = cluster;
+    if (cluster == MSDOSFSROOT) 
+    {
+	rv = index_entries(ix, (struct direntry*)cluster_to_addr(cluster, image_buf, bpb),
+			   bpb->bpbRootDirEnts);
+	return rv < 0 ? -1 : 0;
+    }
+
+    nents = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) / sizeof(struct direntry);
+    while (is_valid_cluster(cluster, bpb) && steps++ < max_clusters) 
+    {
+	rv = index_entries(ix, (struct direntry*)cluster_to_addr(cluster, image_buf, bpb), 
+			   nents);
+	if (rv < 0)
+	    return -1;
+	if (rv > 0)
+	    break;
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+    }
+    return 0;
+}
+
+
+/* get_dir_index returns the index for the directory starting at
+   cluster, building it if it isn't cached.  It belongs to the cache,
+   and stays valid until the next call. */
+static struct dir_index *get_dir_index(uint32_t cluster, uint8_t *image_buf, 
+				       struct bpb33 *bpb)
+{
+    struct dir_index *ix = &dir_cache[cluster % DIR_INDEX_SLOTS];
+    uint32_t generation = __atomic_load_n(&dir_generation, __ATOMIC_ACQUIRE);
+    uint32_t volume = get_fat_generation(bpb) >> 32;
+
+    /* the same address may have been reused for another image since */
+    if (ix->image_buf == image_buf && ix->cluster == cluster 
+	&& ix->generation == generation && ix->volume == volume)
+	return ix;
+
+    free_dir_index(ix);
+    if (build_dir_index(ix, cluster, image_buf, bpb) < 0) 
+    {
+	free_dir_index(ix);
+	return NULL;
+    }
+    ix->image_buf = image_buf;
+    ix->generation = generation;
+    ix->volume = volume;
+    return ix;
+}
+
+
+/* dir_lookup finds name in the directory starting at cluster.  The
+   whole directory is indexed, so a name that isn't there is answered
+   from the index too.  Returns NULL if there's no such entry. */
+struct direntry *dir_lookup(uint32_t cluster, const char *name,
+			    uint8_t *image_buf, struct bpb33 *bpb)
+{
+    struct dir_index *ix;
+    char norm[13];
+    uint32_t h, i;
+
+    if (normalize_name(name, strlen(name), norm) < 0)
+	return NULL;
+    ix = get_dir_index(cluster, image_buf, bpb);
+    if (ix == NULL || ix->nslots == 0)
+	return NULL;
+
+    h = name_hash(norm);
+    for (i = h & (ix->nslots - 1); ix->slots[i].dirent != NULL; 
+	 i = (i + 1) & (ix->nslots - 1)) 
+    {
+	if (ix->slots[i].hash == h && strcmp(ix->slots[i].name, norm) == 0)
+	    return ix->slots[i].dirent;
+    }
+    return NULL;
+}
+
+
+/* walk_path looks up every component of path except the last,
+   starting from the root, and leaves the directory they lead to in
+   *cluster and the last component in *leaf.  Slashes can be either
+   way round.  Returns 0, or -1 if some component isn't a directory. */
+static int walk_path(const char *path, uint32_t *cluster, const char **leaf,
+		     uint8_t *image_buf, struct bpb33 *bpb)
+{
+    char part[MAXPATHLEN+1];
+    const char *end;
+    struct direntry *dirent;
+    size_t len;
+
+    *cluster = root_cluster(bpb);
+    while (1) 
+    {
+	while (*path == '/' || *path == '\\')
+	    path++;
+	for (end = path; *end != '\0' && *end != '/' && *end != '\\'; end++)
+	    ;
+	if (*end == '\0')
+	    break;
+
+	/* an intermediate component must be a directory */
+	len = end - path;
+	if (len > MAXPATHLEN)
+	    return -1;
+	memcpy(part, path, len);
+	part[len] = '\0';
+	dirent = dir_lookup(*cluster, part, image_buf, bpb);
+	if (dirent == NULL || (dirent->deAttributes & ATTR_DIRECTORY) == 0)
+	    return -1;
+	*cluster = get_start_cluster(dirent, bpb);
+	if (*cluster == MSDOSFSROOT)
+	    *cluster = root_cluster(bpb);
+	path = end;
+    }
+    *leaf = path;
+    return 0;
+}
+
+
+/* path_lookup returns the directory entry for path, or NULL if there
+   isn't one */
+struct direntry *path_lookup(const char *path, uint8_t *image_buf, 
+			     struct bpb33 *bpb)
+{
+    uint32_t cluster;
+    const char *leaf;
+
+    if (walk_path(path, &cluster, &leaf, image_buf, bpb) < 0 || *leaf == '\0')
+	return NULL;
+    return dir_lookup(cluster, leaf, image_buf, bpb);
+}
+
+
+/* path_parent finds the directory path would be created in.  Returns
+   0 with its first cluster in *cluster and the name to create in
+   *leaf, or -1 if the directory doesn't exist. */
+int path_parent(const char *path, uint32_t *cluster, const char **leaf,
+		uint8_t *image_buf, struct bpb33 *bpb)
+{
+    return walk_path(path, cluster, leaf, image_buf, bpb);
+}
+
+
+/* dir_index_add must be called after a new entry is written into the
+   directory starting at cluster, so the next lookup sees it.  If this
+   thread has the directory indexed, the name goes straight into the
+   index; if not, the index built on the next lookup will have it.  If
+   adding fails, the index is dropped. */
+void dir_index_add(uint32_t cluster, struct direntry *dirent,
+		   uint8_t *image_buf, struct bpb33 *bpb)
+{
+    struct dir_index *ix = &dir_cache[cluster % DIR_INDEX_SLOTS];
+
+    if (ix->image_buf != image_buf || ix->cluster != cluster
+	|| ix->volume != get_fat_generation(bpb) >> 32)
+	return;
+    if (add_name(ix, dirent) < 0)
+	free_dir_index(ix);
+}
+
+
+/* dir_index_invalidate must be called after anything else changes a
+   directory (deletes or renames an entry, or moves its clusters), so
+   every thread's next lookup reads it afresh */
+void dir_index_invalidate(void)
+{
+    __atomic_add_fetch(&dir_generation, 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,39 @@
+#ifndef __DIRINDEX_H__
+#define __DIRINDEX_H__
+
+#include <stdint.h>
+
+struct bpb33;
+struct direntry;
+
+/* hash index of the names in one directory, built the first time the
+   directory is searched.  Names are kept the way path lookups spell
+   them: upper case, NAME.EXT for files and NAME for directories. */
+struct dir_slot {
+    uint32_t hash;
+    char name[13];
+    struct direntry *dirent;	/* NULL if the slot is unused */
+};
+
+struct dir_index {
+    uint8_t *image_buf;
+    uint32_t cluster;		/* first cluster, MSDOSFSROOT for a FAT12/16 root */
+    uint32_t generation;	/* dir_index_invalidate count it was built at */
+    uint32_t volume;		/* top half of get_fat_generation: which volume */
+    uint32_t nslots;		/* a power of two */
+    uint32_t nnames;
+    struct dir_slot *slots;
+};
+
+/* prototypes for functions in dirindex.c */
+
+void dirent_name(struct direntry *, char *);
+
+struct direntry *dir_lookup(uint32_t, const char *, uint8_t *, struct bpb33 *);
+struct direntry *path_lookup(const char *, uint8_t *, struct bpb33 *);
+int path_parent(const char *, uint32_t *, const char **, uint8_t *, struct bpb33 *);
+
+void dir_index_add(uint32_t, struct direntry *, uint8_t *, struct bpb33 *);
+void dir_index_invalidate(void);
+
+#endif // __DIRINDEX_H__
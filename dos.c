@@ -13,88 +13,331 @@
 #include "direntry.h"
 #include "fat.h"
 #include "dos.h"
+#include "bitset.h"
+#include "fat12.h"
+#include "sparse.h"
+#include "stats.h"
+
+
+/* decoded copy of a FAT12 FAT.  fat_open unpacks the whole FAT into
+   a fat_cache once, get_fat_entry and set_fat_entry work on the
+   array, and fat_close re-encodes only the 3-byte groups that were
+   changed.  Every thread reading the volume shares it; writes have
+   to come from one thread at a time. */
+struct fat_cache {
+    uint32_t entries;		/* number of cached entries */
+    uint16_t *entry;
+    uint8_t *dirty;		/* one flag per pair of entries */
+    int ndirty;
+};
+
+/* what fat_open works out about the volume.  It's allocated around
+   the struct bpb33 in the fat_volume, so the rest of dos.c can find
+   it from the bpb pointer every caller already passes around. */
+struct fat_geometry {
+    struct bpb33 bpb;		/* must come first */
+    int fat_type;		/* 12, 16 or 32 */
+    uint32_t total_sectors;
+    uint32_t fat_sectors;	/* sectors per FAT */
+    uint32_t clusters;		/* highest cluster number + 1 */
+    uint32_t cluster_size;	/* in bytes */
+    uint32_t root_cluster;	/* FAT32: first cluster of the root */
+    size_t fat_offset;		/* byte offsets in the image */
+    size_t root_offset;
+    size_t data_offset;
+    size_t fsinfo_offset;	/* FAT32: the FSInfo block, 0 if none */
+    uint8_t *image_buf;
+    struct fat_volume *vol;	/* NULL for fat_layout's */
+    struct fat_cache *cache;	/* FAT12 only */
+
+    /* sparse containers only (see sparse.h) */
+    struct sparse_header *sparse;
+    uint64_t *present;		/* which clusters are packed, from CLUST_FIRST */
+    uint32_t *rank;		/* how many are before each word of present */
+    uint8_t *packed;		/* the first packed cluster */
+    uint8_t *zero_cluster;	/* what the rest read as */
+};
+
+#define GEOMETRY(bpb) ((struct fat_geometry *)(bpb))
+
+#define FSINFO_SIG1 0x41615252
+#define FSINFO_SIG2 0x61417272
+
+/* how many volumes have been attached, which starts each one's
+   generation somewhere no other volume's has been */
+static uint32_t volumes_attached = 0;
+
+/* bump_generation notes that the FAT of g's volume might have
+   changed, so that anything built from it (extent maps) knows to
+   rebuild */
+static inline void bump_generation(struct fat_geometry *g)
+{
+    if (g->vol != NULL)
+	__atomic_add_fetch(&g->vol->fat_generation, 1, __ATOMIC_RELAXED);
+}
 
+static int bpb_layout(struct byte_bpb710 *bpb, struct fat_geometry *g);
+static int read_bootsector(uint8_t *image_buf, size_t size, struct fat_geometry *g);
+static int fat_cache_load(struct fat_geometry *g);
+static int read_sparse(struct fat_geometry *g, size_t size);
+static void fat_cache_flush(struct fat_geometry *g);
 
-static int imagesize = 0;
 
-/* memory map the FAT-12  disk image file */
-uint8_t *mmap_file(char *filename, int *fd)
+/* fat_open memory maps the disk image file, and reads its boot
+   sector.  flags says whether the image will be written, and how it
+   will be read (see dos.h).  Returns 0 with the new volume in *volp,
+   or a negative error for fat_strerror. */
+int fat_open(const char *filename, int flags, struct fat_volume **volp)
 {
     struct stat statbuf;
     uint8_t *image_buf;
-    char pathname[MAXPATHLEN+1];
+    size_t size;
+    int fd, rv, prot, mapflags;
 
+    fd = open(filename, (flags & FAT_RDONLY) ? O_RDONLY : O_RDWR);
+    if (fd < 0) 
+	return -errno;
 
-    /* If filename isn't an absolute pathname, then we'd better prepend
-       the current working directory to it */
-
-    if (filename[0] == '/') 
+    /* find out how big the disk image file is, and map all of it */
+    if (fstat(fd, &statbuf) < 0) 
     {
-	strncpy(pathname, filename, MAXPATHLEN);
-    } 
-    else 
+	rv = -errno;
+	close(fd);
+	return rv;
+    }
+    if (!S_ISREG(statbuf.st_mode) || statbuf.st_size < 512) 
     {
-	getcwd(pathname, MAXPATHLEN);
-	if (strlen(pathname) + strlen(filename) + 1 > MAXPATHLEN) 
-	{
-	    fprintf(stderr, "Filename too long\n");
-	    exit(1);
-	}
-	strcat(pathname, "/");
-	strcat(pathname, filename);
+	close(fd);
+	return -FAT_ENOTIMAGE;
     }
+    size = statbuf.st_size;
+
+    prot = (flags & FAT_RDONLY) ? PROT_READ : PROT_READ | PROT_WRITE;
+    mapflags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    /* fault the whole image in up front, rather than a page at a
+       time - but only if it's small enough not to matter */
+    if ((flags & FAT_POPULATE) && size <= FAT_POPULATE_LIMIT)
+	mapflags |= MAP_POPULATE;
+#endif
+    image_buf = mmap(NULL, size, prot, mapflags, fd, 0);
+    if (image_buf == MAP_FAILED) 
+    {
+	rv = -errno;
+	close(fd);
+	return rv;
+    }
+    if (flags & FAT_SEQUENTIAL)
+	madvise(image_buf, size, MADV_SEQUENTIAL);
+    else if (flags & FAT_RANDOM)
+	madvise(image_buf, size, MADV_RANDOM);
+
+    return fat_attach(image_buf, size, fd, flags, volp);
+}
 
 
-    /* Step 2: find out how big the disk image file is */
-    /* we can use "stat" to do this, by checking the file status */
+/* fat_attach makes a volume of an image that's already mapped at
+   image_buf, reading its boot sector.  The volume owns the mapping
+   and fd (which may be -1) from then on, even if it fails: fat_close
+   unmaps and closes them. */
+int fat_attach(uint8_t *image_buf, size_t size, int fd, int flags, 
+	       struct fat_volume **volp)
+{
+    struct fat_volume *vol;
+    int rv;
 
-    if (stat(pathname, &statbuf) < 0) 
+    vol = calloc(1, sizeof(struct fat_volume));
+    if (vol == NULL) 
+    {
+	munmap(image_buf, size);
+	if (fd >= 0)
+	    close(fd);
+	return -ENOMEM;
+    }
+    vol->image_buf = image_buf;
+    vol->size = size;
+    vol->fd = fd;
+    vol->flags = flags;
+    vol->fat_generation = (uint64_t)__atomic_add_fetch(&volumes_attached, 1,
+							__ATOMIC_RELAXED) << 32;
+
+    vol->geometry = calloc(1, sizeof(struct fat_geometry));
+    if (vol->geometry == NULL) 
     {
-	fprintf(stderr, "Cannot read disk image file %s:\n%s\n", 
-		pathname, strerror(errno));
-	exit(1);
+	rv = -ENOMEM;
+	goto fail;
+    }
+    vol->geometry->vol = vol;
+    vol->bpb = &vol->geometry->bpb;
+    rv = read_bootsector(vol->image_buf, vol->size, vol->geometry);
+    if (rv < 0)
+	goto fail;
+    rv = read_sparse(vol->geometry, vol->size);
+    if (rv < 0)
+	goto fail;
+    /* there's nowhere to put a cluster that isn't packed already */
+    if (vol->geometry->sparse != NULL && !(flags & FAT_RDONLY)) 
+    {
+	rv = -FAT_ESPARSERO;
+	goto fail;
     }
-    imagesize = statbuf.st_size;
 
+    *volp = vol;
+    return 0;
 
-    /* Step 3: open the file for read/write */
+ fail:
+    fat_close(vol);
+    return rv;
+}
 
-    *fd = open(pathname, O_RDWR);
-    if (*fd < 0) 
+
+/* fat_layout works out from just the boot sector how big the volume
+   is, and where its data area starts - everything before that being
+   the boot sector, FATs and root directory */
+int fat_layout(uint8_t *bootsector, uint64_t *size, size_t *data_offset)
+{
+    struct fat_geometry g;
+    int rv;
+
+    memset(&g, 0, sizeof(g));
+    rv = bpb_layout((struct byte_bpb710*)((struct bootsector33*)bootsector)->bsBPB, &g);
+    if (rv < 0)
+	return rv;
+    *size = (uint64_t)g.total_sectors * g.bpb.bpbBytesPerSec;
+    *data_offset = g.data_offset;
+    return 0;
+}
+
+
+/* fat_close writes back anything still cached, and unmaps the image */
+void fat_close(struct fat_volume *vol)
+{
+    struct fat_geometry *g = vol->geometry;
+
+    if (g != NULL && g->cache != NULL) 
     {
-	fprintf(stderr, "Cannot read disk image file %s:\n%s\n", 
-		pathname, strerror(errno));
-	exit(1);
+	fat_cache_flush(g);
+	free(g->cache->entry);
+	free(g->cache->dirty);
+	free(g->cache);
     }
+    if (g != NULL) 
+    {
+	free(g->present);
+	free(g->rank);
+	free(g->zero_cluster);
+    }
+    free(g);
 
+    if (vol->image_buf != MAP_FAILED)
+	munmap(vol->image_buf, vol->size);
+    if (vol->fd >= 0)
+	close(vol->fd);
+    free(vol);
+}
 
-    /* Step 4: we memory map the file */
 
-    image_buf = mmap(NULL, imagesize, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
-    if (image_buf == MAP_FAILED) 
+/* fat_strerror describes an error from fat_open or fat_attach */
+const char *fat_strerror(int err)
+{
+    switch (-err) 
     {
-	fprintf(stderr, "Failed to memory map: \n%s\n", strerror(errno));
-	exit(1);
+    case FAT_ENOTIMAGE:
+	return "not a disk image";
+    case FAT_EBOOTSECT:
+	return "bad boot sector";
+    case FAT_ESHORT:
+	return "image ends before the volume does";
+    case FAT_ESPARSE:
+	return "damaged sparse container";
+    case FAT_ESPARSERO:
+	return "sparse containers can only be read";
     }
-    return image_buf;
+    return strerror(-err);
 }
 
 
-void unmmap_file(uint8_t *image, int *fd)
+/* bpb_layout copies the BPB out of the boot sector and works out the
+   layout of the volume from it.  It only needs the boot sector
+   itself, so fat_read_head can size an image it hasn't read yet. */
+static int bpb_layout(struct byte_bpb710 *bpb, struct fat_geometry *g)
 {
-    munmap(image, imagesize);
-    close(*fd);
+    struct bpb33* bpb_aligned;
+    uint32_t root_sectors, data_sectors, fat_entries;
+
+    /* bpb is a byte-based struct, because this data is unaligned.
+       This makes it hard to access the multi-byte fields, so we copy
+       it to a slightly larger struct that is word-aligned */
+    bpb_aligned = &g->bpb;
+
+    bpb_aligned->bpbBytesPerSec = getushort(bpb->bpbBytesPerSec);
+    bpb_aligned->bpbSecPerClust = bpb->bpbSecPerClust;
+    bpb_aligned->bpbResSectors = getushort(bpb->bpbResSectors);
+    bpb_aligned->bpbFATs = bpb->bpbFATs;
+    bpb_aligned->bpbRootDirEnts = getushort(bpb->bpbRootDirEnts);
+    bpb_aligned->bpbSectors = getushort(bpb->bpbSectors);
+    bpb_aligned->bpbFATsecs = getushort(bpb->bpbFATsecs);
+    bpb_aligned->bpbHiddenSecs = getushort(bpb->bpbHiddenSecs);
+
+    /* work out the layout, and from the number of clusters whether
+       it's FAT12, FAT16 or FAT32 (the same rule DOS uses) */
+    g->total_sectors = bpb_aligned->bpbSectors;
+    if (g->total_sectors == 0)
+	g->total_sectors = getulong(bpb->bpbHugeSectors);
+    g->fat_sectors = bpb_aligned->bpbFATsecs;
+    if (g->fat_sectors == 0)
+	g->fat_sectors = getulong(bpb->bpbBigFATsecs);
+    g->fat_type = 12;
+    if (bpb_aligned->bpbBytesPerSec == 0 || bpb_aligned->bpbSecPerClust == 0) 
+    {
+	/* not a FAT file system */
+	return -FAT_EBOOTSECT;
+    }
+
+    root_sectors = (bpb_aligned->bpbRootDirEnts * sizeof(struct direntry)
+		    + bpb_aligned->bpbBytesPerSec - 1) / bpb_aligned->bpbBytesPerSec;
+    g->cluster_size = bpb_aligned->bpbBytesPerSec * bpb_aligned->bpbSecPerClust;
+    g->fat_offset = (size_t)bpb_aligned->bpbResSectors * bpb_aligned->bpbBytesPerSec;
+    g->root_offset = g->fat_offset 
+	+ (size_t)bpb_aligned->bpbFATs * g->fat_sectors * bpb_aligned->bpbBytesPerSec;
+    g->data_offset = g->root_offset + (size_t)root_sectors * bpb_aligned->bpbBytesPerSec;
+
+    data_sectors = (g->data_offset / bpb_aligned->bpbBytesPerSec < g->total_sectors) ?
+	g->total_sectors - g->data_offset / bpb_aligned->bpbBytesPerSec : 0;
+    g->clusters = data_sectors / bpb_aligned->bpbSecPerClust + CLUST_FIRST;
+    if (g->clusters < 4085 + CLUST_FIRST)
+	g->fat_type = 12;
+    else if (g->clusters < 65525 + CLUST_FIRST)
+	g->fat_type = 16;
+    else
+	g->fat_type = 32;
+
+    /* a FAT that's too short to describe every cluster limits the
+       ones we can use */
+    fat_entries = (uint32_t)(((uint64_t)g->fat_sectors * bpb_aligned->bpbBytesPerSec * 8) 
+			     / g->fat_type);
+    if (g->clusters > fat_entries)
+	g->clusters = fat_entries;
+    if (g->fat_type == 32 && g->clusters > (FAT32_MASK & CLUST_RSRVDS))
+	g->clusters = FAT32_MASK & CLUST_RSRVDS;
+
+    if (g->fat_type == 32)
+	g->root_cluster = getulong(bpb->bpbRootClust) & FAT32_MASK;
+    return 0;
 }
 
 
-/* read the bootsector from the disk, and check that it is sane */
+/* read the bootsector from the disk, and check that it is sane.
+   Returns 0, or a negative error if it can't be a FAT volume. */
 /* define DEBUG to see what the disk parameters actually are */
 
-struct bpb33* check_bootsector(uint8_t *image_buf)
+static int read_bootsector(uint8_t *image_buf, size_t size, struct fat_geometry *g)
 {
     struct bootsector33* bootsect;
-    struct byte_bpb33* bpb;  /* BIOS parameter block */
+    struct byte_bpb710* bpb;  /* BIOS parameter block */
     struct bpb33* bpb_aligned;
+    struct fsinfo *fsi;
+    int rv;
 
 #ifdef DEBUG
     fprintf(stderr, "Size of BPB: %lu\n", sizeof(struct bootsector33));
@@ -134,22 +377,15 @@ struct bpb33* check_bootsector(uint8_t *image_buf)
 		bootsect->bsBootSectSig1);
     }
 
-    bpb = (struct byte_bpb33*)&(bootsect->bsBPB[0]);
+    /* the DOS 3.3, 5.0 and 7.10 BPBs all start at the same place, and
+       each one extends the one before */
+    bpb = (struct byte_bpb710*)&(bootsect->bsBPB[0]);
 
-    /* bpb is a byte-based struct, because this data is unaligned.
-       This makes it hard to access the multi-byte fields, so we copy
-       it to a slightly larger struct that is word-aligned */
-    bpb_aligned = malloc(sizeof(struct bpb33));
-
-    bpb_aligned->bpbBytesPerSec = getushort(bpb->bpbBytesPerSec);
-    bpb_aligned->bpbSecPerClust = bpb->bpbSecPerClust;
-    bpb_aligned->bpbResSectors = getushort(bpb->bpbResSectors);
-    bpb_aligned->bpbFATs = bpb->bpbFATs;
-    bpb_aligned->bpbRootDirEnts = getushort(bpb->bpbRootDirEnts);
-    bpb_aligned->bpbSectors = getushort(bpb->bpbSectors);
-    bpb_aligned->bpbFATsecs = getushort(bpb->bpbFATsecs);
-    bpb_aligned->bpbHiddenSecs = getushort(bpb->bpbHiddenSecs);
-    
+    g->image_buf = image_buf;
+    bpb_aligned = &g->bpb;
+    rv = bpb_layout(bpb, g);
+    if (rv < 0)
+	return rv;
 
 #ifdef DEBUG
     fprintf(stderr, "Bytes per sector: %d\n", bpb_aligned->bpbBytesPerSec);
@@ -162,64 +398,301 @@ struct bpb33* check_bootsector(uint8_t *image_buf)
     fprintf(stderr, "Number of hidden sectors: %d\n", bpb_aligned->bpbHiddenSecs);
 #endif
 
-    return bpb_aligned;
+    if (g->data_offset > size) 
+    {
+	/* the FATs and root directory don't even fit in the image */
+	return -FAT_EBOOTSECT;
+    }
+
+    if (g->fat_type == 32) 
+    {
+	fsi = (struct fsinfo*)(image_buf 
+			       + (size_t)getushort(bpb->bpbFSInfo) * bpb_aligned->bpbBytesPerSec);
+	if (getushort(bpb->bpbFSInfo) != 0 
+	    && getushort(bpb->bpbFSInfo) < bpb_aligned->bpbResSectors
+	    && (uint32_t)getulong(fsi->fsisig1) == FSINFO_SIG1 
+	    && (uint32_t)getulong(fsi->fsisig2) == FSINFO_SIG2)
+	    g->fsinfo_offset = (uint8_t*)fsi - image_buf;
+    }
+
+#ifdef DEBUG
+    fprintf(stderr, "FAT type: FAT%d\n", g->fat_type);
+    if (g->fat_type == 32) 
+    {
+	fprintf(stderr, "Total number of sectors: %u\n", g->total_sectors);
+	fprintf(stderr, "Number of sectors per FAT: %u\n", g->fat_sectors);
+	fprintf(stderr, "Root directory cluster: %u\n", g->root_cluster);
+    }
+#endif
+
+    if (g->fat_type == 12)
+	return fat_cache_load(g);
+    return 0;
+}
+
+
+/* read_sparse checks whether the image is a sparse container, and if
+   so loads its bitmap and builds the rank index over it that
+   cluster_to_addr uses.  Returns 0 (whether it's one or not), or a
+   negative error if it's a damaged one. */
+static int read_sparse(struct fat_geometry *g, size_t size)
+{
+    struct sparse_header *h;
+    uint8_t *bitmap;
+    uint32_t nbits, i, npresent = 0;
+    uint64_t packed_offset, tail_offset, tail_len;
+
+    if (g->data_offset + sizeof(struct sparse_header) > size)
+	return 0;
+    h = (struct sparse_header*)(g->image_buf + g->data_offset);
+    if (memcmp(h->magic, SPARSE_MAGIC, sizeof(h->magic)) != 0)
+	return 0;
+
+    if (getulong(h->version) != SPARSE_VERSION 
+	|| getulong(h->cluster_size) != g->cluster_size
+	|| getulong(h->clusters) != g->clusters)
+	return -FAT_ESPARSE;
+    nbits = g->clusters - CLUST_FIRST;
+    bitmap = (uint8_t*)(h + 1);
+    if (g->data_offset + sizeof(*h) + (nbits + 7) / 8 > size)
+	return -FAT_ESPARSE;
+
+    g->present = bitset_alloc(nbits);
+    g->rank = calloc(BITSET_WORDS(nbits) + 1, sizeof(uint32_t));
+    g->zero_cluster = calloc(1, g->cluster_size);
+    if (g->present == NULL || g->rank == NULL || g->zero_cluster == NULL)
+	return -ENOMEM;
+    for (i = 0; i < nbits; i++) 
+    {
+	if (SPARSE_PRESENT(bitmap, i))
+	    bitset_set(g->present, i);
+    }
+    for (i = 0; i < BITSET_WORDS(nbits); i++) 
+    {
+	g->rank[i] = npresent;
+	npresent += __builtin_popcountll(g->present[i]);
+    }
+
+    /* everything it says is there has to be */
+    packed_offset = get64(h->packed_offset);
+    tail_offset = get64(h->tail_offset);
+    tail_len = get64(h->image_size) - get64(h->tail_start);
+    if (npresent != (uint32_t)getulong(h->npresent)
+	|| get64(h->tail_start) > get64(h->image_size)
+	|| packed_offset > size || tail_offset > size || tail_len > size
+	|| packed_offset + (uint64_t)npresent * g->cluster_size > tail_offset
+	|| tail_offset + tail_len != size)
+	return -FAT_ESPARSE;
+
+    g->sparse = h;
+    g->packed = g->image_buf + packed_offset;
+    return 0;
+}
+
+
+/* fat_sparse returns the header of a volume opened from a sparse
+   container, or NULL if it's an ordinary image */
+struct sparse_header *fat_sparse(struct fat_volume *vol)
+{
+    return vol->geometry->sparse;
+}
+
+
+/* fat_cache_flush re-encodes the groups touched by set_fat_entry
+   back into the image, a run of them at a time */
+static void fat_cache_flush(struct fat_geometry *g)
+{
+    struct fat_cache *c = g->cache;
+    uint32_t groups, i, start;
+
+    if (c->ndirty == 0)
+	return;
+
+    groups = c->entries / 2;
+    for (i = 0; i < groups; i++) 
+    {
+	if (!c->dirty[i])
+	    continue;
+	for (start = i; i < groups && c->dirty[i]; i++)
+	    c->dirty[i] = 0;
+	fat12_pack(c->entry + 2*start, g->image_buf + g->fat_offset + 3*start, i - start);
+    }
+    c->ndirty = 0;
+}
+
+
+/* fat_cache_load decodes every complete 3-byte group of the FAT into
+   a new cache, two 12-bit entries per group.  Returns 0, or -ENOMEM. */
+static int fat_cache_load(struct fat_geometry *g)
+{
+    uint32_t groups;
+    struct fat_cache *c;
+
+    c = calloc(1, sizeof(struct fat_cache));
+    if (c == NULL)
+	return -ENOMEM;
+    g->cache = c;
+
+    groups = (g->fat_sectors * g->bpb.bpbBytesPerSec) / 3;
+    c->entries = groups * 2;
+    c->entry = malloc(c->entries * sizeof(uint16_t));
+    c->dirty = calloc(groups, 1);
+    c->ndirty = 0;
+    if (c->entry == NULL || c->dirty == NULL)
+	return -ENOMEM;
+
+    fat12_unpack(g->image_buf + g->fat_offset, c->entry, groups);
+    bump_generation(g);
+    return 0;
 }
 
+
+/* flush_fat writes any FAT changes still held in the cache back into
+   the image, so the mapping is consistent before fat_close */
+void flush_fat(uint8_t *image_buf, struct bpb33 *bpb)
+{
+    if (GEOMETRY(bpb)->cache != NULL)
+	fat_cache_flush(GEOMETRY(bpb));
+}
+
+
+/* FAT values at or above the reserved range mean the same thing
+   whatever the width of the FAT.  fat_value widens them to the 32-bit
+   CLUST_ values in fat.h, so callers can compare against those
+   without knowing which FAT they're on. */
+static inline uint32_t fat_value(uint32_t value, uint32_t mask)
+{
+    if (value >= (mask & CLUST_RSRVDS))
+	value |= ~mask;
+    return value;
+}
+
+
 /* get_fat_entry returns the value from the FAT entry for
    clusternum. */
-uint16_t get_fat_entry(uint16_t clusternum, 
+uint32_t get_fat_entry(uint32_t clusternum, 
 		       uint8_t *image_buf, struct bpb33* bpb)
 {
-    uint32_t offset;
-    uint16_t value;
+    struct fat_geometry *g = GEOMETRY(bpb);
+    uint8_t *fat = image_buf + g->fat_offset;
+    size_t offset;
+    uint32_t value = 0;
     uint8_t b1, b2;
+    struct fat_cache *c;
+
+    STATS_ADD(fat_reads, 1);
+    switch (g->fat_type) 
+    {
+    case 16:
+	return fat_value(getushort(fat + 2 * (size_t)clusternum), FAT16_MASK);
+    case 32:
+	return fat_value(FAT32_MASK & getulong(fat + 4 * (size_t)clusternum), 
+			 FAT32_MASK);
+    }
+
+    c = g->cache;
+    if (c != NULL && clusternum < c->entries)
+	return fat_value(c->entry[clusternum], FAT12_MASK);
     
     /* this involves some really ugly bit shifting.  This probably
        only works on a little-endian machine. */
-    offset = bpb->bpbResSectors * bpb->bpbBytesPerSec * bpb->bpbSecPerClust 
-	+ (3 * (clusternum/2));
+    offset = 3 * (size_t)(clusternum/2);
     switch(clusternum % 2) 
     {
     case 0:
-	b1 = *(image_buf + offset);
-	b2 = *(image_buf + offset + 1);
+	b1 = *(fat + offset);
+	b2 = *(fat + offset + 1);
 
 	/* mjh: little-endian CPUs are ugly! */
 	value = ((0x0f & b2) << 8) | b1;
 	break;
     case 1:
-	b1 = *(image_buf + offset + 1);
-	b2 = *(image_buf + offset + 2);
+	b1 = *(fat + offset + 1);
+	b2 = *(fat + offset + 2);
 	value = b2 << 4 | ((0xf0 & b1) >> 4);
 	break;
     }
-    return value;
+    return fat_value(value, FAT12_MASK);
+}
+
+
+/* fsinfo_update keeps the FAT32 FSInfo hints in step when a FAT entry
+   goes from free to used or back */
+static void fsinfo_update(uint32_t clusternum, uint32_t old, uint32_t value,
+			  uint8_t *image_buf, struct fat_geometry *g)
+{
+    struct fsinfo *fsi;
+    uint32_t nfree;
+
+    if (g->fsinfo_offset == 0 || (old == CLUST_FREE) == (value == CLUST_FREE))
+	return;
+
+    fsi = (struct fsinfo*)(image_buf + g->fsinfo_offset);
+    nfree = getulong(fsi->fsinfree);
+    if (nfree != FSINFO_UNKNOWN) 
+    {
+	nfree = (value == CLUST_FREE) ? nfree + 1 : nfree - 1;
+	putulong(fsi->fsinfree, nfree);
+    }
+    if (value != CLUST_FREE)
+	putulong(fsi->fsinxtfree, clusternum + 1);
 }
 
 
 /* set_fat_entry sets the value of the FAT entry for clusternum to value. */
-void set_fat_entry(uint16_t clusternum, uint16_t value,
+void set_fat_entry(uint32_t clusternum, uint32_t value,
 		   uint8_t *image_buf, struct bpb33* bpb)
 {
-    uint32_t offset;
+    struct fat_geometry *g = GEOMETRY(bpb);
+    uint8_t *fat = image_buf + g->fat_offset;
+    size_t offset;
+    uint32_t old;
     uint8_t *p1, *p2;
+    struct fat_cache *c;
+
+    bump_generation(g);
+    STATS_ADD(fat_writes, 1);
+    switch (g->fat_type) 
+    {
+    case 16:
+	putushort(fat + 2 * (size_t)clusternum, FAT16_MASK & value);
+	return;
+    case 32:
+	/* the top four bits are reserved, and have to be kept */
+	p1 = fat + 4 * (size_t)clusternum;
+	old = getulong(p1);
+	putulong(p1, (old & ~FAT32_MASK) | (value & FAT32_MASK));
+	fsinfo_update(clusternum, old & FAT32_MASK, value & FAT32_MASK, image_buf, g);
+	return;
+    }
+
+    c = g->cache;
+    if (c != NULL && clusternum < c->entries) 
+    {
+	c->entry[clusternum] = FAT12_MASK & value;
+	if (!c->dirty[clusternum/2]) 
+	{
+	    c->dirty[clusternum/2] = 1;
+	    c->ndirty++;
+	}
+	return;
+    }
     
     /* this involves some really ugly bit shifting.  This probably
        only works on a little-endian machine. */
-    offset = bpb->bpbResSectors * bpb->bpbBytesPerSec * bpb->bpbSecPerClust 
-	+ (3 * (clusternum/2));
+    offset = 3 * (size_t)(clusternum/2);
     switch(clusternum % 2) 
     {
     case 0:
-	p1 = image_buf + offset;
-	p2 = image_buf + offset + 1;
+	p1 = fat + offset;
+	p2 = fat + offset + 1;
 	/* mjh: little-endian CPUs are really ugly! */
 	*p1 = (uint8_t)(0xff & value);
 	*p2 = (uint8_t)((0xf0 & (*p2)) | (0x0f & (value >> 8)));
 	break;
     case 1:
-	p1 = image_buf + offset + 1;
-	p2 = image_buf + offset + 2;
+	p1 = fat + offset + 1;
+	p2 = fat + offset + 2;
 	*p1 = (uint8_t)((0x0f & (*p1)) | ((0x0f & value) << 4));
 	*p2 = (uint8_t)(0xff & (value >> 4));
 	break;
@@ -227,13 +700,94 @@ void set_fat_entry(uint16_t clusternum, uint16_t value,
 }
 
 
-int is_valid_cluster(uint16_t cluster, struct bpb33 *bpb)
+/* get_fat_generation returns a number that changes every time the
+   volume's FAT is loaded or written.  The top half is the volume's, so
+   no two volumes, even at the same address one after the other, ever
+   have the same one. */
+uint64_t get_fat_generation(struct bpb33 *bpb)
 {
-    uint16_t max_cluster = (bpb->bpbSectors / bpb->bpbSecPerClust) & FAT12_MASK;
+    struct fat_volume *vol = GEOMETRY(bpb)->vol;
+
+    return vol != NULL ? __atomic_load_n(&vol->fat_generation, __ATOMIC_RELAXED) : 0;
+}
+
 
-    if (cluster >= (FAT12_MASK & CLUST_FIRST) && 
-        cluster <= (FAT12_MASK & CLUST_LAST) &&
-        cluster < max_cluster)
+/* fat_type returns 12, 16 or 32 */
+int fat_type(struct bpb33 *bpb)
+{
+    return GEOMETRY(bpb)->fat_type;
+}
+
+
+/* total_clusters returns one more than the highest cluster number on
+   the volume (clusters 0 and 1 don't exist, but are counted) */
+uint32_t total_clusters(struct bpb33 *bpb)
+{
+    return GEOMETRY(bpb)->clusters;
+}
+
+
+/* volume_size returns the size in bytes the boot sector says the
+   volume has */
+uint64_t volume_size(struct bpb33 *bpb)
+{
+    return (uint64_t)GEOMETRY(bpb)->total_sectors * bpb->bpbBytesPerSec;
+}
+
+
+/* root_cluster returns the first cluster of the root directory on
+   FAT32, or MSDOSFSROOT where the root is a fixed area */
+uint32_t root_cluster(struct bpb33 *bpb)
+{
+    struct fat_geometry *g = GEOMETRY(bpb);
+    return g->fat_type == 32 ? g->root_cluster : MSDOSFSROOT;
+}
+
+
+/* get_fsinfo reads the FAT32 free cluster count and next free cluster
+   hints.  Returns 0, or -1 if the volume has no FSInfo block.  Either
+   value can be FSINFO_UNKNOWN (0xffffffff). */
+int get_fsinfo(uint8_t *image_buf, struct bpb33 *bpb, 
+	       uint32_t *nfree, uint32_t *next_free)
+{
+    struct fat_geometry *g = GEOMETRY(bpb);
+    struct fsinfo *fsi;
+
+    if (g->fsinfo_offset == 0)
+	return -1;
+    fsi = (struct fsinfo*)(image_buf + g->fsinfo_offset);
+    *nfree = getulong(fsi->fsinfree);
+    *next_free = getulong(fsi->fsinxtfree);
+    return 0;
+}
+
+
+/* get_start_cluster returns the first cluster of a file or directory.
+   Only FAT32 has the high 16 bits. */
+uint32_t get_start_cluster(struct direntry *dirent, struct bpb33 *bpb)
+{
+    uint32_t cluster = getushort(dirent->deStartCluster);
+
+    if (GEOMETRY(bpb)->fat_type == 32)
+	cluster |= (uint32_t)getushort(dirent->deHighClust) << 16;
+    return cluster;
+}
+
+
+void set_start_cluster(struct direntry *dirent, uint32_t cluster, 
+		       struct bpb33 *bpb)
+{
+    putushort(dirent->deStartCluster, cluster & 0xffff);
+    if (GEOMETRY(bpb)->fat_type == 32)
+	putushort(dirent->deHighClust, (cluster >> 16) & 0xffff);
+}
+
+
+int is_valid_cluster(uint32_t cluster, struct bpb33 *bpb)
+{
+    if (cluster >= CLUST_FIRST && 
+        cluster <= CLUST_LAST &&
+        cluster < GEOMETRY(bpb)->clusters)
         return TRUE;
     return FALSE;
 }
@@ -241,10 +795,10 @@ int is_valid_cluster(uint16_t cluster, struct bpb33 *bpb)
 
 /* is_end_of_file returns true if the FAT entry for cluster indicates
    this is the last cluster in a file */
-int is_end_of_file(uint16_t cluster) 
+int is_end_of_file(uint32_t cluster) 
 {
-    if (cluster >= (FAT12_MASK & CLUST_EOFS) && 
-        cluster <= (FAT12_MASK & CLUST_EOFE)) 
+    if (cluster >= CLUST_EOFS && 
+        cluster <= CLUST_EOFE) 
     {
 	return TRUE;
     } 
@@ -259,29 +813,71 @@ int is_end_of_file(uint16_t cluster)
    start of the root directory, as indicated in the boot sector */
 uint8_t *root_dir_addr(uint8_t *image_buf, struct bpb33* bpb)
 {
-    uint32_t offset;
-    offset = 
-	(bpb->bpbBytesPerSec 
-	 * (bpb->bpbResSectors + (bpb->bpbFATs * bpb->bpbFATsecs)));
-    return image_buf + offset;
+    struct fat_geometry *g = GEOMETRY(bpb);
+
+    if (g->fat_type == 32)
+	return cluster_to_addr(g->root_cluster, image_buf, bpb);
+    return image_buf + g->root_offset;
+}
+
+
+/* sparse_cluster_addr finds a cluster in a sparse container: after
+   as many packed clusters as there are present before it */
+static uint8_t *sparse_cluster_addr(struct fat_geometry *g, uint32_t cluster)
+{
+    uint32_t bit, word;
+    uint64_t before;
+
+    if (cluster < CLUST_FIRST || cluster >= g->clusters)
+	return g->zero_cluster;
+    bit = cluster - CLUST_FIRST;
+    word = bit / BITS_PER_WORD;
+    if (!bitset_test(g->present, bit))
+	return g->zero_cluster;
+    before = g->present[word] & ((1ULL << (bit % BITS_PER_WORD)) - 1);
+    return g->packed 
+	+ (size_t)g->cluster_size * (g->rank[word] + __builtin_popcountll(before));
 }
 
 
 /* cluster_to_addr returns the memory location where the memory mapped
    cluster actually starts */
-uint8_t *cluster_to_addr(uint16_t cluster, uint8_t *image_buf, 
+uint8_t *cluster_to_addr(uint32_t cluster, uint8_t *image_buf, 
 			 struct bpb33* bpb)
 {
-    uint8_t *p;
-    p = root_dir_addr(image_buf, bpb);
-    if (cluster != MSDOSFSROOT) 
-    {
-	/* move to the end of the root directory */
-	p += bpb->bpbRootDirEnts * sizeof(struct direntry);
+    struct fat_geometry *g = GEOMETRY(bpb);
 
-	/* move forward the right number of clusters */
-	p += bpb->bpbBytesPerSec * bpb->bpbSecPerClust * (cluster - CLUST_FIRST);
+    STATS_ADD(clusters, 1);
+    if (cluster == MSDOSFSROOT) 
+    {
+	if (g->fat_type != 32)
+	    return image_buf + g->root_offset;
+	cluster = g->root_cluster;
     }
-    return p;
+
+    if (g->sparse != NULL)
+	return sparse_cluster_addr(g, cluster);
+
+    /* move forward the right number of clusters from the end of the
+       root directory */
+    return image_buf + g->data_offset 
+	+ (size_t)g->cluster_size * (cluster - CLUST_FIRST);
 }
 
+
+/* cluster_in_image says whether the data of cluster is in the image
+   file, at the offset cluster_to_addr gives less image_buf.  In a
+   sparse container a cluster that was left out isn't: it reads as
+   zeros from a buffer of its own, which can't be copied from the file
+   or run on into the next cluster. */
+int cluster_in_image(uint32_t cluster, struct bpb33 *bpb)
+{
+    struct fat_geometry *g = GEOMETRY(bpb);
+
+    if (g->sparse == NULL)
+	return TRUE;
+    if (cluster == MSDOSFSROOT && g->fat_type == 32)
+	cluster = g->root_cluster;
+    return cluster >= CLUST_FIRST && cluster < g->clusters
+	&& bitset_test(g->present, cluster - CLUST_FIRST);
+}
@@ -9,24 +9,77 @@
 #define FALSE (0)
 #endif
 
+/* a FAT32 FSInfo hint that hasn't been filled in */
+#define FSINFO_UNKNOWN 0xffffffff
+
 /* prototypes for functions in dos.c */
 
 #include <stdint.h>
+#include <stddef.h>
+
+struct bpb33;
+struct direntry;
+struct fat_geometry;
+struct sparse_header;
+
+/* an open disk image.  Everything dos.c knows about the volume hangs
+   off it, so a process can have any number open at once. */
+struct fat_volume {
+    uint8_t *image_buf;		/* the whole image, memory mapped */
+    size_t size;
+    int fd;
+    int flags;			/* as passed to fat_open */
+    struct bpb33 *bpb;		/* the boot sector's parameters */
+    struct fat_geometry *geometry;	/* and the layout worked out from them */
+    uint64_t fat_generation;	/* see get_fat_generation */
+};
+
+/* fat_open flags.  A read-only volume only needs read access to the
+   image, and nothing may write to it.  The others are hints about how
+   it'll be read: mostly in order, all over the place, or all of it
+   soon (which only applies to images up to FAT_POPULATE_LIMIT). */
+#define FAT_RDONLY	0x01
+#define FAT_SEQUENTIAL	0x02
+#define FAT_RANDOM	0x04
+#define FAT_POPULATE	0x08
+
+#define FAT_POPULATE_LIMIT (64 << 20)
+
+/* fat_open errors that aren't an errno */
+#define FAT_ENOTIMAGE 1000	/* not a regular file, or too small */
+#define FAT_EBOOTSECT 1001	/* boot sector doesn't describe a FAT volume */
+#define FAT_ESHORT 1002		/* streamed image ended early */
+#define FAT_ESPARSE 1003	/* sparse container doesn't add up */
+#define FAT_ESPARSERO 1004	/* sparse container opened for writing */
+
+int fat_open(const char *, int, struct fat_volume **);
+int fat_attach(uint8_t *, size_t, int, int, struct fat_volume **);
+int fat_layout(uint8_t *, uint64_t *, size_t *);
+struct sparse_header *fat_sparse(struct fat_volume *);
+void fat_close(struct fat_volume *);
+const char *fat_strerror(int);
 
-uint8_t *mmap_file(char *, int *);
-void unmmap_file(uint8_t *, int *);
+uint32_t get_fat_entry(uint32_t, uint8_t *, struct bpb33 *);
 
-struct bpb33* check_bootsector(uint8_t *);
+void set_fat_entry(uint32_t, uint32_t, uint8_t *, struct bpb33 *);
+uint64_t get_fat_generation(struct bpb33 *);
+void flush_fat(uint8_t *, struct bpb33 *);
 
-uint16_t get_fat_entry(uint16_t, uint8_t *, struct bpb33 *);
+int fat_type(struct bpb33 *);
+uint32_t total_clusters(struct bpb33 *);
+uint64_t volume_size(struct bpb33 *);
+uint32_t root_cluster(struct bpb33 *);
+int get_fsinfo(uint8_t *, struct bpb33 *, uint32_t *, uint32_t *);
 
-void set_fat_entry(uint16_t, uint16_t, uint8_t *, struct bpb33 *);
+uint32_t get_start_cluster(struct direntry *, struct bpb33 *);
+void set_start_cluster(struct direntry *, uint32_t, struct bpb33 *);
 
-int is_end_of_file(uint16_t);
-int is_valid_cluster(uint16_t, struct bpb33 *);
+int is_end_of_file(uint32_t);
+int is_valid_cluster(uint32_t, struct bpb33 *);
 
 uint8_t *root_dir_addr(uint8_t *, struct bpb33 *);
 
-uint8_t *cluster_to_addr(uint16_t, uint8_t *, struct bpb33 *);
+uint8_t *cluster_to_addr(uint32_t, uint8_t *, struct bpb33 *);
+int cluster_in_image(uint32_t, struct bpb33 *);
 
 #endif // __DOS_H__
@@ -0,0 +1,644 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "synth.h"
+#include "fat12.h"
+
+
+/* dos_bench times the primitives in dos.c.  Each benchmark is run
+   once to warm up and then runs times, pinned to one CPU, and is
+   reported as ns per operation (min, median, 90th and 99th
+   percentile over the runs) and as operations per second at the
+   median.  The results can be written as JSON, one result per line,
+   and compared against an earlier file: a median more than the
+   tolerance slower than the baseline's is a regression.
+
+   Images are copied into memory before they're timed, so
+   set_fat_entry never touches the file.  "synth:<fat type>:<MiB>"
+   instead of a file name builds a volume in memory, full of
+   fragmented files.
+
+   The FAT12 unpack and pack kernels (see fat12.h) are checked against
+   the plain one and timed first, over a buffer much bigger than the
+   caches, as "kernel:<name>". */
+
+#define DEFAULT_RUNS 21
+#define DEFAULT_TOLERANCE 10	/* percent */
+#define MAX_RESULTS 256
+
+struct result {
+    char image[64];
+    char bench[32];
+    uint64_t ops;		/* per run */
+    double min, p50, p90, p99;	/* ns per op */
+};
+
+/* what a benchmark runs over */
+struct target {
+    const char *name;
+    struct fat_volume *vol;
+    uint8_t *image_buf;
+    struct bpb33 *bpb;
+    uint32_t clusters;		/* total_clusters */
+    uint32_t *random;		/* NRANDOM cluster numbers, in no order */
+    uint32_t *heads;		/* first cluster of every chain a directory points to */
+    uint32_t nheads;
+};
+
+#define NRANDOM (1 << 20)
+
+/* 24MB packed, 32MB unpacked */
+#define KERNEL_GROUPS (1 << 23)
+
+static struct result results[MAX_RESULTS];
+static int nresults = 0;
+static int runs = DEFAULT_RUNS;
+
+/* the FAT12 kernel being timed, and what it works on */
+static const struct fat12_kernel *kernel;
+static uint8_t *packed;
+static uint16_t *unpacked;
+
+/* keeps the compiler from throwing away what's being timed */
+static volatile uint64_t sink;
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+
+/* xorshift, so every run and every machine gets the same clusters */
+static uint32_t next_random(uint32_t *state)
+{
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+
+/* the benchmarks.  Each does one run, and returns how many operations
+   it did. */
+
+static uint64_t bench_get_fat_entry(struct target *t)
+{
+    uint64_t sum = 0;
+    uint32_t i;
+
+    for (i = 0; i < NRANDOM; i++)
+	sum += get_fat_entry(t->random[i], t->image_buf, t->bpb);
+    sink = sum;
+    return NRANDOM;
+}
+
+
+static uint64_t bench_set_fat_entry(struct target *t)
+{
+    uint32_t i, c;
+
+    /* write back what's there, so the volume doesn't change */
+    for (i = 0; i < NRANDOM; i++)
+    {
+	c = t->random[i];
+	set_fat_entry(c, get_fat_entry(c, t->image_buf, t->bpb), t->image_buf, t->bpb);
+    }
+    return NRANDOM;
+}
+
+
+static uint64_t bench_cluster_to_addr(struct target *t)
+{
+    uintptr_t sum = 0;
+    uint32_t i;
+
+    for (i = 0; i < NRANDOM; i++)
+	sum += (uintptr_t)cluster_to_addr(t->random[i], t->image_buf, t->bpb);
+    sink = sum;
+    return NRANDOM;
+}
+
+
+static uint64_t bench_is_valid_cluster(struct target *t)
+{
+    uint64_t sum = 0;
+    uint32_t i;
+
+    /* the random clusters are all valid; flip some into the reserved
+       and end-of-chain ranges */
+    for (i = 0; i < NRANDOM; i++)
+	sum += is_valid_cluster(t->random[i] | ((i & 7) == 0 ? 0xfffffff0 : 0), t->bpb);
+    sink = sum;
+    return NRANDOM;
+}
+
+
+static uint64_t bench_chain_walk(struct target *t)
+{
+    uint64_t links = 0;
+    uint32_t i, c, steps;
+
+    for (i = 0; i < t->nheads; i++)
+    {
+	c = t->heads[i];
+	for (steps = 0; is_valid_cluster(c, t->bpb) && steps < t->clusters; steps++)
+	    c = get_fat_entry(c, t->image_buf, t->bpb);
+	links += steps;
+    }
+    return links;
+}
+
+
+/* scan_dir visits every slot of the directory starting at cluster and
+   of the ones under it, the way the tools do.  Returns the number of
+   slots, and if heads isn't NULL records every chain it finds. */
+static uint64_t scan_dir(struct target *t, uint32_t cluster, uint32_t *heads,
+			 uint32_t *nheads, int depth)
+{
+    struct direntry *dirent;
+    uint64_t slots = 0;
+    uint32_t start, steps = 0;
+    int i, nents;
+
+    if (depth > 64)
+	return 0;
+    if (cluster == MSDOSFSROOT && fat_type(t->bpb) != 32)
+	nents = t->bpb->bpbRootDirEnts;
+    else
+	nents = (t->bpb->bpbBytesPerSec * t->bpb->bpbSecPerClust) / sizeof(struct direntry);
+
+    for (;;)
+    {
+	dirent = (struct direntry*)cluster_to_addr(cluster, t->image_buf, t->bpb);
+	for (i = 0; i < nents; i++, dirent++)
+	{
+	    slots++;
+	    if (dirent->deName[0] == SLOT_EMPTY)
+		return slots;
+	    if (dirent->deName[0] == SLOT_DELETED || dirent->deName[0] == '.'
+		|| (dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN
+		|| (dirent->deAttributes & ATTR_VOLUME))
+		continue;
+	    start = get_start_cluster(dirent, t->bpb);
+	    if (!is_valid_cluster(start, t->bpb))
+		continue;
+	    if (heads != NULL && *nheads < t->clusters)
+		heads[(*nheads)++] = start;
+	    if (dirent->deAttributes & ATTR_DIRECTORY)
+		slots += scan_dir(t, start, heads, nheads, depth + 1);
+	}
+	if (cluster == MSDOSFSROOT && fat_type(t->bpb) != 32)
+	    return slots;
+	if (cluster == MSDOSFSROOT)
+	    cluster = root_cluster(t->bpb);
+	cluster = get_fat_entry(cluster, t->image_buf, t->bpb);
+	if (!is_valid_cluster(cluster, t->bpb) || steps++ >= t->clusters)
+	    return slots;
+    }
+}
+
+
+static uint64_t bench_dir_scan(struct target *t)
+{
+    return scan_dir(t, MSDOSFSROOT, NULL, NULL, 0);
+}
+
+
+static uint64_t bench_fat12_unpack(struct target *t)
+{
+    kernel->unpack(packed, unpacked, KERNEL_GROUPS);
+    return 2 * KERNEL_GROUPS;
+}
+
+
+static uint64_t bench_fat12_pack(struct target *t)
+{
+    kernel->pack(unpacked, packed, KERNEL_GROUPS);
+    return 2 * KERNEL_GROUPS;
+}
+
+
+static struct {
+    const char *name;
+    uint64_t (*run)(struct target *);
+} benchmarks[] = {
+    { "get_fat_entry", bench_get_fat_entry },
+    { "set_fat_entry", bench_set_fat_entry },
+    { "cluster_to_addr", bench_cluster_to_addr },
+    { "is_valid_cluster", bench_is_valid_cluster },
+    { "chain_walk", bench_chain_walk },
+    { "dir_scan", bench_dir_scan },
+};
+
+#define NBENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+
+/* time runs one benchmark over t, and records the result */
+static void time_bench(struct target *t, const char *name, uint64_t (*run)(struct target *))
+{
+    struct result *r;
+    double *per_op;
+    uint64_t start, ops = 0;
+    int i;
+
+    if (nresults == MAX_RESULTS)
+	return;
+    per_op = malloc(runs * sizeof(double));
+    if (per_op == NULL)
+    {
+	fprintf(stderr, "Out of memory\n");
+	exit(1);
+    }
+
+    run(t);
+    for (i = 0; i < runs; i++)
+    {
+	start = now_ns();
+	ops = run(t);
+	per_op[i] = ops > 0 ? (double)(now_ns() - start) / ops : 0;
+    }
+    qsort(per_op, runs, sizeof(double), compare_doubles);
+
+    r = &results[nresults++];
+    snprintf(r->image, sizeof(r->image), "%s", t->name);
+    snprintf(r->bench, sizeof(r->bench), "%s", name);
+    r->ops = ops;
+    r->min = per_op[0];
+    r->p50 = per_op[runs / 2];
+    r->p90 = per_op[(runs * 9) / 10];
+    r->p99 = per_op[(runs * 99) / 100];
+    free(per_op);
+
+    printf("%-20s %-18s %10.2f %10.2f %10.2f %10.2f %12.2f\n",
+	   r->image, r->bench, r->min, r->p50, r->p90, r->p99,
+	   r->p50 > 0 ? 1000.0 / r->p50 : 0);
+}
+
+
+/* check_kernels makes sure every FAT12 kernel turns random bytes and
+   entries into exactly what the plain one does, at every length up to
+   a few of its blocks and from odd addresses.  Returns the name of
+   one that doesn't, or NULL. */
+static const char *check_kernels(const struct fat12_kernel *k, int nkernels)
+{
+    uint8_t bytes[3 * 64 + 1], want_bytes[3 * 64], got_bytes[3 * 64 + 1];
+    uint16_t entries[2 * 64 + 1], want[2 * 64], got[2 * 64 + 1];
+    uint32_t seed = 12345;
+    size_t groups, i;
+    int j, skew;
+
+    for (i = 0; i < sizeof(bytes); i++)
+	bytes[i] = next_random(&seed);
+    for (i = 0; i < sizeof(entries) / sizeof(entries[0]); i++)
+	entries[i] = next_random(&seed);
+
+    for (j = 1; j < nkernels; j++)
+    {
+	for (skew = 0; skew < 2; skew++)
+	{
+	    for (groups = 0; groups <= 64; groups++)
+	    {
+		memset(got, 0, sizeof(got));
+		k[0].unpack(bytes + skew, want, groups);
+		k[j].unpack(bytes + skew, got, groups);
+		if (memcmp(want, got, groups * 2 * sizeof(uint16_t)) != 0 
+		    || got[2 * groups] != 0)
+		    return k[j].name;
+
+		memset(got_bytes, 0, sizeof(got_bytes));
+		k[0].pack(entries + skew, want_bytes, groups);
+		k[j].pack(entries + skew, got_bytes, groups);
+		if (memcmp(want_bytes, got_bytes, groups * 3) != 0
+		    || got_bytes[groups * 3] != 0)
+		    return k[j].name;
+	    }
+	}
+    }
+
+    /* and the whole buffer there and back */
+    for (i = 0; i < 3 * (size_t)KERNEL_GROUPS; i++)
+	packed[i] = next_random(&seed);
+    k[0].unpack(packed, unpacked, KERNEL_GROUPS);
+    for (j = 1; j < nkernels; j++)
+    {
+	k[j].pack(unpacked, packed + 3 * (size_t)KERNEL_GROUPS, KERNEL_GROUPS);
+	if (memcmp(packed, packed + 3 * (size_t)KERNEL_GROUPS, 3 * (size_t)KERNEL_GROUPS) != 0)
+	    return k[j].name;
+    }
+    return NULL;
+}
+
+
+/* time_kernels checks the FAT12 kernels, then times each one */
+static void time_kernels(void)
+{
+    const struct fat12_kernel *k;
+    const char *bad;
+    struct target t;
+    char name[64];
+    int j, nkernels;
+
+    k = fat12_kernels(&nkernels);
+    /* room for a second packed copy, to compare round trips */
+    packed = malloc(6 * (size_t)KERNEL_GROUPS);
+    unpacked = malloc(4 * (size_t)KERNEL_GROUPS);
+    if (packed == NULL || unpacked == NULL)
+    {
+	fprintf(stderr, "Out of memory\n");
+	exit(1);
+    }
+    bad = check_kernels(k, nkernels);
+    if (bad != NULL)
+    {
+	fprintf(stderr, "The %s FAT12 kernel doesn't match the scalar one\n", bad);
+	exit(1);
+    }
+
+    memset(&t, 0, sizeof(t));
+    t.name = name;
+    for (j = 0; j < nkernels; j++)
+    {
+	kernel = &k[j];
+	snprintf(name, sizeof(name), "kernel:%s", k[j].name);
+	time_bench(&t, "fat12_unpack", bench_fat12_unpack);
+	time_bench(&t, "fat12_pack", bench_fat12_pack);
+    }
+    free(packed);
+    free(unpacked);
+}
+
+
+/* load_image copies an image file into memory */
+static int load_image(const char *filename, struct fat_volume **volp)
+{
+    struct stat st;
+    uint8_t *image_buf;
+    size_t done = 0;
+    ssize_t n;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+	return -errno;
+    if (fstat(fd, &st) < 0 || st.st_size < 512)
+    {
+	close(fd);
+	return -FAT_ENOTIMAGE;
+    }
+    image_buf = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (image_buf == MAP_FAILED)
+    {
+	close(fd);
+	return -ENOMEM;
+    }
+    while (done < (size_t)st.st_size)
+    {
+	n = read(fd, image_buf + done, st.st_size - done);
+	if (n <= 0)
+	    break;
+	done += n;
+    }
+    close(fd);
+    return fat_attach(image_buf, st.st_size, -1, 0, volp);
+}
+
+
+/* synth_volume builds a volume of the given FAT type and size, with
+   a file for every 64K of it, interleaved in fours across a tree of
+   directories (see synth.h) */
+static int synth_volume(int type, uint32_t mib, struct fat_volume **volp)
+{
+    struct synth_spec spec;
+
+    synth_defaults(&spec);
+    spec.fat_type = type;
+    spec.size = (uint64_t)mib << 20;
+    spec.files = mib * 16;
+    spec.dirs = spec.files / 32;
+    spec.layout = SYNTH_INTERLEAVED;
+    spec.fill = FALSE;
+    return synth_image(&spec, volp);
+}
+
+
+static int open_target(const char *name, struct target *t)
+{
+    unsigned type, mib;
+    uint32_t i, seed = 12345;
+    int err;
+
+    memset(t, 0, sizeof(*t));
+    t->name = name;
+    if (sscanf(name, "synth:%u:%u", &type, &mib) == 2)
+	err = synth_volume(type, mib, &t->vol);
+    else
+	err = load_image(name, &t->vol);
+    if (err < 0)
+    {
+	fprintf(stderr, "Cannot read disk image file %s: %s\n", name, fat_strerror(err));
+	return -1;
+    }
+    t->image_buf = t->vol->image_buf;
+    t->bpb = t->vol->bpb;
+    t->clusters = total_clusters(t->bpb);
+
+    t->random = malloc(NRANDOM * sizeof(uint32_t));
+    t->heads = malloc(t->clusters * sizeof(uint32_t));
+    if (t->random == NULL || t->heads == NULL)
+    {
+	fprintf(stderr, "Out of memory\n");
+	exit(1);
+    }
+    for (i = 0; i < NRANDOM; i++)
+	t->random[i] = CLUST_FIRST + next_random(&seed) % (t->clusters - CLUST_FIRST);
+    scan_dir(t, MSDOSFSROOT, t->heads, &t->nheads, 0);
+    return 0;
+}
+
+
+static void close_target(struct target *t)
+{
+    free(t->random);
+    free(t->heads);
+    fat_close(t->vol);
+}
+
+
+static void write_json(const char *filename)
+{
+    FILE *f;
+    int i;
+
+    f = fopen(filename, "w");
+    if (f == NULL)
+    {
+	fprintf(stderr, "Cannot write %s: %s\n", filename, strerror(errno));
+	exit(1);
+    }
+    fprintf(f, "{\"runs\": %d, \"results\": [\n", runs);
+    for (i = 0; i < nresults; i++)
+    {
+	struct result *r = &results[i];
+	fprintf(f, "{\"image\": \"%s\", \"bench\": \"%s\", \"ops\": %llu, "
+		"\"ns_per_op\": {\"min\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f}, "
+		"\"mops_per_sec\": %.3f}%s\n",
+		r->image, r->bench, (unsigned long long)r->ops,
+		r->min, r->p50, r->p90, r->p99, r->p50 > 0 ? 1000.0 / r->p50 : 0,
+		i + 1 < nresults ? "," : "");
+    }
+    fprintf(f, "]}\n");
+    fclose(f);
+}
+
+
+/* compare reads a file write_json wrote, and reports every result
+   whose median is more than tolerance percent slower now.  Returns
+   the number of regressions. */
+static int compare(const char *filename, double tolerance)
+{
+    char line[512], image[64], bench[32];
+    const char *p;
+    double base;
+    FILE *f;
+    int i, regressions = 0;
+
+    f = fopen(filename, "r");
+    if (f == NULL)
+    {
+	fprintf(stderr, "Cannot read baseline %s: %s\n", filename, strerror(errno));
+	exit(1);
+    }
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+	if (sscanf(line, "{\"image\": \"%63[^\"]\", \"bench\": \"%31[^\"]\"", image, bench) != 2
+	    || (p = strstr(line, "\"p50\": ")) == NULL
+	    || sscanf(p, "\"p50\": %lf", &base) != 1)
+	    continue;
+	for (i = 0; i < nresults; i++)
+	{
+	    if (strcmp(results[i].image, image) != 0 || strcmp(results[i].bench, bench) != 0)
+		continue;
+	    if (results[i].p50 > base * (1 + tolerance / 100))
+	    {
+		printf("REGRESSION: %s %s: %.2f ns/op, baseline %.2f (+%.1f%%)\n",
+		       image, bench, results[i].p50, base,
+		       100 * (results[i].p50 / base - 1));
+		regressions++;
+	    }
+	}
+    }
+    fclose(f);
+    return regressions;
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [-r runs] [-c cpu] [-o out.json] [-b baseline.json [-t percent]] <imagename>...\n",
+	    progname);
+    fprintf(stderr, "\t<imagename> can be synth:<12|16|32>:<MiB> for a generated volume\n");
+    fprintf(stderr, "\t-r times each benchmark this many times (default %d)\n", DEFAULT_RUNS);
+    fprintf(stderr, "\t-c runs on this CPU (default 0)\n");
+    fprintf(stderr, "\t-o writes the results as JSON\n");
+    fprintf(stderr, "\t-b fails if a median is more than -t percent (default %d) slower than in baseline\n",
+	    DEFAULT_TOLERANCE);
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    struct target t;
+    cpu_set_t cpus;
+    char *out = NULL, *baseline = NULL;
+    double tolerance = DEFAULT_TOLERANCE;
+    int c, cpu = 0, status = 0;
+    size_t b;
+
+    while ((c = getopt(argc, argv, "r:c:o:b:t:")) != -1)
+    {
+	switch (c)
+	{
+	case 'r':
+	    runs = atoi(optarg);
+	    if (runs < 1)
+		usage(argv[0]);
+	    break;
+	case 'c':
+	    cpu = atoi(optarg);
+	    break;
+	case 'o':
+	    out = optarg;
+	    break;
+	case 'b':
+	    baseline = optarg;
+	    break;
+	case 't':
+	    tolerance = atof(optarg);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (optind >= argc)
+    {
+	usage(argv[0]);
+    }
+
+    /* one CPU, so the runs don't migrate and their caches stay warm */
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+	fprintf(stderr, "Cannot pin to CPU %d: %s\n", cpu, strerror(errno));
+
+    printf("%-20s %-18s %10s %10s %10s %10s %12s\n",
+	   "image", "benchmark", "min ns", "p50 ns", "p90 ns", "p99 ns", "Mops/s");
+    time_kernels();
+    for (; optind < argc; optind++)
+    {
+	if (open_target(argv[optind], &t) < 0)
+	{
+	    status = 1;
+	    continue;
+	}
+	for (b = 0; b < NBENCHMARKS; b++)
+	    time_bench(&t, benchmarks[b].name, benchmarks[b].run);
+	close_target(&t);
+    }
+
+    if (out != NULL)
+	write_json(out);
+    if (baseline != NULL && compare(baseline, tolerance) > 0)
+	status = 2;
+    return status;
+}
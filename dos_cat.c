@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -7,23 +8,30 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/uio.h>
+#include <getopt.h>
 
 #include "bootsect.h"
 #include "bpb.h"
 #include "direntry.h"
 #include "fat.h"
 #include "dos.h"
+#include "extent.h"
+#include "dirindex.h"
+#include "stream.h"
+#include "stats.h"
 
 
-uint16_t get_dirent(struct direntry *dirent, char *buffer)
+uint32_t get_dirent(struct direntry *dirent, char *buffer, struct bpb33 *bpb)
 {
-    uint16_t followclust = 0;
+    uint32_t followclust = 0;
     memset(buffer, 0, MAXFILENAME);
 
     int i;
     char name[9];
     char extension[4];
-    uint16_t file_cluster;
+    uint32_t file_cluster;
     name[8] = ' ';
     extension[3] = ' ';
     memcpy(name, &(dirent->deName[0]), 8);
@@ -77,7 +85,7 @@ uint16_t get_dirent(struct direntry *dirent, char *buffer)
 	if ((dirent->deAttributes & ATTR_HIDDEN) != ATTR_HIDDEN)
         {
             strcpy(buffer, name);
-            file_cluster = getushort(dirent->deStartCluster);
+            file_cluster = get_start_cluster(dirent, bpb);
             followclust = file_cluster;
         }
     }
@@ -99,157 +107,288 @@ uint16_t get_dirent(struct direntry *dirent, char *buffer)
 }
 
 
-struct direntry *follow_dir(char *searchpath, uint16_t cluster, 
-		            uint8_t *image_buf, struct bpb33* bpb)
+struct direntry *find_file(char *searchpath, uint8_t *image_buf, struct bpb33 *bpb)
 {
-    char *next_path_component = index(searchpath, '/');
-    int entry_len = strlen(searchpath);
-    if (next_path_component != NULL)
-    {
-        entry_len = next_path_component - searchpath;
-        *next_path_component = '\0';
-        next_path_component++;
-    }
+    /* the directory index resolves each component of the path */
+    return path_lookup(searchpath, image_buf, bpb);
+}
 
-    struct direntry *rv = NULL;
 
-    while (is_valid_cluster(cluster, bpb))
-    {
-        struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+/* when stdout is a pipe, file data is moved into it with splice (or
+   vmsplice from the mapping) instead of being copied through stdio */
+static int stdout_is_pipe = 0;
 
-        int numDirEntries = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) / sizeof(struct direntry);
-        int i = 0;
-	for ( ; i < numDirEntries; i++)
-	{
-            char buffer[MAXFILENAME]; 
-            uint16_t followclust = get_dirent(dirent, buffer);
-
-            if (strncasecmp(searchpath, buffer, strlen(searchpath)) == 0)
-            {
-                if (next_path_component)
-                {
-                    if (followclust)
-                        rv = follow_dir(buffer, followclust, image_buf, bpb);
-                }
-                else
-                {
-                    rv = dirent; 
-                }
-            }
-
-            if (rv)
-                break;
-
-            dirent++;
-	}
 
-	cluster = get_fat_entry(cluster, image_buf, bpb);
+/* splice_out moves len bytes at offset in the image file (mapped at
+   p) into the stdout pipe.  Returns the number of bytes it couldn't
+   move, which the caller writes the ordinary way. */
+size_t splice_out(int image_fd, loff_t offset, uint8_t *p, size_t len)
+{
+#ifdef __linux__
+    static int can_splice = 1;
+    static int can_vmsplice = 1;
+
+    while (len > 0 && can_splice && image_fd >= 0)
+    {
+        ssize_t n = splice(image_fd, &offset, STDOUT_FILENO, NULL, len, SPLICE_F_MORE);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+                continue;
+            can_splice = 0;
+            break;
+        }
+        p += n;
+        len -= n;
     }
 
-    return rv;
+    while (len > 0 && can_vmsplice)
+    {
+        struct iovec iov = { p, len };
+        ssize_t n = vmsplice(STDOUT_FILENO, &iov, 1, 0);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+                continue;
+            can_vmsplice = 0;
+            break;
+        }
+        p += n;
+        len -= n;
+    }
+#endif
+    return len;
 }
 
 
-struct direntry *traverse_root(char *searchpath, uint8_t *image_buf, struct bpb33* bpb)
+void write_out(int image_fd, uint8_t *image_buf, uint8_t *p, size_t len)
 {
-    uint16_t cluster = 0;
-    struct direntry *rv = NULL;
-
-    struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
-
-    char *next_path_component = index(searchpath, '/');
-    int root_entry_len = strlen(searchpath);
-    if (next_path_component != NULL)
+    STATS_ADD(bytes_copied, len);
+    if (stdout_is_pipe)
     {
-        root_entry_len = next_path_component - searchpath;
-        *next_path_component = '\0';
-        next_path_component++;
+        /* anything stdio is holding has to reach the pipe first */
+        fflush(stdout);
+        size_t left = splice_out(image_fd, p - image_buf, p, len);
+        p += len - left;
+        len = left;
     }
+    if (len > 0)
+        fwrite(p, 1, len, stdout);
+}
+
+
+/* with framing on, each file is preceded by a "<length> <path>\n"
+   header so a reader can split the stream back into files */
+static int framed = 0;
+
+
+void do_cat(char *path, struct direntry *dirent, int image_fd, uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint32_t cluster = get_start_cluster(dirent, bpb);
+    uint32_t bytes_remaining = getulong(dirent->deFileSize);
+    uint32_t cluster_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
 
     char buffer[MAXFILENAME];
+    get_dirent(dirent, buffer, bpb);
+
+    fprintf(stderr, "doing cat for %s, size %d\n", buffer, bytes_remaining);
+
+    struct extent_map *map = get_extent_map(cluster, image_buf, bpb);
+    if (map == NULL)
+        return;
 
     int i = 0;
-    for ( ; i < bpb->bpbRootDirEnts; i++)
+    if (framed)
     {
-        uint16_t followclust = get_dirent(dirent, buffer);
+        /* the header has to give the length actually written, which
+           is less than the size if the chain ends early */
+        uint64_t chain_bytes = 0;
+        for (i = 0; i < map->nextents; i++)
+            chain_bytes += (uint64_t)map->ext[i].length * cluster_size;
+        if (chain_bytes < bytes_remaining)
+            bytes_remaining = chain_bytes;
+        printf("%u %s\n", bytes_remaining, path);
+    }
 
-        if (strncasecmp(searchpath, buffer, strlen(searchpath)) == 0)
-        {
-            if (!next_path_component)
-                rv = dirent;
-            else if (is_valid_cluster(followclust, bpb))
-                rv = follow_dir(next_path_component, followclust, image_buf, bpb);
-        }
+    for (i = 0; i < map->nextents && bytes_remaining > 0; i++)
+    {
+        /* map the run to the data location; its clusters are contiguous */
+        uint8_t *p = cluster_to_addr(map->ext[i].start, image_buf, bpb);
 
-        if (rv)
-            break;
+        uint32_t run_bytes = (uint32_t)map->ext[i].length * cluster_size;
+        uint32_t nbytes = bytes_remaining > run_bytes ? run_bytes : bytes_remaining;
 
-        dirent++;
+        /* a cluster left out of a sparse container can't be spliced
+           from the file */
+        write_out(cluster_in_image(map->ext[i].start, bpb) ? image_fd : -1,
+                  image_buf, p, nbytes);
+        bytes_remaining -= nbytes;
     }
-
-    return rv;
 }
 
 
-struct direntry *find_file(char *searchpath, uint8_t *image_buf, struct bpb33 *bpb)
+/* cat_path looks up one path and writes it out.  Returns 0, or -1 if
+   there's no such file. */
+int cat_path(char *path, int image_fd, uint8_t *image_buf, struct bpb33 *bpb)
 {
-    /* strip any leading '/' from search path */
-    while (*searchpath == '/' && *searchpath != '\0') searchpath++;
-    return traverse_root(searchpath, image_buf, bpb);
+    struct direntry *dirent = find_file(path, image_buf, bpb);
+    if (dirent == NULL)
+    {
+        fprintf(stderr, "No file called %s exists in the disk image\n", path);
+        return -1;
+    }
+    do_cat(path, dirent, image_fd, image_buf, bpb);
+    return 0;
 }
 
 
-void do_cat(struct direntry *dirent, uint8_t *image_buf, struct bpb33 *bpb)
+/* path_matches says whether name, as given on the command line, is
+   the file at path, as stream.h spells it.  name can be in any case,
+   with slashes either way round and a trailing dot on a component. */
+static int path_matches(const char *name, const char *path)
 {
-    uint16_t cluster = getushort(dirent->deStartCluster);
-    uint32_t bytes_remaining = getulong(dirent->deFileSize);
-    uint16_t cluster_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
-
-    char buffer[MAXFILENAME];
-    get_dirent(dirent, buffer);
-
-    fprintf(stderr, "doing cat for %s, size %d\n", buffer, bytes_remaining);
+    size_t len, n;
 
-    while (is_valid_cluster(cluster, bpb))
+    for (;;)
     {
-        /* map the cluster number to the data location */
-        uint8_t *p = cluster_to_addr(cluster, image_buf, bpb);
+	while (*name == '/' || *name == '\\')
+	    name++;
+	if (*name == '\0')
+	    return *path == '\0';
+	len = strcspn(name, "/\\");
+	for (n = len; n > 0 && name[n-1] == '.'; n--)
+	    ;
+	if (n == 0 || strncasecmp(name, path, n) != 0 
+	    || (path[n] != '/' && path[n] != '\0'))
+	    return 0;
+	name += len;
+	path += n;
+	if (*path == '/')
+	    path++;
+    }
+}
 
-        uint32_t nbytes = bytes_remaining > cluster_size ? cluster_size : bytes_remaining;
 
-        fwrite(p, 1, nbytes, stdout);
-        bytes_remaining -= nbytes;
-    
-        cluster = get_fat_entry(cluster, image_buf, bpb);
+/* when the image is streamed in, only the files asked for are kept */
+static int wanted(const char *path, void *arg)
+{
+    char **names;
+
+    for (names = arg; *names != NULL; names++)
+    {
+	if (path_matches(*names, path))
+	    return 1;
     }
+    return 0;
 }
 
 
 void usage(char *progname)
 {
-    fprintf(stderr, "usage: %s <imagename> <filename>\n", progname);
+    fprintf(stderr, "usage: %s [-l] [--stats] <imagename> <filename>...\n", progname);
+    fprintf(stderr, "       %s [-l] [--stats] -0 <imagename> < list\n", progname);
+    fprintf(stderr, "\t-0 reads a NUL separated list of filenames from stdin\n");
+    fprintf(stderr, "\t-l precedes each file with a \"<length> <filename>\" line\n");
+    fprintf(stderr, "\t<imagename> - reads the image from stdin (not with -0)\n");
+    fprintf(stderr, "\t--stats prints operation counts and times to stderr\n");
     exit(1);
 }
 
 
 int main(int argc, char** argv)
 {
+    struct fat_volume *vol;
+    int err;
     uint8_t *image_buf;
     int fd;
     struct bpb33* bpb;
-    if (argc != 3)
+    int c, from_stdin = 0, status = 0;
+    static struct option options[] = {
+	{ "stats", no_argument, NULL, 's' },
+	{ NULL, 0, NULL, 0 }
+    };
+
+    while ((c = getopt_long(argc, argv, "0l", options, NULL)) != -1)
+    {
+	switch (c)
+	{
+	case '0':
+	    from_stdin = 1;
+	    break;
+	case 'l':
+	    framed = 1;
+	    break;
+	case 's':
+	    stats_start();
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (argc - optind < (from_stdin ? 1 : 2))
     {
 	usage(argv[0]);
     }
 
-    image_buf = mmap_file(argv[1], &fd);
-    bpb = check_bootsector(image_buf);
+    /* one file is read straight through; many are mostly lookups */
+    stats_phase("open");
+    if (strcmp(argv[optind], "-") == 0)
+    {
+	/* the list of names would have to come from stdin too */
+	if (from_stdin)
+	    usage(argv[0]);
+	err = stream_open(stdin, FAT_RDONLY, wanted, &argv[optind + 1], &vol);
+    }
+    else
+	err = fat_open(argv[optind], FAT_RDONLY 
+		       | (from_stdin || argc - optind > 2 ? FAT_RANDOM : FAT_SEQUENTIAL), 
+		       &vol);
+    if (err < 0)
+    {
+	fprintf(stderr, "Cannot read disk image file %s: %s\n", argv[optind], 
+		fat_strerror(err));
+	exit(1);
+    }
+    image_buf = vol->image_buf;
+    fd = vol->fd;
+    bpb = vol->bpb;
 
-    struct direntry *dirent = find_file(argv[2], image_buf, bpb);
-    if (dirent)
-        do_cat(dirent, image_buf, bpb);
+    struct stat st;
+    if (fstat(STDOUT_FILENO, &st) == 0 && S_ISFIFO(st.st_mode))
+        stdout_is_pipe = 1;
 
-    unmmap_file(image_buf, &fd);
+    /* everything comes out of the one mapping */
+    stats_phase("cat");
+    int i;
+    for (i = optind + 1; i < argc; i++)
+    {
+        if (cat_path(argv[i], fd, image_buf, bpb) < 0)
+            status = 1;
+    }
 
-    return 0;
+    if (from_stdin)
+    {
+        char *path = NULL;
+        size_t size = 0;
+        ssize_t len;
+
+        while ((len = getdelim(&path, &size, '\0', stdin)) > 0)
+        {
+            if (path[len-1] == '\0')
+                len--;
+            if (len == 0)
+                continue;
+            path[len] = '\0';
+            if (cat_path(path, fd, image_buf, bpb) < 0)
+                status = 1;
+        }
+        free(path);
+    }
+
+    fflush(stdout);
+    stats_phase("close");
+    fat_close(vol);
+    stats_print(stderr);
+
+    return status;
 }
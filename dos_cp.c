@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -9,242 +10,156 @@
 #include <string.h>
 #include <assert.h>
 #include <ctype.h>
+#include <getopt.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #include "bootsect.h"
 #include "bpb.h"
 #include "direntry.h"
 #include "fat.h"
 #include "dos.h"
-
-
-/* get_name retrieves the filename from a directory entry */
-
-void get_name(char *fullname, struct direntry *dirent) 
+#include "alloc.h"
+#include "extent.h"
+#include "dirindex.h"
+#include "stats.h"
+#include "trace.h"
+
+
+/* copy_run copies len bytes starting at offset in the disk image file
+   to out_fd.  Where the kernel supports it the data goes straight
+   from the image file to the output with copy_file_range (which can
+   reflink) or sendfile, without passing through user space; otherwise
+   it's written from the memory mapped image at src, as it always is
+   when image_fd is -1.  Returns 0 on success, -1 on a write error. */
+
+static int copy_run(int image_fd, off_t offset, int out_fd,
+		    uint8_t *src, size_t len)
 {
-    char name[9];
-    char extension[4];
-    int i;
+    ssize_t n;
+#ifdef __linux__
+    static int have_copy_file_range = TRUE;
+    static int have_sendfile = TRUE;
 
-    name[8] = ' ';
-    extension[3] = ' ';
-    memcpy(name, &(dirent->deName[0]), 8);
-    memcpy(extension, dirent->deExtension, 3);
-
-    /* names are space padded - remove the padding */
-    for (i = 8; i > 0; i--) 
+    while (len > 0 && have_copy_file_range && image_fd >= 0) 
     {
-	if (name[i] == ' ') 
-	    name[i] = '\0';
-	else 
-	    break;
-    }
-
-    /* extensions aren't normally space padded - but remove the
-       padding anyway if it's there */
-    for (i = 3; i > 0; i--) 
-    {
-	if (extension[i] == ' ') 
-	    extension[i] = '\0';
-	else 
+	n = copy_file_range(image_fd, &offset, out_fd, NULL, len, 0);
+	if (n <= 0) 
+	{
+	    /* not supported between these two files - don't try it
+	       again, and fall through to sendfile */
+	    if (n < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL
+			  || errno == EOPNOTSUPP || errno == EBADF))
+		have_copy_file_range = FALSE;
+	    else if (n < 0)
+		return -1;
 	    break;
-    }
-    fullname[0]='\0';
-    strcat(fullname, name);
-
-    /* append the extension if it's not a directory */
-    if ((dirent->deAttributes & ATTR_DIRECTORY) == 0) 
-    {
-	strcat(fullname, ".");
-	strcat(fullname, extension);
-    }
-}
-
-
-/* find_file seeks through the directories in the memory disk image,
-   until it finds the named file */
-
-/* flags, depending on whether we're searching for a file or a
-   directory */
-#define FIND_FILE 0
-#define FIND_DIR 1
-
-struct direntry* find_file(char *infilename, uint16_t cluster,
-			   int find_mode,
-			   uint8_t *image_buf, struct bpb33* bpb)
-{
-    char buf[MAXPATHLEN];
-    char *seek_name, *next_name;
-    int d;
-    struct direntry *dirent;
-    uint16_t dir_cluster;
-    char fullname[13];
-
-    /* find the first dirent in this directory */
-    dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
-
-    /* first we need to split the file name we're looking for into the
-       first part of the path, and the remainder.  We hunt through the
-       current directory for the first part.  If there's a remainder,
-       and what we find is a directory, then we recurse, and search
-       that directory for the remainder */
-
-    strncpy(buf, infilename, MAXPATHLEN);
-    seek_name = buf;
-
-    /* trim leading slashes */
-    while (*seek_name == '/' || *seek_name == '\\') 
-    {
-	seek_name++;
+	}
+	src += n;
+	len -= n;
     }
 
-    /* search for any more slashes - if so, it's a dirname */
-    next_name = seek_name;
-    while (1) 
+    while (len > 0 && have_sendfile && image_fd >= 0) 
     {
-	if (*next_name == '/' || *next_name == '\\') 
+	n = sendfile(out_fd, image_fd, &offset, len);
+	if (n <= 0) 
 	{
-	    *next_name = '\0';
-	    next_name ++;
-	    break;
-	}
-	if (*next_name == '\0') 
-	{
-	    /* end of name - no slashes found */
-	    next_name = NULL;
-	    if (find_mode == FIND_DIR) 
-	    {
-		return dirent;
-	    }
+	    if (n < 0 && (errno == ENOSYS || errno == EINVAL))
+		have_sendfile = FALSE;
+	    else if (n < 0)
+		return -1;
 	    break;
 	}
-	next_name++;
+	src += n;
+	len -= n;
     }
+#endif
 
-    while (1) 
+    while (len > 0) 
     {
-	/* hunt a cluster for the relevant dirent.  If we reach the
-	   end of the cluster, we'll need to go to the next cluster
-	   for this directory */
-	for (d = 0; 
-	     d < bpb->bpbBytesPerSec * bpb->bpbSecPerClust; 
-	     d += sizeof(struct direntry)) 
+	n = write(out_fd, src, len);
+	if (n < 0) 
 	{
-	    if (dirent->deName[0] == SLOT_EMPTY) 
-	    {
-		/* we failed to find the file */
-		return NULL;
-	    }
-
-	    if (dirent->deName[0] == SLOT_DELETED) 
-	    {
-		/* skip over a deleted file */
-		dirent++;
+	    if (errno == EINTR)
 		continue;
-	    }
-
-	    get_name(fullname, dirent);
-	    if (strcmp(fullname, seek_name)==0) 
-	    {
-		/* found it! */
-		if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) 
-		{
-		    /* it's a directory */
-		    if (next_name == NULL) 
-		    {
-			fprintf(stderr, "Cannot copy out a directory\n");
-			exit(1);
-		    }
-		    dir_cluster = getushort(dirent->deStartCluster);
-		    return find_file(next_name, dir_cluster, 
-				     find_mode, image_buf, bpb);
-		} 
-		else if ((dirent->deAttributes & ATTR_VOLUME) != 0) 
-		{
-		    /* it's a volume */
-		    fprintf(stderr, "Cannot copy out a volume\n");
-		    exit(1);
-		} 
-		else 
-		{
-		    /* assume it's a file */
-		    return dirent;
-		}
-	    }
-	    dirent++;
-	}
-
-	/* we've reached the end of the cluster for this directory.
-	   Where's the next cluster? */
-	if (cluster == 0) 
-	{
-	    // root dir is special
-	    dirent++;
-	} 
-	else 
-	{
-	    cluster = get_fat_entry(cluster, image_buf, bpb);
-	    dirent = (struct direntry*)cluster_to_addr(cluster, 
-						       image_buf, bpb);
+	    return -1;
 	}
+	src += n;
+	len -= n;
     }
+    return 0;
 }
 
 
-/* copy_out_file actually does the work of copying, recursing through
-   the clusters of the memory disk image, and copying out a cluster at
-   a time */
+/* copy_out_file actually does the work of copying, turning the
+   file's cluster chain into runs of contiguous clusters in the memory
+   disk image, and copying out a run at a time.  Returns 0 on success,
+   -1 on an error. */
 
-void copy_out_file(FILE *fd, uint16_t cluster, uint32_t bytes_remaining,
+int copy_out_file(int image_fd, int out_fd, uint32_t cluster, 
+		   uint32_t bytes_remaining,
 		   uint8_t *image_buf, struct bpb33* bpb)
 {
-    int total_clusters, clust_size;
+    int clust_size, i;
+    uint32_t nbytes;
+    struct extent_map *map;
     uint8_t *p;
+    uint32_t nclusters = 0, bytes = bytes_remaining;
+    struct trace_span span;
 
     clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
-    total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
-
-    assert(cluster <= total_clusters);
+    assert(cluster <= total_clusters(bpb));
+    trace_begin(&span, TRACE_DETAIL, "file", "copy out");
 
-    if (cluster == 0) 
+    map = get_extent_map(cluster, image_buf, bpb);
+    if (map == NULL) 
     {
-	fprintf(stderr, "Bad file termination\n");
-	return;
+	fprintf(stderr, "Out of memory\n");
+	return -1;
     }
-    else if (is_end_of_file(cluster)) 
-    {
-	return;	
-    } 
-
-
-    /* map the cluster number to the data location */
-    p = cluster_to_addr(cluster, image_buf, bpb);
 
-    if (bytes_remaining <= clust_size) 
+    for (i = 0; i < map->nextents && bytes_remaining > 0; i++) 
     {
-	/* this is the last cluster */
-	fwrite(p, bytes_remaining, 1, fd);
-    } 
-    else 
-    {
-	/* more clusters after this one */
-	fwrite(p, clust_size, 1, fd);
+	/* map the first cluster of the run to the data location; the
+	   rest of the run follows it directly */
+	p = cluster_to_addr(map->ext[i].start, image_buf, bpb);
+
+	nbytes = map->ext[i].length * clust_size;
+	if (nbytes > bytes_remaining)
+	    nbytes = bytes_remaining;
+	if (copy_run(cluster_in_image(map->ext[i].start, bpb) ? image_fd : -1,
+		     p - image_buf, out_fd, p, nbytes) < 0) 
+	{
+	    fprintf(stderr, "Write error copying data out: %s\n",
+		    strerror(errno));
+	    return -1;
+	}
+	STATS_ADD(bytes_copied, nbytes);
+	bytes_remaining -= nbytes;
+	nclusters += map->ext[i].length;
+    }
+    trace_arg(&span, "clusters", nclusters);
+    trace_arg(&span, "bytes", bytes - bytes_remaining);
+    trace_end(&span);
 
-	/* recurse, continuing to copy */
-	copy_out_file(fd, get_fat_entry(cluster, image_buf, bpb), 
-		      bytes_remaining - clust_size, image_buf, bpb);
+    if (bytes_remaining > 0 && map->end == CLUST_FREE) 
+    {
+	fprintf(stderr, "Bad file termination\n");
     }
-    return;
+    return 0;
 }
 
-/* copyout copies a file from the FAT-12 memory disk image to a
-   regular file in the file system */
+/* copyout copies a file from the FAT memory disk image to a
+   regular file in the file system.  Returns 0 on success, -1 on an
+   error. */
 
-void copyout(char *infilename, char* outfilename,
-	     uint8_t *image_buf, struct bpb33* bpb)
+int copyout(char *infilename, char* outfilename,
+	    int image_fd, uint8_t *image_buf, struct bpb33* bpb)
 {
     struct direntry *dirent = (void*)1;
-    FILE *fd;
-    uint16_t start_cluster;
+    int fd, rv;
+    uint32_t start_cluster;
     uint32_t size;
 
     /* skip the volume name */
@@ -252,46 +167,65 @@ void copyout(char *infilename, char* outfilename,
     infilename+=2;
 
     /* find the dirent of the file in the memory disk image */
-    dirent = find_file(infilename, 0, FIND_FILE, image_buf, bpb);
+    dirent = path_lookup(infilename, image_buf, bpb);
     if (dirent == NULL) 
     {
 	fprintf(stderr, "No file called %s exists in the disk image\n",
 		infilename);
-	exit(1);
+	return -1;
+    }
+    if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) 
+    {
+	fprintf(stderr, "Cannot copy out a directory\n");
+	return -1;
+    }
+    if ((dirent->deAttributes & ATTR_VOLUME) != 0) 
+    {
+	fprintf(stderr, "Cannot copy out a volume\n");
+	return -1;
     }
 
     /* open the real file for writing */
-    fd = fopen(outfilename, "w");
-    if (fd == NULL) 
+    fd = open(outfilename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) 
     {
 	fprintf(stderr, "Can't open file %s to copy data out\n",
 		outfilename);
-	exit(1);
+	return -1;
     }
 
     /* do the actual copy out*/
-    start_cluster = getushort(dirent->deStartCluster);
+    start_cluster = get_start_cluster(dirent, bpb);
     size = getulong(dirent->deFileSize);
-    copy_out_file(fd, start_cluster, size, image_buf, bpb);
+    rv = copy_out_file(image_fd, fd, start_cluster, size, image_buf, bpb);
     
-    fclose(fd);
+    close(fd);
+    return rv;
 }
 
 /* copy_in_file actually does the copying of the file into the memory
-   image, updates the FAT, and returns the starting cluster of the
-   file */
-
-uint16_t copy_in_file(FILE* fd, uint8_t *image_buf, struct bpb33* bpb, 
-		      uint32_t *size)
+   image, updates the FAT, and stores the starting cluster of the file
+   in *start_cluster.  The nclusters clusters the file is expected to
+   need are taken from the allocator in as few contiguous runs as
+   possible; if it runs dry part way through, the clusters taken so
+   far are given back and -1 is returned. */
+
+int copy_in_file(FILE* fd, uint8_t *image_buf, struct bpb33* bpb, 
+		 struct cluster_alloc *alloc, uint32_t nclusters,
+		 uint32_t *start_cluster, uint32_t *size)
 {
-    uint32_t clust_size, total_clusters, i;
+    uint32_t clust_size;
     uint8_t *buf;
     size_t bytes;
-    uint16_t start_cluster = 0;
-    uint16_t prev_cluster = 0;
+    uint32_t i = 0;
+    uint32_t prev_cluster = 0;
+    uint32_t run_next = 0, run_left = 0;
+    uint32_t taken = 0;
+    struct trace_span span;
     
     clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
-    total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
+    *start_cluster = 0;
+    trace_begin(&span, TRACE_DETAIL, "file", "copy in");
     buf = malloc(clust_size);
     while(1) 
     {
@@ -299,29 +233,36 @@ uint16_t copy_in_file(FILE* fd, uint8_t *image_buf, struct bpb33* bpb,
 	bytes = fread(buf, 1, clust_size, fd);
 	if (bytes > 0) {
 	    *size += bytes;
+	    STATS_ADD(bytes_copied, bytes);
 
-	    /* find a free cluster */
-	    for (i = 2; i < total_clusters; i++) 
+	    if (run_left == 0) 
 	    {
-		if (get_fat_entry(i, image_buf, bpb) == CLUST_FREE) 
-		{
-		    break;
-		}
+		/* reserve the rest of the file in one go, or as close
+		   to that as the free space allows.  If the file grew
+		   since it was measured, carry on a cluster at a time */
+		run_next = alloc_run(alloc, nclusters > 0 ? nclusters : 1, 
+				     &run_left);
+		nclusters -= run_left < nclusters ? run_left : nclusters;
 	    }
-
-	    if (i == total_clusters) 
+	    if (run_left == 0) 
 	    {
-		/* oops - we ran out of disk space */
+		/* oops - we ran out of disk space, so give back what
+		   we've taken */
 		fprintf(stderr, "No more space in filesystem\n");
-		/* we should clean up here, rather than just exit */ 
-		exit(1);
+		alloc_release_chain(alloc, *start_cluster);
+		*start_cluster = 0;
+		free(buf);
+		return -1;
 	    }
+	    i = run_next++;
+	    run_left--;
+	    taken++;
 
 	    /* remember the first cluster, as we need to store this in
 	       the dirent */
-	    if (start_cluster == 0) 
+	    if (*start_cluster == 0) 
 	    {
-		start_cluster = i;
+		*start_cluster = i;
 	    } 
 	    else 
 	    {
@@ -331,7 +272,7 @@ uint16_t copy_in_file(FILE* fd, uint8_t *image_buf, struct bpb33* bpb,
 	    }
 
 	    /* make sure we've recorded this cluster as used */
-	    set_fat_entry(i, FAT12_MASK&CLUST_EOFS, image_buf, bpb);
+	    set_fat_entry(i, CLUST_EOFS, image_buf, bpb);
 
 	    /* copy the data into the cluster */
 	    memcpy(cluster_to_addr(i, image_buf, bpb), buf, clust_size);
@@ -346,13 +287,23 @@ uint16_t copy_in_file(FILE* fd, uint8_t *image_buf, struct bpb33* bpb,
 	prev_cluster = i;
     }
 
+    /* the file came up short of what was reserved for it */
+    while (run_left > 0) 
+    {
+	alloc_release(alloc, run_next++);
+	run_left--;
+    }
+
+    trace_arg(&span, "clusters", taken);
+    trace_arg(&span, "bytes", *size);
+    trace_end(&span);
     free(buf);
-    return start_cluster;
+    return 0;
 }
 
 /* write the values into a directory entry */
 void write_dirent(struct direntry *dirent, char *filename, 
-		  uint16_t start_cluster, uint32_t size)
+		  uint32_t start_cluster, uint32_t size, struct bpb33* bpb)
 {
     char *p, *p2;
     char *uppername;
@@ -404,7 +355,7 @@ void write_dirent(struct direntry *dirent, char *filename,
 
     /* set the attributes and file size */
     dirent->deAttributes = ATTR_NORMAL;
-    putushort(dirent->deStartCluster, start_cluster);
+    set_start_cluster(dirent, start_cluster, bpb);
     putulong(dirent->deFileSize, size);
 
     /* could also set time and date here if we really
@@ -412,66 +363,155 @@ void write_dirent(struct direntry *dirent, char *filename,
 }
 
 
-/* create_dirent finds a free slot in the directory, and write the
-   directory entry */
+/* where create_dirent takes up its search for a free slot in each
+   directory it has written to, so a manifest copying many files into
+   one directory doesn't rescan it for each.  Every slot before slot in
+   cluster is in use, since dos_cp never frees one.  Direct mapped by
+   the directory's first cluster; an entry that was reused just starts
+   from the beginning again. */
+struct dir_cursor {
+    uint32_t dir_cluster;
+    uint32_t cluster;
+    int slot;
+};
 
-void create_dirent(struct direntry *dirent, char *filename, 
-		   uint16_t start_cluster, uint32_t size,
-		   uint8_t *image_buf, struct bpb33* bpb)
+#define DIR_CURSORS 64
+static struct dir_cursor dir_cursors[DIR_CURSORS];
+
+
+/* create_dirent finds a free slot in the directory starting at
+   dir_cluster, and write the directory entry.  If the directory is
+   full it's extended by a cluster from alloc.  Returns 0 on success,
+   -1 if there's no room. */
+
+int create_dirent(uint32_t dir_cluster, char *filename, 
+		  uint32_t start_cluster, uint32_t size,
+		  uint8_t *image_buf, struct bpb33* bpb,
+		  struct cluster_alloc *alloc)
 {
+    struct direntry *dirent;
+    struct dir_cursor *cur = &dir_cursors[dir_cluster % DIR_CURSORS];
+    uint32_t cluster, prev_cluster, next_cluster;
+    uint32_t steps = 0, max_clusters = total_clusters(bpb);
+    int i, nents;
+
+    if (dir_cluster == MSDOSFSROOT)
+	nents = bpb->bpbRootDirEnts;
+    else
+	nents = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) 
+	    / sizeof(struct direntry);
+
+    if (cur->dir_cluster != dir_cluster) 
+    {
+	cur->dir_cluster = dir_cluster;
+	cur->cluster = dir_cluster;
+	cur->slot = 0;
+    }
+    cluster = cur->cluster;
+    i = cur->slot;
+
     while (1) 
     {
-	if (dirent->deName[0] == SLOT_EMPTY) 
+	dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb) + i;
+	next_cluster = cluster == MSDOSFSROOT 
+	    ? CLUST_EOFS : get_fat_entry(cluster, image_buf, bpb);
+	for (; i < nents; i++, dirent++) 
 	{
-	    /* we found an empty slot at the end of the directory */
-	    write_dirent(dirent, filename, start_cluster, size);
-	    dirent++;
-
-	    /* make sure the next dirent is set to be empty, just in
-	       case it wasn't before */
-	    memset((uint8_t*)dirent, 0, sizeof(struct direntry));
-	    dirent->deName[0] = SLOT_EMPTY;
-	    return;
+	    if (dirent->deName[0] == SLOT_EMPTY) 
+	    {
+		/* we found an empty slot at the end of the directory */
+		write_dirent(dirent, filename, start_cluster, size, bpb);
+		dir_index_add(dir_cluster, dirent, image_buf, bpb);
+		cur->cluster = cluster;
+		cur->slot = i + 1;
+
+		/* make sure the next dirent is set to be empty, just in
+		   case it wasn't before */
+		if (i + 1 < nents) 
+		    dirent++;
+		else if (is_valid_cluster(next_cluster, bpb))
+		    dirent = (struct direntry*)cluster_to_addr(next_cluster, 
+							       image_buf, bpb);
+		else
+		    return 0;
+		memset((uint8_t*)dirent, 0, sizeof(struct direntry));
+		dirent->deName[0] = SLOT_EMPTY;
+		return 0;
+	    }
+
+	    if (dirent->deName[0] == SLOT_DELETED) 
+	    {
+		/* we found a deleted entry - we can just overwrite it */
+		write_dirent(dirent, filename, start_cluster, size, bpb);
+		dir_index_add(dir_cluster, dirent, image_buf, bpb);
+		cur->cluster = cluster;
+		cur->slot = i + 1;
+		return 0;
+	    }
 	}
 
-	if (dirent->deName[0] == SLOT_DELETED) 
+	if (cluster == MSDOSFSROOT) 
 	{
-	    /* we found a deleted entry - we can just overwrite it */
-	    write_dirent(dirent, filename, start_cluster, size);
-	    return;
+	    /* the FAT12/16 root directory can't grow */
+	    fprintf(stderr, "No room left in the root directory\n");
+	    return -1;
 	}
-	dirent++;
+	if (!is_valid_cluster(next_cluster, bpb) || ++steps >= max_clusters)
+	    break;
+	cluster = next_cluster;
+	i = 0;
+    }
+
+    /* every slot is in use, so add a cluster to the directory */
+    prev_cluster = cluster;
+    cluster = alloc_cluster(alloc);
+    if (cluster == 0) 
+    {
+	fprintf(stderr, "No more space in filesystem\n");
+	return -1;
     }
+    set_fat_entry(prev_cluster, cluster, image_buf, bpb);
+    set_fat_entry(cluster, CLUST_EOFS, image_buf, bpb);
+    memset(cluster_to_addr(cluster, image_buf, bpb), 0, 
+	   bpb->bpbBytesPerSec * bpb->bpbSecPerClust);
+    dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    write_dirent(dirent, filename, start_cluster, size, bpb);
+    dir_index_add(dir_cluster, dirent, image_buf, bpb);
+    cur->cluster = cluster;
+    cur->slot = 1;
+    return 0;
 }
 
 /* copyin copies a file from a regular file on the filesystem into a
-   file in the FAT-12 memory disk image  */
+   file in the FAT memory disk image, taking clusters from alloc.
+   Returns 0 on success, -1 on an error. */
 
-void copyin(char *infilename, char* outfilename,
-	    uint8_t *image_buf, struct bpb33* bpb)
+int copyin(char *infilename, char* outfilename,
+	   uint8_t *image_buf, struct bpb33* bpb, struct cluster_alloc *alloc)
 {
-    struct direntry *dirent = (void*)1;
     FILE *fd;
-    uint16_t start_cluster;
+    uint32_t dir_cluster;
+    const char *leaf;
+    uint32_t start_cluster;
     uint32_t size = 0;
+    uint32_t clust_size, nclusters;
+    struct stat st;
 
     assert(strncmp("a:", outfilename, 2)==0);
     outfilename+=2;
 
-    /* check that the file doesn't already exist */
-    dirent = find_file(outfilename, 0, FIND_FILE, image_buf, bpb);
-    if (dirent != NULL) 
+    /* find the directory to put the file in */
+    if (path_parent(outfilename, &dir_cluster, &leaf, image_buf, bpb) < 0) 
     {
-	fprintf(stderr, "File %s already exists\n", outfilename);
-	exit(1);
+	fprintf(stderr, "Directory does not exists in the disk image\n");
+	return -1;
     }
 
-    /* find the dirent of the directory to put the file in */
-    dirent = find_file(outfilename, 0, FIND_DIR, image_buf, bpb);
-    if (dirent == NULL) 
+    /* check that the file doesn't already exist */
+    if (dir_lookup(dir_cluster, leaf, image_buf, bpb) != NULL) 
     {
-	fprintf(stderr, "Directory does not exists in the disk image\n");
-	exit(1);
+	fprintf(stderr, "File %s already exists\n", outfilename);
+	return -1;
     }
 
     /* open the real file for reading */
@@ -480,16 +520,133 @@ void copyin(char *infilename, char* outfilename,
     {
 	fprintf(stderr, "Can't open file %s to copy data in\n",
 		infilename);
-	exit(1);
+	return -1;
+    }
+
+    /* make sure there's room for the whole file before we touch the
+       FAT */
+    if (fstat(fileno(fd), &st) < 0) 
+    {
+	fprintf(stderr, "Can't stat file %s\n", infilename);
+	fclose(fd);
+	return -1;
+    }
+    clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
+    nclusters = (st.st_size + clust_size - 1) / clust_size;
+    if (nclusters > alloc->nfree) 
+    {
+	fprintf(stderr, "No more space in filesystem for %s\n", infilename);
+	fclose(fd);
+	return -1;
     }
 
     /* do the actual copy in*/
-    start_cluster = copy_in_file(fd, image_buf, bpb, &size);
+    if (copy_in_file(fd, image_buf, bpb, alloc, nclusters, 
+		     &start_cluster, &size) < 0) 
+    {
+	fclose(fd);
+	return -1;
+    }
 
     /* create the directory entry */
-    create_dirent(dirent, outfilename, start_cluster, size, image_buf, bpb);
+    if (create_dirent(dir_cluster, outfilename, start_cluster, size, 
+		      image_buf, bpb, alloc) < 0) 
+    {
+	alloc_release_chain(alloc, start_cluster);
+	fclose(fd);
+	return -1;
+    }
     
     fclose(fd);
+    return 0;
+}
+
+
+/* the free-cluster allocator is set up on the first copy in, and
+   shared by every copy in after that */
+static struct cluster_alloc image_alloc;
+static int have_alloc = FALSE;
+
+/* copy copies one file, in whichever direction the "a:" says.
+   Returns 0 on success, -1 on an error. */
+
+int copy(char *from, char *to, int image_fd, uint8_t *image_buf, 
+	 struct bpb33* bpb)
+{
+    /* use the "a:" bit to determine whether we're copying in or out */
+    if (strncmp("a:", from, 2)==0) 
+    {
+	/* copy from FAT disk image to external filesystem */
+	return copyout(from, to, image_fd, image_buf, bpb);
+    }
+    if (strncmp("a:", to, 2)!=0) 
+    {
+	fprintf(stderr, "One of %s and %s must be in the disk image (a:)\n",
+		from, to);
+	return -1;
+    }
+
+    /* copy from external filesystem to FAT disk image */
+    if (!have_alloc) 
+    {
+	if (alloc_init(&image_alloc, image_buf, bpb) < 0) 
+	{
+	    fprintf(stderr, "Out of memory\n");
+	    return -1;
+	}
+	have_alloc = TRUE;
+    }
+    return copyin(from, to, image_buf, bpb, &image_alloc);
+}
+
+
+/* copy_manifest does every copy listed in the manifest file, one
+   "<from> <to>" pair per line, written the way they would be on the
+   command line.  Blank lines and lines starting with # are skipped.
+   A failed copy doesn't stop the rest.  Returns the number of lines
+   that failed. */
+
+int copy_manifest(char *manifest, int image_fd, uint8_t *image_buf, 
+		  struct bpb33* bpb)
+{
+    FILE *mf;
+    char *line = NULL;
+    char *from, *to, *extra;
+    size_t size = 0;
+    int lineno = 0, failed = 0;
+
+    if (strcmp(manifest, "-") == 0)
+	mf = stdin;
+    else
+	mf = fopen(manifest, "r");
+    if (mf == NULL) 
+    {
+	fprintf(stderr, "Can't open manifest %s\n", manifest);
+	return 1;
+    }
+
+    while (getline(&line, &size, mf) > 0) 
+    {
+	lineno++;
+	from = strtok(line, " \t\r\n");
+	if (from == NULL || from[0] == '#')
+	    continue;
+	to = strtok(NULL, " \t\r\n");
+	extra = strtok(NULL, " \t\r\n");
+	if (to == NULL || extra != NULL) 
+	{
+	    fprintf(stderr, "%s:%d: expected <from> <to>\n", manifest, lineno);
+	    failed++;
+	    continue;
+	}
+	if (copy(from, to, image_fd, image_buf, bpb) < 0) 
+	    failed++;
+    }
+
+    free(line);
+    if (mf != stdin)
+	fclose(mf);
+    return failed;
 }
 
 void usage(char *progname)
@@ -498,38 +655,103 @@ void usage(char *progname)
     fprintf(stderr, "\tcopies file called filename1 from disk image to a normal file\n");
     fprintf(stderr, "usage: %s <imagename> <filename3> a:<filename4>\n", progname);
     fprintf(stderr, "\tcopies normal file called filename3 into disk image as filename4\n");
+    fprintf(stderr, "usage: %s -m <manifest> <imagename>\n", progname);
+    fprintf(stderr, "\tdoes every copy listed in manifest (- for stdin), one pair per line\n");
+    fprintf(stderr, "\t--stats, with any of these, prints operation counts and times to stderr\n");
+    fprintf(stderr, "\t--trace=file writes the phases' times as a Chrome trace-event file,\n");
+    fprintf(stderr, "\tfor chrome://tracing or Perfetto; --trace-detail adds every file copied\n");
     exit(1);
 }
 
 int main(int argc, char** argv)
 {
-    int fd;
+    struct fat_volume *vol;
+    int err, flags;
+    int fd, c, rv;
     uint8_t *image_buf;
     struct bpb33* bpb;
-    if (argc < 4 || argc > 4) 
+    char *manifest = NULL;
+    char *tracefile = NULL;
+    int trace_detail = TRACE_PHASES;
+    static struct option options[] = {
+	{ "stats", no_argument, NULL, 's' },
+	{ "trace", required_argument, NULL, 't' },
+	{ "trace-detail", no_argument, NULL, 'T' },
+	{ NULL, 0, NULL, 0 }
+    };
+
+    while ((c = getopt_long(argc, argv, "m:", options, NULL)) != -1) 
+    {
+	switch (c) 
+	{
+	case 'm':
+	    manifest = optarg;
+	    break;
+	case 's':
+	    stats_start();
+	    break;
+	case 't':
+	    tracefile = optarg;
+	    break;
+	case 'T':
+	    trace_detail = TRACE_DETAIL;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (tracefile != NULL && trace_open(tracefile, trace_detail) < 0) 
+    {
+	fprintf(stderr, "Cannot write trace %s: %s\n", tracefile, strerror(errno));
+	exit(1);
+    }
+    if (argc - optind != (manifest != NULL ? 1 : 3)) 
     {
 	usage(argv[0]);
     }
 
-    image_buf = mmap_file(argv[1], &fd);
-    bpb = check_bootsector(image_buf);
-
-    /* use the "a:" bit to determine whether we're copying in or out */
-    if (strncmp("a:", argv[2], 2)==0) 
+    /* copying a single file out only reads the image, in order */
+    flags = 0;
+    if (manifest == NULL) 
     {
-	/* copy from FAT-12 disk image to external filesystem */
-	copyout(argv[2], argv[3], image_buf, bpb);
+	flags = FAT_SEQUENTIAL;
+	if (strncmp("a:", argv[optind+1], 2)==0)
+	    flags |= FAT_RDONLY;
     }
-    else if (strncmp("a:", argv[3], 2)==0) 
+    stats_phase("open");
+    err = fat_open(argv[optind], flags, &vol);
+    if (err < 0)
     {
-	/* copy from external filesystem to FAT-12 disk image */
-	copyin(argv[2], argv[3], image_buf, bpb);
-    } 
-    else 
+	fprintf(stderr, "Cannot read disk image file %s: %s\n", argv[optind], 
+		fat_strerror(err));
+	exit(1);
+    }
+    image_buf = vol->image_buf;
+    fd = vol->fd;
+    bpb = vol->bpb;
+
+    /* every copy works on the one mapping; changes to the FAT are
+       written back once, when it's unmapped */
+    stats_phase("copy");
+    if (manifest != NULL) 
+    {
+	rv = copy_manifest(manifest, fd, image_buf, bpb) > 0;
+    }
+    else if (strncmp("a:", argv[optind+1], 2)!=0 
+	     && strncmp("a:", argv[optind+2], 2)!=0) 
     {
 	usage(argv[0]);
     }
+    else 
+    {
+	rv = copy(argv[optind+1], argv[optind+2], fd, image_buf, bpb) < 0;
+    }
 
-    unmmap_file(image_buf, &fd);
-    return 0;
+    if (have_alloc)
+	alloc_destroy(&image_alloc);
+    stats_phase("close");
+    fat_close(vol);
+    stats_print(stderr);
+    trace_close();
+    return rv;
 }
@@ -0,0 +1,654 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/types.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "alloc.h"
+#include "dirindex.h"
+
+
+/* dos_defrag moves the cluster chains of every directory and file
+   into contiguous runs.  Each cluster is moved on its own: the data
+   is copied to a free cluster, whatever pointed at the old cluster
+   (the previous FAT entry, or the directory entry) is pointed at the
+   new one, and the old cluster is freed.  The file system is
+   consistent between moves, so if dos_defrag is stopped it can just
+   be run again, and it carries on with whatever is still
+   fragmented. */
+
+#define NO_CHAIN (-1)
+
+/* a cluster chain - the root directory, a subdirectory or a file */
+struct chain {
+    uint32_t *cluster;		/* the clusters, in chain order */
+    uint32_t n, cap;
+    int parent;			/* chain of the directory holding its entry */
+    uint32_t entry;		/* byte offset of that entry in the parent */
+    int is_dir;
+    int pinned;			/* already placed, or mustn't be moved */
+    char *path;
+};
+
+struct defrag {
+    uint8_t *image_buf;
+    struct bpb33 *bpb;
+    uint32_t clust_size;
+    uint32_t total;		/* total_clusters */
+    struct chain *chains;	/* chain 0 is the root directory */
+    int nchains, capchains;
+    int32_t *owner;		/* chain each cluster belongs to, or NO_CHAIN */
+    uint32_t *pos;		/* and where in that chain it is */
+    struct cluster_alloc alloc;
+    uint32_t moved;		/* clusters copied */
+};
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void interrupt(int sig)
+{
+    interrupted = 1;
+}
+
+
+static void *xrealloc(void *p, size_t size)
+{
+    p = realloc(p, size);
+    if (p == NULL)
+    {
+	fprintf(stderr, "Out of memory\n");
+	exit(1);
+    }
+    return p;
+}
+
+
+/* entry_addr returns the directory entry at byte offset entry in the
+   directory chain dir, wherever that directory is now */
+static struct direntry *entry_addr(struct defrag *d, int dir, uint32_t entry)
+{
+    struct chain *ch = &d->chains[dir];
+
+    if (dir == 0 && fat_type(d->bpb) != 32)
+	return (struct direntry*)(root_dir_addr(d->image_buf, d->bpb) + entry);
+    return (struct direntry*)(cluster_to_addr(ch->cluster[entry / d->clust_size],
+					      d->image_buf, d->bpb)
+			      + entry % d->clust_size);
+}
+
+
+/* add_chain follows the chain starting at cluster and records it.
+   Returns the new chain, or -1 if the chain is broken or shares
+   clusters with another one. */
+static int add_chain(struct defrag *d, int parent, uint32_t entry,
+		     int is_dir, char *path, uint32_t cluster)
+{
+    struct chain *ch;
+    uint32_t next;
+    int id = d->nchains;
+
+    if (d->nchains == d->capchains)
+    {
+	d->capchains = d->capchains ? d->capchains * 2 : 64;
+	d->chains = xrealloc(d->chains, d->capchains * sizeof(struct chain));
+    }
+    ch = &d->chains[id];
+    memset(ch, 0, sizeof(struct chain));
+    ch->parent = parent;
+    ch->entry = entry;
+    ch->is_dir = is_dir;
+    ch->path = path;
+    d->nchains++;
+
+    while (cluster != MSDOSFSROOT || id != 0)
+    {
+	if (!is_valid_cluster(cluster, d->bpb))
+	{
+	    fprintf(stderr, "%s: broken cluster chain\n", path);
+	    return -1;
+	}
+	if (d->owner[cluster] != NO_CHAIN)
+	{
+	    fprintf(stderr, "%s: cluster %u is also in %s\n", path, cluster,
+		    d->chains[d->owner[cluster]].path);
+	    return -1;
+	}
+	if (ch->n == ch->cap)
+	{
+	    ch->cap = ch->cap ? ch->cap * 2 : 8;
+	    ch->cluster = xrealloc(ch->cluster, ch->cap * sizeof(uint32_t));
+	}
+	d->owner[cluster] = id;
+	d->pos[cluster] = ch->n;
+	ch->cluster[ch->n++] = cluster;
+
+	next = get_fat_entry(cluster, d->image_buf, d->bpb);
+	if (is_end_of_file(next))
+	    break;
+	cluster = next;
+    }
+    return id;
+}
+
+
+/* scan_dir adds a chain for everything in directory dir */
+static int scan_dir(struct defrag *d, int dir)
+{
+    struct direntry *dirent;
+    uint32_t entry, size, cluster;
+    char name[13], *path;
+
+    if (dir == 0 && fat_type(d->bpb) != 32)
+	size = d->bpb->bpbRootDirEnts * sizeof(struct direntry);
+    else
+	size = d->chains[dir].n * d->clust_size;
+
+    for (entry = 0; entry < size; entry += sizeof(struct direntry))
+    {
+	dirent = entry_addr(d, dir, entry);
+	if (dirent->deName[0] == SLOT_EMPTY)
+	    break;
+	if (dirent->deName[0] == SLOT_DELETED || dirent->deName[0] == '.')
+	    continue;
+	if ((dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN
+	    || (dirent->deAttributes & ATTR_VOLUME) != 0)
+	    continue;
+	cluster = get_start_cluster(dirent, d->bpb);
+	if (cluster == 0)
+	    continue;		/* an empty file */
+
+	dirent_name(dirent, name);
+	path = xrealloc(NULL, strlen(d->chains[dir].path) + strlen(name) + 2);
+	sprintf(path, "%s/%s", d->chains[dir].path, name);
+	if (add_chain(d, dir, entry, (dirent->deAttributes & ATTR_DIRECTORY) != 0,
+		      path, cluster) < 0)
+	    return -1;
+    }
+    return 0;
+}
+
+
+/* collect records every chain on the disk, directories first.
+   Returns -1 if the file system needs fixing first. */
+static int collect(struct defrag *d)
+{
+    int i;
+
+    if (add_chain(d, NO_CHAIN, 0, TRUE, "", root_cluster(d->bpb)) < 0)
+	return -1;
+    /* the FAT32 root directory is found from the boot sector, and
+       stays where it is */
+    d->chains[0].pinned = TRUE;
+
+    /* the list grows as directories are read, so this reads them
+       breadth first */
+    for (i = 0; i < d->nchains; i++)
+    {
+	if (d->chains[i].is_dir && scan_dir(d, i) < 0)
+	    return -1;
+    }
+    return 0;
+}
+
+
+static int is_contiguous(struct chain *ch)
+{
+    uint32_t k;
+
+    for (k = 1; k < ch->n; k++)
+    {
+	if (ch->cluster[k] != ch->cluster[k-1] + 1)
+	    return FALSE;
+    }
+    return TRUE;
+}
+
+
+/* report prints how fragmented the disk is: how many chains are in
+   more than one piece, and what fraction of the links from one
+   cluster to the next don't go to the cluster that follows it */
+static void report(struct defrag *d, char *when)
+{
+    uint32_t links = 0, breaks = 0, k;
+    int i, nchains = 0, fragmented = 0;
+
+    for (i = 0; i < d->nchains; i++)
+    {
+	struct chain *ch = &d->chains[i];
+	if (ch->n == 0)
+	    continue;
+	nchains++;
+	links += ch->n - 1;
+	for (k = 1; k < ch->n; k++)
+	{
+	    if (ch->cluster[k] != ch->cluster[k-1] + 1)
+		breaks++;
+	}
+	if (!is_contiguous(ch))
+	    fragmented++;
+    }
+    printf("%s: %d of %d chains fragmented, %u of %u cluster links out of order"
+	   " (fragmentation %.1f%%)\n", when, fragmented, nchains, breaks, links,
+	   links ? 100.0 * breaks / links : 0.0);
+}
+
+
+/* fix_dot points the "." or ".." entry in the directory starting at
+   dir_cluster at new_cluster, if it pointed at old_cluster */
+static void fix_dot(struct defrag *d, uint32_t dir_cluster, int dotdot,
+		    uint32_t old_cluster, uint32_t new_cluster)
+{
+    struct direntry *dirent;
+    uint32_t i;
+
+    dirent = (struct direntry*)cluster_to_addr(dir_cluster, d->image_buf, d->bpb);
+    for (i = 0; i < d->clust_size / sizeof(struct direntry); i++, dirent++)
+    {
+	if (dirent->deName[0] == SLOT_EMPTY)
+	    return;
+	if (dirent->deName[0] != '.'
+	    || dirent->deName[1] != (dotdot ? '.' : ' '))
+	    continue;
+	if (get_start_cluster(dirent, d->bpb) == old_cluster)
+	    set_start_cluster(dirent, new_cluster, d->bpb);
+	return;
+    }
+}
+
+
+/* move_cluster moves the k'th cluster of chain id to the free cluster
+   dst.  The cluster it leaves is freed, but if it's in the window
+   [wstart, wstart+wlen) the chain being placed there keeps it. */
+static void move_cluster(struct defrag *d, int id, uint32_t k, uint32_t dst,
+			 uint32_t wstart, uint32_t wlen)
+{
+    struct chain *ch = &d->chains[id];
+    uint32_t old = ch->cluster[k];
+    int i;
+
+    memcpy(cluster_to_addr(dst, d->image_buf, d->bpb),
+	   cluster_to_addr(old, d->image_buf, d->bpb), d->clust_size);
+    set_fat_entry(dst, get_fat_entry(old, d->image_buf, d->bpb),
+		  d->image_buf, d->bpb);
+
+    /* point whatever led to the old cluster at the new one */
+    if (k > 0)
+    {
+	set_fat_entry(ch->cluster[k-1], dst, d->image_buf, d->bpb);
+    }
+    else
+    {
+	set_start_cluster(entry_addr(d, ch->parent, ch->entry), dst, d->bpb);
+	if (ch->is_dir)
+	{
+	    /* a directory's "." entry, and the ".." entries of its
+	       subdirectories, give its first cluster too */
+	    fix_dot(d, dst, FALSE, old, dst);
+	    for (i = 1; i < d->nchains; i++)
+	    {
+		if (d->chains[i].parent == id && d->chains[i].is_dir)
+		    fix_dot(d, d->chains[i].cluster[0], TRUE, old, dst);
+	    }
+	}
+    }
+
+    ch->cluster[k] = dst;
+    d->owner[dst] = id;
+    d->pos[dst] = k;
+    d->owner[old] = NO_CHAIN;
+    if (old >= wstart && old < wstart + wlen)
+	set_fat_entry(old, CLUST_FREE, d->image_buf, d->bpb);
+    else
+	alloc_release(&d->alloc, old);
+
+    /* make sure the FAT in the image matches the directories, in case
+       we're stopped before the end */
+    flush_fat(d->image_buf, d->bpb);
+    d->moved++;
+}
+
+
+/* window_cost returns how many clusters would have to be copied to
+   put chain id in the n clusters starting at start, or UINT32_MAX if
+   it can't go there */
+static uint32_t window_cost(struct defrag *d, int id, uint32_t start)
+{
+    uint32_t n = d->chains[id].n, k, c;
+    uint32_t evict = 0, in_place = 0, free_in_window = 0;
+    int o;
+
+    if (start < CLUST_FIRST || start > d->total - n)
+	return UINT32_MAX;
+
+    for (k = 0; k < n; k++)
+    {
+	c = start + k;
+	o = d->owner[c];
+	if (o == id)
+	{
+	    if (d->pos[c] == k)
+		in_place++;
+	    else
+		evict++;
+	}
+	else if (o == NO_CHAIN)
+	{
+	    /* lost and bad clusters can't be moved */
+	    if (get_fat_entry(c, d->image_buf, d->bpb) != CLUST_FREE)
+		return UINT32_MAX;
+	    free_in_window++;
+	}
+	else if (d->chains[o].pinned)
+	{
+	    return UINT32_MAX;
+	}
+	else
+	{
+	    evict++;
+	}
+    }
+
+    /* whatever's in the way has to go somewhere outside the window */
+    if (d->alloc.nfree - free_in_window < evict)
+	return UINT32_MAX;
+    return evict + (n - in_place);
+}
+
+
+/* longest_piece returns where chain id would start if its longest
+   contiguous piece stayed where it is */
+static uint32_t longest_piece(struct chain *ch)
+{
+    uint32_t k, run = 1, best = 1, best_start = ch->cluster[0];
+
+    for (k = 1; k < ch->n; k++)
+    {
+	run = ch->cluster[k] == ch->cluster[k-1] + 1 ? run + 1 : 1;
+	if (run > best)
+	{
+	    best = run;
+	    best_start = ch->cluster[k] - k;
+	}
+    }
+    return best_start;
+}
+
+
+/* fill_window moves chain id into the n clusters starting at start,
+   whose free clusters the caller has already taken, moving whatever
+   else is there out of the way.  Returns 0, 1 if interrupted, or -1
+   if there's nowhere to move something to. */
+static int fill_window(struct defrag *d, int id, uint32_t start)
+{
+    struct chain *ch = &d->chains[id];
+    uint32_t n = ch->n, k, slot, dst;
+    int o;
+
+    for (k = 0; k < n; k++)
+    {
+	if (interrupted)
+	    return 1;
+	slot = start + k;
+	if (ch->cluster[k] == slot)
+	    continue;
+
+	o = d->owner[slot];
+	if (o != NO_CHAIN)
+	{
+	    /* move whatever is in the way out of the window */
+	    dst = alloc_cluster(&d->alloc);
+	    if (dst == 0)
+		return -1;
+	    move_cluster(d, o, d->pos[slot], dst, start, n);
+	}
+	move_cluster(d, id, k, slot, start, n);
+    }
+    return 0;
+}
+
+
+/* place_chain makes chain id contiguous.  It goes in a free run if
+   there's one big enough, unless leaving its longest piece where it
+   is and moving the rest around it copies less.  Returns 0, 1 if
+   interrupted, or -1 if there's no room for it. */
+static int place_chain(struct defrag *d, int id)
+{
+    struct chain *ch = &d->chains[id];
+    uint32_t n = ch->n, start, len, k, slot, cost, i;
+
+    start = alloc_best_run(&d->alloc, n, &len);
+    if (start != 0 && len < n)
+    {
+	for (i = 0; i < len; i++)
+	    alloc_release(&d->alloc, start + i);
+	start = 0;
+    }
+    cost = start != 0 ? n : UINT32_MAX;
+
+    slot = longest_piece(ch);
+    if (window_cost(d, id, slot) < cost)
+    {
+	if (start != 0)
+	{
+	    for (i = 0; i < n; i++)
+		alloc_release(&d->alloc, start + i);
+	}
+	start = slot;
+	/* keep the free clusters in the window for this chain */
+	for (k = 0; k < n; k++)
+	    alloc_take(&d->alloc, start + k);
+    }
+    if (start == 0)
+	return -1;
+    return fill_window(d, id, start);
+}
+
+
+/* compact is what defrag falls back on when placing chains where
+   they fit has left the free space in pieces too small for the rest.
+   It packs every chain, directories first, from the start of the data
+   area up: each goes right after the one before, and whatever is in
+   its way moves out.  Only clusters that can't move (the FAT32 root
+   directory, and lost or bad clusters) are stepped over.  A chain
+   that's already where it would go stays put.  Returns 0, 1 if
+   interrupted, or -1 with the chain that couldn't be placed in *id. */
+static int compact(struct defrag *d, int *id)
+{
+    uint32_t cursor = CLUST_FIRST, n, k;
+    int pass, i, rv;
+
+    for (i = 1; i < d->nchains; i++)
+	d->chains[i].pinned = FALSE;
+
+    for (pass = 0; pass < 2; pass++)
+    {
+	for (i = 1; i < d->nchains; i++)
+	{
+	    struct chain *ch = &d->chains[i];
+	    if (ch->is_dir != (pass == 0) || ch->n == 0)
+		continue;
+	    n = ch->n;
+	    while (window_cost(d, i, cursor) == UINT32_MAX)
+	    {
+		if (cursor >= d->total - n)
+		{
+		    *id = i;
+		    return -1;
+		}
+		cursor++;
+	    }
+	    if (ch->cluster[0] != cursor || !is_contiguous(ch))
+	    {
+		for (k = 0; k < n; k++)
+		    alloc_take(&d->alloc, cursor + k);
+		rv = fill_window(d, i, cursor);
+		if (rv != 0)
+		{
+		    *id = i;
+		    return rv;
+		}
+	    }
+	    ch->pinned = TRUE;
+	    cursor += n;
+	}
+    }
+    return 0;
+}
+
+
+/* defrag places every chain in turn, directories first, and then
+   compacts the disk if any of them didn't fit */
+static int defrag(struct defrag *d)
+{
+    int pass, i, rv, failed = 0;
+
+    for (pass = 0; pass < 2; pass++)
+    {
+	for (i = 1; i < d->nchains; i++)
+	{
+	    struct chain *ch = &d->chains[i];
+	    if (ch->is_dir != (pass == 0))
+		continue;
+	    if (!is_contiguous(ch))
+	    {
+		rv = place_chain(d, i);
+		if (rv > 0)
+		    return 1;
+		if (rv < 0)
+		{
+		    failed++;
+		    continue;
+		}
+	    }
+	    ch->pinned = TRUE;
+	}
+    }
+    if (failed == 0)
+	return 0;
+
+    rv = compact(d, &i);
+    if (rv < 0)
+	fprintf(stderr, "Free space is too fragmented to defragment %s\n",
+		d->chains[i].path);
+    return rv > 0;
+}
+
+
+/* list_fragmented prints each fragmented chain and how many pieces
+   it's in */
+static void list_fragmented(struct defrag *d)
+{
+    uint32_t k, pieces;
+    int i;
+
+    for (i = 0; i < d->nchains; i++)
+    {
+	struct chain *ch = &d->chains[i];
+	if (ch->n == 0 || is_contiguous(ch))
+	    continue;
+	pieces = 1;
+	for (k = 1; k < ch->n; k++)
+	{
+	    if (ch->cluster[k] != ch->cluster[k-1] + 1)
+		pieces++;
+	}
+	printf("%s%s: %u clusters in %u pieces\n", i == 0 ? "/" : ch->path,
+	       ch->is_dir && i != 0 ? "/" : "", ch->n, pieces);
+    }
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [-n] <imagename>\n", progname);
+    fprintf(stderr, "\t-n only reports what is fragmented\n");
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    struct fat_volume *vol;
+    int err;
+    uint8_t *image_buf;
+    int c, rv = 0, dry_run = FALSE;
+    uint32_t i;
+    struct bpb33* bpb;
+    struct defrag d;
+
+    while ((c = getopt(argc, argv, "n")) != -1)
+    {
+	switch (c)
+	{
+	case 'n':
+	    dry_run = TRUE;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (argc - optind != 1)
+    {
+	usage(argv[0]);
+    }
+
+    err = fat_open(argv[optind], (dry_run ? FAT_RDONLY : 0) | FAT_RANDOM, &vol);
+    if (err < 0)
+    {
+	fprintf(stderr, "Cannot read disk image file %s: %s\n", argv[optind], 
+		fat_strerror(err));
+	exit(1);
+    }
+    image_buf = vol->image_buf;
+    bpb = vol->bpb;
+
+    memset(&d, 0, sizeof(d));
+    d.image_buf = image_buf;
+    d.bpb = bpb;
+    d.clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    d.total = total_clusters(bpb);
+    d.owner = xrealloc(NULL, d.total * sizeof(int32_t));
+    d.pos = xrealloc(NULL, d.total * sizeof(uint32_t));
+    for (i = 0; i < d.total; i++)
+	d.owner[i] = NO_CHAIN;
+    if (alloc_init(&d.alloc, image_buf, bpb) < 0)
+    {
+	fprintf(stderr, "Out of memory\n");
+	exit(1);
+    }
+
+    if (collect(&d) < 0)
+    {
+	fprintf(stderr, "The file system needs repairing first - run scandisk\n");
+	exit(1);
+    }
+
+    report(&d, "Before");
+    if (dry_run)
+    {
+	list_fragmented(&d);
+    }
+    else
+    {
+	/* finish the cluster being moved before stopping */
+	signal(SIGINT, interrupt);
+	signal(SIGTERM, interrupt);
+	signal(SIGHUP, interrupt);
+
+	rv = defrag(&d);
+	report(&d, "After");
+	printf("%u clusters moved\n", d.moved);
+	if (rv > 0)
+	    printf("Interrupted - run %s again to carry on\n", argv[0]);
+    }
+
+    alloc_destroy(&d.alloc);
+    fat_close(vol);
+    return rv;
+}
@@ -7,31 +7,84 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <getopt.h>
 
 #include "bootsect.h"
 #include "bpb.h"
 #include "direntry.h"
 #include "fat.h"
 #include "dos.h"
+#include "walk.h"
+#include "dirindex.h"
+#include "stream.h"
+#include "stats.h"
 
 
-void print_indent(int indent)
+/* output formats.  Everything but FORMAT_TEXT has one record per
+   entry, with the entry's full path:
+
+   json    an array of objects
+   ndjson  one object per line
+   tsv     a header line, then tab-separated lines.  Tabs, newlines and
+           backslashes in names are written as \t, \n and \\.
+   binary  BINARY_MAGIC, then for each entry, little-endian:
+             uint8  type (0 file, 1 directory, 2 volume label)
+             uint8  attributes, as in the directory entry
+             uint16 path length
+             uint32 size
+             uint32 first cluster
+             uint16 created time, created date, accessed date,
+                    modified time, modified date (DOS format)
+             the path, not NUL terminated
+
+   Times in the text formats are ISO 8601 local times, and missing
+   when the entry has none. */
+#define FORMAT_TEXT	0
+#define FORMAT_JSON	1
+#define FORMAT_NDJSON	2
+#define FORMAT_TSV	3
+#define FORMAT_BINARY	4
+
+#define BINARY_MAGIC "DOSLSB1\n"
+
+#define TYPE_FILE	0
+#define TYPE_DIR	1
+#define TYPE_VOLUME	2
+
+static const char *type_names[] = { "file", "directory", "volume" };
+
+struct listing {
+    struct bpb33 *bpb;
+    int format;
+    int started;		/* json: the first record has been written */
+};
+
+
+void print_indent(struct walk_buf *out, int indent)
 {
-    int i;
-    for (i = 0; i < indent*4; i++)
-	printf(" ");
+    static const char spaces[] = "                                ";
+    int n = indent*4;
+
+    while (n > 0)
+    {
+	int len = n < (int)sizeof(spaces) - 1 ? n : (int)sizeof(spaces) - 1;
+	walk_write(out, spaces, len);
+	n -= len;
+    }
 }
 
 
-uint16_t print_dirent(struct direntry *dirent, int indent)
+uint32_t print_dirent(struct direntry *dirent, int indent,
+		      struct walk_buf *out, void *arg)
 {
-    uint16_t followclust = 0;
+    struct bpb33 *bpb = ((struct listing*)arg)->bpb;
+    uint32_t followclust = 0;
 
     int i;
     char name[9];
     char extension[4];
     uint32_t size;
-    uint16_t file_cluster;
+    uint32_t file_cluster;
     name[8] = ' ';
     extension[3] = ' ';
     memcpy(name, &(dirent->deName[0]), 8);
@@ -80,7 +133,7 @@ uint16_t print_dirent(struct direntry *dirent, int indent)
     }
     else if ((dirent->deAttributes & ATTR_VOLUME) != 0) 
     {
-	printf("Volume: %s\n", name);
+	walk_printf(out, "Volume: %s\n", name);
     } 
     else if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) 
     {
@@ -88,9 +141,9 @@ uint16_t print_dirent(struct direntry *dirent, int indent)
         // for trash directories and such; just ignore them.
 	if ((dirent->deAttributes & ATTR_HIDDEN) != ATTR_HIDDEN)
         {
-	    print_indent(indent);
-    	    printf("%s/ (directory)\n", name);
-            file_cluster = getushort(dirent->deStartCluster);
+	    print_indent(out, indent);
+    	    walk_printf(out, "%s/ (directory)\n", name);
+            file_cluster = get_start_cluster(dirent, bpb);
             followclust = file_cluster;
         }
     }
@@ -106,9 +159,9 @@ uint16_t print_dirent(struct direntry *dirent, int indent)
 	int arch = (dirent->deAttributes & ATTR_ARCHIVE) == ATTR_ARCHIVE;
 
 	size = getulong(dirent->deFileSize);
-	print_indent(indent);
-	printf("%s.%s (%u bytes) (starting cluster %d) %c%c%c%c\n", 
-	       name, extension, size, getushort(dirent->deStartCluster),
+	print_indent(out, indent);
+	walk_printf(out, "%s.%s (%u bytes) (starting cluster %d) %c%c%c%c\n", 
+	       name, extension, size, get_start_cluster(dirent, bpb),
 	       ro?'r':' ', 
                hidden?'h':' ', 
                sys?'s':' ', 
@@ -119,69 +172,376 @@ uint16_t print_dirent(struct direntry *dirent, int indent)
 }
 
 
-void follow_dir(uint16_t cluster, int indent,
-		uint8_t *image_buf, struct bpb33* bpb)
+/* the put_ functions write at p, and return the end of what they
+   wrote.  Nothing goes through stdio until the whole tree has been
+   formatted. */
+
+static char *put_str(char *p, const char *s)
+{
+    while (*s)
+	*p++ = *s++;
+    return p;
+}
+
+
+static char *put_uint(char *p, uint32_t v)
 {
-    while (is_valid_cluster(cluster, bpb))
+    char digits[10];
+    int n = 0;
+
+    do
     {
-        struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+	digits[n++] = '0' + v % 10;
+	v /= 10;
+    } while (v > 0);
+    while (n > 0)
+	*p++ = digits[--n];
+    return p;
+}
+
 
-        int numDirEntries = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) / sizeof(struct direntry);
-        int i = 0;
-	for ( ; i < numDirEntries; i++)
+static char *put_2digits(char *p, int v)
+{
+    *p++ = '0' + v / 10 % 10;
+    *p++ = '0' + v % 10;
+    return p;
+}
+
+
+/* put_name writes a name, escaped as the format needs.  The most it
+   can write is 6 bytes for each of the name's. */
+static char *put_name(char *p, const char *s, int format)
+{
+    static const char hex[] = "0123456789abcdef";
+    uint8_t c;
+
+    for (; *s; s++)
+    {
+	c = *s;
+	if (format == FORMAT_JSON || format == FORMAT_NDJSON)
 	{
-            
-            uint16_t followclust = print_dirent(dirent, indent);
-            if (followclust)
-                follow_dir(followclust, indent+1, image_buf, bpb);
-            dirent++;
+	    if (c == '"' || c == '\\')
+	    {
+		*p++ = '\\';
+		*p++ = c;
+	    }
+	    else if (c < 0x20 || c >= 0x7f)
+	    {
+		/* not UTF-8, so take it as Latin-1 */
+		p = put_str(p, "\\u00");
+		*p++ = hex[c >> 4];
+		*p++ = hex[c & 0xf];
+	    }
+	    else
+		*p++ = c;
 	}
+	else if (format == FORMAT_TSV && (c == '\t' || c == '\n' || c == '\\'))
+	{
+	    *p++ = '\\';
+	    *p++ = c == '\t' ? 't' : c == '\n' ? 'n' : '\\';
+	}
+	else
+	    *p++ = c;
+    }
+    return p;
+}
 
-	cluster = get_fat_entry(cluster, image_buf, bpb);
+
+static char *put_path(char *p, const char *dir, const char *name, int format)
+{
+    if (dir[0] != '\0')
+    {
+	p = put_name(p, dir, format);
+	*p++ = '/';
+    }
+    return put_name(p, name, format);
+}
+
+
+/* put_time writes a DOS date (and time, unless it's NULL) in ISO 8601,
+   quoted for json.  A zero date is no time at all. */
+static char *put_time(char *p, const uint8_t *date, const uint8_t *time, int format)
+{
+    int d = getushort(date), t = time != NULL ? getushort(time) : 0;
+    int json = format == FORMAT_JSON || format == FORMAT_NDJSON;
+
+    if (d == 0)
+	return json ? put_str(p, "null") : p;
+    if (json)
+	*p++ = '"';
+    p = put_uint(p, 1980 + ((d & DD_YEAR_MASK) >> DD_YEAR_SHIFT));
+    *p++ = '-';
+    p = put_2digits(p, (d & DD_MONTH_MASK) >> DD_MONTH_SHIFT);
+    *p++ = '-';
+    p = put_2digits(p, (d & DD_DAY_MASK) >> DD_DAY_SHIFT);
+    if (time != NULL)
+    {
+	*p++ = 'T';
+	p = put_2digits(p, (t & DT_HOURS_MASK) >> DT_HOURS_SHIFT);
+	*p++ = ':';
+	p = put_2digits(p, (t & DT_MINUTES_MASK) >> DT_MINUTES_SHIFT);
+	*p++ = ':';
+	p = put_2digits(p, 2 * ((t & DT_2SECONDS_MASK) >> DT_2SECONDS_SHIFT));
     }
+    if (json)
+	*p++ = '"';
+    return p;
 }
 
 
-void traverse_root(uint8_t *image_buf, struct bpb33* bpb)
+static char *put_attributes(char *p, uint8_t attr)
 {
-    uint16_t cluster = 0;
+    if (attr & ATTR_READONLY)
+	*p++ = 'r';
+    if (attr & ATTR_HIDDEN)
+	*p++ = 'h';
+    if (attr & ATTR_SYSTEM)
+	*p++ = 's';
+    if (attr & ATTR_ARCHIVE)
+	*p++ = 'a';
+    return p;
+}
 
-    struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
 
-    int i = 0;
-    for ( ; i < bpb->bpbRootDirEnts; i++)
+/* write_record writes one entry's record straight into out */
+static void write_record(struct walk_buf *out, struct direntry *dirent,
+			 const char *name, int type, uint32_t cluster, int format)
+{
+    size_t pathlen = strlen(out->path) + 1 + strlen(name);
+    uint32_t size = getulong(dirent->deFileSize);
+    char *start, *p;
+
+    start = p = walk_reserve(out, 6 * pathlen + 512);
+
+    if (format == FORMAT_BINARY)
+    {
+	if (out->path[0] == '\0')
+	    pathlen = strlen(name);
+	*p++ = type;
+	*p++ = dirent->deAttributes;
+	putushort(p, pathlen);
+	putulong(p + 2, size);
+	putulong(p + 6, cluster);
+	memcpy(p + 10, dirent->deCTime, 4);
+	memcpy(p + 14, dirent->deADate, 2);
+	memcpy(p + 16, dirent->deMTime, 4);
+	p = put_path(p + 20, out->path, name, format);
+    }
+    else if (format == FORMAT_TSV)
+    {
+	p = put_path(p, out->path, name, format);
+	*p++ = '\t';
+	p = put_str(p, type_names[type]);
+	*p++ = '\t';
+	p = put_uint(p, size);
+	*p++ = '\t';
+	p = put_uint(p, cluster);
+	*p++ = '\t';
+	p = put_attributes(p, dirent->deAttributes);
+	*p++ = '\t';
+	p = put_time(p, dirent->deCDate, dirent->deCTime, format);
+	*p++ = '\t';
+	p = put_time(p, dirent->deADate, NULL, format);
+	*p++ = '\t';
+	p = put_time(p, dirent->deMDate, dirent->deMTime, format);
+	*p++ = '\n';
+    }
+    else
     {
-        uint16_t followclust = print_dirent(dirent, 0);
-        if (is_valid_cluster(followclust, bpb))
-            follow_dir(followclust, 1, image_buf, bpb);
+	/* every json record starts with a comma, and the sink drops
+	   the first one */
+	if (format == FORMAT_JSON)
+	    p = put_str(p, ",\n");
+	p = put_str(p, "{\"path\":\"");
+	p = put_path(p, out->path, name, format);
+	p = put_str(p, "\",\"type\":\"");
+	p = put_str(p, type_names[type]);
+	p = put_str(p, "\",\"size\":");
+	p = put_uint(p, size);
+	p = put_str(p, ",\"cluster\":");
+	p = put_uint(p, cluster);
+	p = put_str(p, ",\"attributes\":\"");
+	p = put_attributes(p, dirent->deAttributes);
+	p = put_str(p, "\",\"created\":");
+	p = put_time(p, dirent->deCDate, dirent->deCTime, format);
+	p = put_str(p, ",\"accessed\":");
+	p = put_time(p, dirent->deADate, NULL, format);
+	p = put_str(p, ",\"modified\":");
+	p = put_time(p, dirent->deMDate, dirent->deMTime, format);
+	*p++ = '}';
+	if (format == FORMAT_NDJSON)
+	    *p++ = '\n';
+    }
+    out->len += p - start;
+}
+
+
+/* list_dirent is print_dirent for the machine-readable formats.  It
+   lists the same entries. */
+uint32_t list_dirent(struct direntry *dirent, int depth,
+		     struct walk_buf *out, void *arg)
+{
+    struct listing *l = arg;
+    uint8_t c = dirent->deName[0];
+    char name[MAXFILENAME];
+    uint32_t cluster;
+    int i, type;
+
+    if (c == SLOT_EMPTY || c == SLOT_DELETED || c == '.')
+	return 0;
+    if ((dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN)
+	return 0;
+
+    if ((dirent->deAttributes & ATTR_VOLUME) != 0)
+    {
+	/* a label is all eleven characters, without a dot */
+	memcpy(name, dirent->deName, 8);
+	memcpy(name + 8, dirent->deExtension, 3);
+	for (i = 11; i > 0 && name[i-1] == ' '; i--)
+	    ;
+	name[i] = '\0';
+	type = TYPE_VOLUME;
+    }
+    else
+    {
+	/* hidden directories are left out, as in the text listing */
+	if ((dirent->deAttributes & (ATTR_DIRECTORY | ATTR_HIDDEN)) 
+	    == (ATTR_DIRECTORY | ATTR_HIDDEN))
+	    return 0;
+	dirent_name(dirent, name);
+	type = (dirent->deAttributes & ATTR_DIRECTORY) ? TYPE_DIR : TYPE_FILE;
+    }
+
+    cluster = get_start_cluster(dirent, l->bpb);
+    write_record(out, dirent, name, type, cluster, l->format);
+    return type == TYPE_DIR ? cluster : 0;
+}
+
 
-        dirent++;
+void print_out(const char *data, size_t len, void *arg)
+{
+    struct listing *l = arg;
+
+    if (l->format == FORMAT_JSON && !l->started && len > 0)
+    {
+	/* the first record's comma */
+	data++;
+	len--;
+	l->started = 1;
     }
+    fwrite(data, 1, len, stdout);
+}
+
+
+/* the tree is listed by walk_tree, one directory per task, and comes
+   out in the same order as a plain depth-first walk */
+void traverse_root(uint8_t *image_buf, struct bpb33* bpb, int nthreads, int format)
+{
+    struct walk_ops ops;
+    struct listing l;
+
+    memset(&l, 0, sizeof(l));
+    l.bpb = bpb;
+    l.format = format;
+
+    if (format == FORMAT_JSON)
+	fputs("[", stdout);
+    else if (format == FORMAT_TSV)
+	fputs("path\ttype\tsize\tcluster\tattributes\tcreated\taccessed\tmodified\n", stdout);
+    else if (format == FORMAT_BINARY)
+	fwrite(BINARY_MAGIC, 1, 8, stdout);
+
+    memset(&ops, 0, sizeof(ops));
+    ops.entry = format == FORMAT_TEXT ? print_dirent : list_dirent;
+    ops.sink = print_out;
+    walk_tree(image_buf, bpb, nthreads, &ops, &l);
+
+    if (format == FORMAT_JSON)
+	fputs("\n]\n", stdout);
 }
 
 
 void usage(char *progname)
 {
-    fprintf(stderr, "usage: %s <imagename>\n", progname);
+    fprintf(stderr, "usage: %s [-j threads] [--format=text|json|ndjson|tsv|binary] [--stats] <imagename>\n",
+	    progname);
+    fprintf(stderr, "\t-f, --format\tlist every entry with its full path, one record each\n");
+    fprintf(stderr, "\t--stats\t\tprint operation counts and times to stderr\n");
+    fprintf(stderr, "\t<imagename> - reads the image from stdin\n");
     exit(1);
 }
 
 
 int main(int argc, char** argv)
 {
+    struct fat_volume *vol;
+    int err;
     uint8_t *image_buf;
-    int fd;
     struct bpb33* bpb;
-    if (argc != 2)
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int c, format = FORMAT_TEXT;
+    static const char *format_names[] = { "text", "json", "ndjson", "tsv", "binary" };
+    static struct option options[] = {
+	{ "format", required_argument, NULL, 'f' },
+	{ "stats", no_argument, NULL, 's' },
+	{ NULL, 0, NULL, 0 }
+    };
+
+    while ((c = getopt_long(argc, argv, "j:f:", options, NULL)) != -1)
+    {
+	switch (c)
+	{
+	case 'j':
+	    nthreads = atoi(optarg);
+	    if (nthreads < 1)
+		usage(argv[0]);
+	    break;
+	case 'f':
+	    for (format = FORMAT_BINARY; format >= 0; format--)
+	    {
+		if (strcmp(optarg, format_names[format]) == 0)
+		    break;
+	    }
+	    if (format < 0)
+		usage(argv[0]);
+	    break;
+	case 's':
+	    stats_start();
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (argc - optind != 1)
     {
 	usage(argv[0]);
     }
 
-    image_buf = mmap_file(argv[1], &fd);
-    bpb = check_bootsector(image_buf);
-    traverse_root(image_buf, bpb);
+    /* the directory tree is read in no particular order.  Streamed
+       in, only the directories are needed. */
+    stats_phase("open");
+    if (strcmp(argv[optind], "-") == 0)
+	err = stream_open(stdin, FAT_RDONLY, NULL, NULL, &vol);
+    else
+	err = fat_open(argv[optind], FAT_RDONLY | FAT_RANDOM | FAT_POPULATE, &vol);
+    if (err < 0)
+    {
+	fprintf(stderr, "Cannot read disk image file %s: %s\n", argv[optind], 
+		fat_strerror(err));
+	exit(1);
+    }
+    image_buf = vol->image_buf;
+    bpb = vol->bpb;
+    /* the walk hands over the listing in large pieces, so let stdio
+       pass them on in large writes too */
+    setvbuf(stdout, NULL, _IOFBF, 1 << 20);
+    stats_phase("list");
+    traverse_root(image_buf, bpb, nthreads, format);
+    fflush(stdout);
 
-    unmmap_file(image_buf, &fd);
+    stats_phase("close");
+    fat_close(vol);
+    stats_print(stderr);
 
     return 0;
 }
@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+
+#include "bpb.h"
+#include "fat.h"
+#include "dos.h"
+#include "synth.h"
+
+
+/* dos_mkimage makes a synthetic disk image (see synth.h): a freshly
+   formatted volume filled with generated directories and files, laid
+   out and damaged as asked.  The same options and seed always make
+   the same image. */
+
+
+/* write_at writes all of len bytes from p at offset in fd.  Returns
+   0, or -1 with errno set. */
+static int write_at(int fd, const void *p, size_t len, off_t offset)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+	n = pwrite(fd, p, len, offset);
+	if (n < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	p = (const uint8_t*)p + n;
+	len -= n;
+	offset += n;
+    }
+    return 0;
+}
+
+
+/* parse_size reads a number of bytes, with an optional K, M or G.
+   Returns -1 if it isn't one. */
+static int64_t parse_size(const char *s)
+{
+    char *end;
+    uint64_t n;
+
+    errno = 0;
+    n = strtoull(s, &end, 10);
+    if (errno != 0 || end == s)
+	return -1;
+    switch (*end)
+    {
+    case 'g': case 'G':
+	n <<= 10;
+	/* fall through */
+    case 'm': case 'M':
+	n <<= 10;
+	/* fall through */
+    case 'k': case 'K':
+	n <<= 10;
+	end++;
+    }
+    if (*end != '\0' || n > INT64_MAX)
+	return -1;
+    return n;
+}
+
+
+/* parse_damage reads a list like "orphans=2,crosslinks=1" into spec */
+static int parse_damage(char *list, struct synth_spec *spec)
+{
+    char *item, *value;
+    uint32_t n;
+
+    for (item = strtok(list, ","); item != NULL; item = strtok(NULL, ","))
+    {
+	value = strchr(item, '=');
+	n = 1;
+	if (value != NULL)
+	{
+	    *value++ = '\0';
+	    n = atoi(value);
+	}
+	if (strcmp(item, "orphans") == 0)
+	    spec->orphans = n;
+	else if (strcmp(item, "size") == 0)
+	    spec->size_mismatches = n;
+	else if (strcmp(item, "bad") == 0)
+	    spec->bad_clusters = n;
+	else if (strcmp(item, "crosslinks") == 0)
+	    spec->crosslinks = n;
+	else
+	    return -1;
+    }
+    return 0;
+}
+
+
+/* write_image writes the volume to filename.  Only clusters that are
+   in use are written, so the rest of the file is holes. */
+static int write_image(struct fat_volume *vol, const char *filename)
+{
+    uint8_t *image_buf = vol->image_buf;
+    struct bpb33 *bpb = vol->bpb;
+    uint32_t c, start, clusters = total_clusters(bpb);
+    size_t cluster_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    size_t data_offset = cluster_to_addr(CLUST_FIRST, image_buf, bpb) - image_buf;
+    int fd;
+
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0
+	|| ftruncate(fd, vol->size) < 0
+	|| write_at(fd, image_buf, data_offset, 0) < 0)
+	return -1;
+    for (c = CLUST_FIRST; c < clusters; c++)
+    {
+	if (get_fat_entry(c, image_buf, bpb) == CLUST_FREE)
+	    continue;
+	for (start = c; c < clusters && get_fat_entry(c, image_buf, bpb) != CLUST_FREE; c++)
+	    ;
+	if (write_at(fd, cluster_to_addr(start, image_buf, bpb), (c - start) * cluster_size,
+		     data_offset + (off_t)(start - CLUST_FIRST) * cluster_size) < 0)
+	    return -1;
+    }
+    return close(fd);
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [options] <imagename>\n", progname);
+    fprintf(stderr, "\t-t 12|16|32\tFAT type (default 16)\n");
+    fprintf(stderr, "\t-s size\t\tof the volume, with K, M or G (default 32M)\n");
+    fprintf(stderr, "\t-c sectors\tper cluster (default: whatever suits the size)\n");
+    fprintf(stderr, "\t-r entries\tin a FAT12/16 root directory (default 512)\n");
+    fprintf(stderr, "\t-n files\t(default 100)\n");
+    fprintf(stderr, "\t-d directories\t(default 10)\n");
+    fprintf(stderr, "\t-D depth\tof the deepest directory (default 4)\n");
+    fprintf(stderr, "\t-T random|even|deep\thow directories are stacked (default random)\n");
+    fprintf(stderr, "\t-z min-max\tfile sizes, with K, M or G (default 1-64K)\n");
+    fprintf(stderr, "\t-Z log|uniform\thow sizes are spread (default log)\n");
+    fprintf(stderr, "\t-l contiguous|interleaved[:files[:clusters]]|random\n");
+    fprintf(stderr, "\t\t\twhere files' clusters go (default contiguous; interleaved 4:4)\n");
+    fprintf(stderr, "\t-x orphans=N,size=N,bad=N,crosslinks=N\tdamage to do\n");
+    fprintf(stderr, "\t-S seed\t\t(default 1)\n");
+    fprintf(stderr, "\t-e\t\tleaves file contents zero\n");
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    struct synth_spec spec;
+    struct fat_volume *vol;
+    int64_t lo, hi;
+    char *p;
+    int c, err;
+
+    synth_defaults(&spec);
+    spec.log = stdout;
+    while ((c = getopt(argc, argv, "t:s:c:r:n:d:D:T:z:Z:l:x:S:e")) != -1)
+    {
+	switch (c)
+	{
+	case 't':
+	    spec.fat_type = atoi(optarg);
+	    break;
+	case 's':
+	    lo = parse_size(optarg);
+	    if (lo < 0)
+		usage(argv[0]);
+	    spec.size = lo;
+	    break;
+	case 'c':
+	    spec.sectors_per_cluster = atoi(optarg);
+	    if (spec.sectors_per_cluster < 1 || spec.sectors_per_cluster > 128
+		|| (spec.sectors_per_cluster & (spec.sectors_per_cluster - 1)) != 0)
+		usage(argv[0]);
+	    break;
+	case 'r':
+	    spec.root_entries = atoi(optarg);
+	    break;
+	case 'n':
+	    spec.files = strtoul(optarg, NULL, 10);
+	    break;
+	case 'd':
+	    spec.dirs = strtoul(optarg, NULL, 10);
+	    break;
+	case 'D':
+	    spec.max_depth = atoi(optarg);
+	    break;
+	case 'T':
+	    if (strcmp(optarg, "random") == 0)
+		spec.tree = SYNTH_TREE_RANDOM;
+	    else if (strcmp(optarg, "even") == 0)
+		spec.tree = SYNTH_TREE_EVEN;
+	    else if (strcmp(optarg, "deep") == 0)
+		spec.tree = SYNTH_TREE_DEEP;
+	    else
+		usage(argv[0]);
+	    break;
+	case 'z':
+	    p = strchr(optarg, '-');
+	    if (p == NULL)
+		usage(argv[0]);
+	    *p++ = '\0';
+	    lo = parse_size(optarg);
+	    hi = parse_size(p);
+	    if (lo < 0 || hi < lo || hi > 0xffffffff)
+		usage(argv[0]);
+	    spec.min_size = lo;
+	    spec.max_size = hi;
+	    break;
+	case 'Z':
+	    if (strcmp(optarg, "log") == 0)
+		spec.size_dist = SYNTH_SIZE_LOG;
+	    else if (strcmp(optarg, "uniform") == 0)
+		spec.size_dist = SYNTH_SIZE_UNIFORM;
+	    else
+		usage(argv[0]);
+	    break;
+	case 'l':
+	    if (strcmp(optarg, "contiguous") == 0)
+		spec.layout = SYNTH_CONTIGUOUS;
+	    else if (strcmp(optarg, "random") == 0)
+		spec.layout = SYNTH_RANDOM;
+	    else if (strncmp(optarg, "interleaved", 11) == 0
+		     && (optarg[11] == '\0' || optarg[11] == ':'))
+	    {
+		spec.layout = SYNTH_INTERLEAVED;
+		if (optarg[11] == ':')
+		    spec.interleave = strtoul(optarg + 12, &p, 10);
+		if (optarg[11] == ':' && *p == ':')
+		    spec.chunk = strtoul(p + 1, NULL, 10);
+	    }
+	    else
+		usage(argv[0]);
+	    break;
+	case 'x':
+	    if (parse_damage(optarg, &spec) < 0)
+		usage(argv[0]);
+	    break;
+	case 'S':
+	    spec.seed = strtoul(optarg, NULL, 10);
+	    break;
+	case 'e':
+	    spec.fill = FALSE;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (argc - optind != 1)
+    {
+	usage(argv[0]);
+    }
+
+    err = synth_image(&spec, &vol);
+    if (err == -EINVAL)
+    {
+	fprintf(stderr, "Cannot make a FAT%d volume like that\n", spec.fat_type);
+	exit(1);
+    }
+    if (err < 0)
+    {
+	fprintf(stderr, "Cannot make the volume: %s\n", fat_strerror(err));
+	exit(1);
+    }
+
+    if (write_image(vol, argv[optind]) < 0)
+    {
+	fprintf(stderr, "Cannot write %s: %s\n", argv[optind], strerror(errno));
+	exit(1);
+    }
+    fat_close(vol);
+    return 0;
+}
@@ -0,0 +1,345 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "sparse.h"
+#include "bitset.h"
+
+
+/* dos_sparse converts between disk images and sparse containers (see
+   sparse.h), which leave out the clusters the FAT says are free.  The
+   other tools can read a container as it is; anything that writes to
+   the image needs it unpacked first. */
+
+
+/* write_at writes all of len bytes from p at offset in fd.  Returns
+   0, or -1 with errno set. */
+static int write_at(int fd, const void *p, size_t len, off_t offset)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+	n = pwrite(fd, p, len, offset);
+	if (n < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	p = (const uint8_t*)p + n;
+	len -= n;
+	offset += n;
+    }
+    return 0;
+}
+
+
+/* next_run finds the next run of present clusters in bitmap at or
+   after *i, leaving its first bit in *i.  Returns its length, or 0 if
+   there are no more. */
+static uint32_t next_run(const uint8_t *bitmap, uint32_t nbits, uint32_t *i)
+{
+    uint32_t j;
+
+    while (*i < nbits && !SPARSE_PRESENT(bitmap, *i))
+	(*i)++;
+    for (j = *i; j < nbits && SPARSE_PRESENT(bitmap, j); j++)
+	;
+    return j - *i;
+}
+
+
+/* keep_chain marks every cluster the chain starting at cluster goes
+   through as present.  That includes one the FAT says is free or bad:
+   the chain still reaches it, so reading the file reads it. */
+static void keep_chain(uint32_t cluster, uint8_t *bitmap, uint32_t full,
+		       uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint32_t steps = 0, max_clusters = total_clusters(bpb);
+
+    while (is_valid_cluster(cluster, bpb) && cluster - CLUST_FIRST < full
+	   && steps++ < max_clusters)
+    {
+	bitmap[(cluster - CLUST_FIRST) / 8] |= 1 << ((cluster - CLUST_FIRST) % 8);
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+    }
+}
+
+
+/* keep_dir marks every cluster the entries in the directory starting
+   at cluster (MSDOSFSROOT for a FAT12/16 root) reach as present,
+   even where the FAT says it's free or bad: on a damaged image that
+   can be all scandisk has to go on, and dos_cat and dos_cp read
+   whatever the chain goes through.  Subdirectories are followed, each
+   once. */
+static void keep_dir(uint32_t cluster, uint8_t *bitmap, uint32_t full,
+		     uint64_t *seen, uint8_t *image_buf, struct bpb33 *bpb)
+{
+    struct direntry *dirent;
+    uint32_t start, steps = 0, max_clusters = total_clusters(bpb);
+    int i, nents;
+
+    if (cluster == MSDOSFSROOT && fat_type(bpb) != 32)
+	nents = bpb->bpbRootDirEnts;
+    else
+	nents = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) / sizeof(struct direntry);
+
+    while (steps++ < max_clusters)
+    {
+	dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+	for (i = 0; i < nents; i++, dirent++)
+	{
+	    if (dirent->deName[0] == SLOT_EMPTY)
+		return;
+	    if (dirent->deName[0] == SLOT_DELETED || dirent->deName[0] == '.'
+		|| (dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN)
+		continue;
+	    start = get_start_cluster(dirent, bpb);
+	    if (!is_valid_cluster(start, bpb) || start - CLUST_FIRST >= full)
+		continue;
+	    keep_chain(start, bitmap, full, image_buf, bpb);
+	    if ((dirent->deAttributes & ATTR_DIRECTORY) && !bitset_test(seen, start))
+	    {
+		bitset_set(seen, start);
+		keep_dir(start, bitmap, full, seen, image_buf, bpb);
+	    }
+	}
+	if (cluster == MSDOSFSROOT && fat_type(bpb) != 32)
+	    return;
+	if (cluster == MSDOSFSROOT)
+	    cluster = root_cluster(bpb);
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+	if (!is_valid_cluster(cluster, bpb))
+	    return;
+    }
+}
+
+
+static struct fat_volume *open_image(const char *filename)
+{
+    struct fat_volume *vol;
+    int err;
+
+    err = fat_open(filename, FAT_RDONLY | FAT_SEQUENTIAL, &vol);
+    if (err < 0)
+    {
+	fprintf(stderr, "Cannot read disk image file %s: %s\n", filename,
+		fat_strerror(err));
+	exit(1);
+    }
+    return vol;
+}
+
+
+static int create(const char *filename)
+{
+    int fd;
+
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+    {
+	fprintf(stderr, "Cannot create %s: %s\n", filename, strerror(errno));
+	exit(1);
+    }
+    return fd;
+}
+
+
+/* pack writes the image from as a sparse container to */
+int pack(const char *from, const char *to)
+{
+    struct fat_volume *vol;
+    struct sparse_header h;
+    uint8_t *image_buf, *bitmap;
+    uint64_t *seen;
+    struct bpb33 *bpb;
+    uint32_t clust_size, nbits, full, i, n, npresent = 0, rank = 0, next;
+    size_t data_offset, bitmap_size;
+    uint64_t packed_offset, tail_start, tail_offset;
+    int fd;
+
+    vol = open_image(from);
+    if (fat_sparse(vol) != NULL)
+    {
+	fprintf(stderr, "%s is a sparse container already\n", from);
+	exit(1);
+    }
+    image_buf = vol->image_buf;
+    bpb = vol->bpb;
+    clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    nbits = total_clusters(bpb) - CLUST_FIRST;
+    data_offset = cluster_to_addr(CLUST_FIRST, image_buf, bpb) - image_buf;
+
+    /* only clusters that are all in the image can be packed; any part
+       of one at the end goes in the tail */
+    full = (vol->size - data_offset) / clust_size;
+    if (full > nbits)
+	full = nbits;
+    tail_start = data_offset + (uint64_t)full * clust_size;
+
+    bitmap_size = (nbits + 7) / 8;
+    bitmap = calloc(1, bitmap_size);
+    if (bitmap == NULL)
+    {
+	fprintf(stderr, "Out of memory\n");
+	exit(1);
+    }
+    seen = bitset_alloc(nbits + CLUST_FIRST);
+    if (seen == NULL)
+    {
+	fprintf(stderr, "Out of memory\n");
+	exit(1);
+    }
+    for (i = 0; i < full; i++)
+    {
+	next = get_fat_entry(i + CLUST_FIRST, image_buf, bpb);
+	if (next != CLUST_FREE && next != CLUST_BAD)
+	    bitmap[i / 8] |= 1 << (i % 8);
+    }
+    keep_dir(MSDOSFSROOT, bitmap, full, seen, image_buf, bpb);
+    free(seen);
+    for (i = 0; i < full; i++)
+	npresent += SPARSE_PRESENT(bitmap, i);
+
+    packed_offset = data_offset + sizeof(h) + bitmap_size;
+    packed_offset = (packed_offset + SPARSE_ALIGN - 1) / SPARSE_ALIGN * SPARSE_ALIGN;
+    tail_offset = packed_offset + (uint64_t)npresent * clust_size;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SPARSE_MAGIC, sizeof(h.magic));
+    putulong(h.version, SPARSE_VERSION);
+    putulong(h.cluster_size, clust_size);
+    putulong(h.clusters, nbits + CLUST_FIRST);
+    putulong(h.npresent, npresent);
+    put64(h.image_size, vol->size);
+    put64(h.packed_offset, packed_offset);
+    put64(h.tail_start, tail_start);
+    put64(h.tail_offset, tail_offset);
+
+    fd = create(to);
+    if (write_at(fd, image_buf, data_offset, 0) < 0
+	|| write_at(fd, &h, sizeof(h), data_offset) < 0
+	|| write_at(fd, bitmap, bitmap_size, data_offset + sizeof(h)) < 0)
+	goto fail;
+    for (i = 0; (n = next_run(bitmap, full, &i)) > 0; i += n, rank += n)
+    {
+	if (write_at(fd, cluster_to_addr(i + CLUST_FIRST, image_buf, bpb),
+		     (size_t)n * clust_size, packed_offset + (uint64_t)rank * clust_size) < 0)
+	    goto fail;
+    }
+    if (write_at(fd, image_buf + tail_start, vol->size - tail_start, tail_offset) < 0
+	|| ftruncate(fd, tail_offset + vol->size - tail_start) < 0
+	|| close(fd) < 0)
+	goto fail;
+
+    printf("%u of %u clusters packed, %llu bytes instead of %llu\n",
+	   npresent, nbits,
+	   (unsigned long long)(tail_offset + vol->size - tail_start),
+	   (unsigned long long)vol->size);
+    free(bitmap);
+    fat_close(vol);
+    return 0;
+
+ fail:
+    fprintf(stderr, "Cannot write %s: %s\n", to, strerror(errno));
+    exit(1);
+}
+
+
+/* unpack writes the sparse container from back out as an image to.
+   The clusters that were left out become holes in it. */
+int unpack(const char *from, const char *to)
+{
+    struct fat_volume *vol;
+    struct sparse_header *h;
+    uint8_t *image_buf, *bitmap;
+    struct bpb33 *bpb;
+    uint32_t clust_size, nbits, i, n;
+    size_t data_offset;
+    uint64_t image_size, tail_start;
+    int fd;
+
+    vol = open_image(from);
+    h = fat_sparse(vol);
+    if (h == NULL)
+    {
+	fprintf(stderr, "%s isn't a sparse container\n", from);
+	exit(1);
+    }
+    image_buf = vol->image_buf;
+    bpb = vol->bpb;
+    clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    nbits = total_clusters(bpb) - CLUST_FIRST;
+    data_offset = (uint8_t*)h - image_buf;
+    bitmap = (uint8_t*)(h + 1);
+    image_size = get64(h->image_size);
+    tail_start = get64(h->tail_start);
+
+    fd = create(to);
+    if (ftruncate(fd, image_size) < 0
+	|| write_at(fd, image_buf, data_offset, 0) < 0)
+	goto fail;
+    for (i = 0; (n = next_run(bitmap, nbits, &i)) > 0; i += n)
+    {
+	if (write_at(fd, cluster_to_addr(i + CLUST_FIRST, image_buf, bpb),
+		     (size_t)n * clust_size, data_offset + (uint64_t)i * clust_size) < 0)
+	    goto fail;
+    }
+    if (write_at(fd, image_buf + get64(h->tail_offset), image_size - tail_start,
+		 tail_start) < 0
+	|| close(fd) < 0)
+	goto fail;
+
+    fat_close(vol);
+    return 0;
+
+ fail:
+    fprintf(stderr, "Cannot write %s: %s\n", to, strerror(errno));
+    exit(1);
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s <imagename> <container>\n", progname);
+    fprintf(stderr, "       %s -u <container> <imagename>\n", progname);
+    fprintf(stderr, "\tpacks a disk image into a sparse container, leaving out free clusters\n");
+    fprintf(stderr, "\t-u unpacks a container back into a disk image\n");
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    int c, unpacking = FALSE;
+
+    while ((c = getopt(argc, argv, "u")) != -1)
+    {
+	switch (c)
+	{
+	case 'u':
+	    unpacking = TRUE;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (argc - optind != 2)
+    {
+	usage(argv[0]);
+    }
+
+    if (unpacking)
+	return unpack(argv[optind], argv[optind + 1]);
+    return pack(argv[optind], argv[optind + 1]);
+}
@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "bpb.h"
+#include "fat.h"
+#include "dos.h"
+#include "extent.h"
+#include "stats.h"
+
+
+/* build_extent_map walks the chain starting at start_cluster and
+   merges consecutive cluster numbers into runs, as long as they're in
+   the image file: in a sparse container a left-out cluster is a run of
+   its own, and the clusters either side of it are in different runs,
+   so each run is contiguous in memory and in the file.  The walk stops at
+   the first entry that isn't a valid cluster, or after as many
+   clusters as the disk has, so a looped chain can't hang it.
+   Returns 0 on success, -1 if out of memory. */
+int build_extent_map(struct extent_map *map, uint32_t start_cluster,
+		     uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint32_t max_clusters = total_clusters(bpb);
+    uint32_t cluster = start_cluster;
+    struct extent *e = NULL;
+    int in_image = FALSE, run_in_image = FALSE;
+
+    map->start_cluster = start_cluster;
+    map->nclusters = 0;
+    map->nextents = 0;
+    map->capacity = 0;
+    map->ext = NULL;
+
+    while (is_valid_cluster(cluster, bpb) && map->nclusters < max_clusters) 
+    {
+	in_image = cluster_in_image(cluster, bpb);
+	if (e != NULL && cluster == e->start + e->length
+	    && in_image && run_in_image) 
+	{
+	    /* continues the current run */
+	    e->length++;
+	} 
+	else 
+	{
+	    if (map->nextents == map->capacity) 
+	    {
+		int capacity = map->capacity ? map->capacity * 2 : 8;
+		struct extent *ext = realloc(map->ext, capacity * sizeof(struct extent));
+		if (ext == NULL) 
+		{
+		    free_extent_map(map);
+		    return -1;
+		}
+		map->ext = ext;
+		map->capacity = capacity;
+	    }
+	    e = &map->ext[map->nextents++];
+	    e->start = cluster;
+	    e->length = 1;
+	    run_in_image = in_image;
+	}
+	map->nclusters++;
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+    }
+    map->end = cluster;
+    STATS_CHAIN(map->nclusters);
+    return 0;
+}
+
+
+void free_extent_map(struct extent_map *map)
+{
+    free(map->ext);
+    map->ext = NULL;
+    map->nextents = 0;
+    map->capacity = 0;
+    map->nclusters = 0;
+}
+
+
+/* small direct-mapped cache of extent maps, keyed by image and start
+   cluster.  An entry is only reused if the FAT hasn't been written
+   since it was built.  It's per thread, so lookups don't need a
+   lock. */
+#define EXTENT_CACHE_SLOTS 64
+
+static __thread struct extent_cache_slot {
+    uint8_t *image_buf;
+    uint64_t generation;
+    struct extent_map map;
+} extent_cache[EXTENT_CACHE_SLOTS];
+
+
+/* get_extent_map returns the extent map for the chain starting at
+   start_cluster, building it if it isn't cached.  The map belongs to
+   the cache and stays valid until the next call. */
+struct extent_map *get_extent_map(uint32_t start_cluster,
+				  uint8_t *image_buf, struct bpb33 *bpb)
+{
+    struct extent_cache_slot *slot;
+    uint64_t generation = get_fat_generation(bpb);
+
+    slot = &extent_cache[start_cluster % EXTENT_CACHE_SLOTS];
+    if (slot->image_buf == image_buf && slot->generation == generation
+	&& slot->map.start_cluster == start_cluster) 
+    {
+	return &slot->map;
+    }
+
+    free_extent_map(&slot->map);
+    slot->image_buf = NULL;
+    if (build_extent_map(&slot->map, start_cluster, image_buf, bpb) < 0)
+	return NULL;
+    slot->image_buf = image_buf;
+    slot->generation = generation;
+    return &slot->map;
+}
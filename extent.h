@@ -0,0 +1,29 @@
+#ifndef __EXTENT_H__
+#define __EXTENT_H__
+
+#include <stdint.h>
+
+/* a run of physically contiguous clusters in a file's chain */
+struct extent {
+    uint32_t start;		/* first cluster of the run */
+    uint32_t length;		/* number of clusters in the run */
+};
+
+/* the cluster chain starting at start_cluster, as a list of runs */
+struct extent_map {
+    uint32_t start_cluster;
+    uint32_t end;		/* FAT value that ended the chain */
+    uint32_t nclusters;		/* total clusters in all the runs */
+    int nextents;
+    int capacity;
+    struct extent *ext;
+};
+
+/* prototypes for functions in extent.c */
+
+int build_extent_map(struct extent_map *, uint32_t, uint8_t *, struct bpb33 *);
+void free_extent_map(struct extent_map *);
+
+struct extent_map *get_extent_map(uint32_t, uint8_t *, struct bpb33 *);
+
+#endif // __EXTENT_H__
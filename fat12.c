@@ -0,0 +1,224 @@
+#include <string.h>
+
+#include "fat12.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FAT12_X86
+#include <immintrin.h>
+#endif
+
+
+/* the plain kernels, which the others have to agree with.  Group i is
+   bytes 3i..3i+2 and entries 2i and 2i+1. */
+static void unpack_scalar(const uint8_t *p, uint16_t *entry, size_t groups)
+{
+    size_t i;
+
+    for (i = 0; i < groups; i++, p += 3)
+    {
+	entry[2*i] = ((0x0f & p[1]) << 8) | p[0];
+	entry[2*i + 1] = (p[2] << 4) | ((0xf0 & p[1]) >> 4);
+    }
+}
+
+
+static void pack_scalar(const uint16_t *entry, uint8_t *p, size_t groups)
+{
+    uint16_t e0, e1;
+    size_t i;
+
+    for (i = 0; i < groups; i++, p += 3)
+    {
+	e0 = entry[2*i];
+	e1 = entry[2*i + 1];
+	p[0] = (uint8_t)(0xff & e0);
+	p[1] = (uint8_t)((0x0f & (e0 >> 8)) | ((0x0f & e1) << 4));
+	p[2] = (uint8_t)(0xff & (e1 >> 4));
+    }
+}
+
+
+#ifdef FAT12_X86
+
+/* Unpacking four groups: a byte shuffle puts bytes 3k,3k+1 in the
+   even 16-bit lane of each pair and 3k+1,3k+2 in the odd one.  The
+   even entry is then the low 12 bits of its lane, and the odd one the
+   high 12.  Packing goes the other way: each pair of entries becomes
+   the 24-bit e0 | e1 << 12 in a 32-bit lane, and a shuffle drops
+   every fourth byte. */
+
+#define UNPACK_SHUFFLE 0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11
+#define PACK_SHUFFLE 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1
+
+__attribute__((target("ssse3")))
+static void unpack_ssse3(const uint8_t *p, uint16_t *entry, size_t groups)
+{
+    const __m128i shuffle = _mm_setr_epi8(UNPACK_SHUFFLE);
+    const __m128i even = _mm_set1_epi32(0x00000fff);
+    const __m128i odd = _mm_set1_epi32(0xffff0000);
+    __m128i v;
+    size_t i;
+
+    /* each load reads 16 bytes to use 12, so the last few groups are
+       left to the plain kernel rather than read past the end */
+    for (i = 0; i + 6 <= groups; i += 4)
+    {
+	v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 3*i)), shuffle);
+	v = _mm_or_si128(_mm_and_si128(v, even),
+			 _mm_and_si128(_mm_srli_epi16(v, 4), odd));
+	_mm_storeu_si128((__m128i*)(entry + 2*i), v);
+    }
+    unpack_scalar(p + 3*i, entry + 2*i, groups - i);
+}
+
+
+__attribute__((target("ssse3")))
+static void pack_ssse3(const uint16_t *entry, uint8_t *p, size_t groups)
+{
+    const __m128i shuffle = _mm_setr_epi8(PACK_SHUFFLE);
+    const __m128i mask = _mm_set1_epi16(0x0fff);
+    const __m128i low = _mm_set1_epi32(0x00000fff);
+    const __m128i high = _mm_set1_epi32(0x00fff000);
+    __m128i v;
+    uint32_t tail;
+    size_t i;
+
+    for (i = 0; i + 4 <= groups; i += 4)
+    {
+	v = _mm_and_si128(_mm_loadu_si128((const __m128i*)(entry + 2*i)), mask);
+	v = _mm_or_si128(_mm_and_si128(v, low),
+			 _mm_and_si128(_mm_srli_epi32(v, 4), high));
+	v = _mm_shuffle_epi8(v, shuffle);
+	_mm_storel_epi64((__m128i*)(p + 3*i), v);
+	tail = _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+	memcpy(p + 3*i + 8, &tail, 4);
+    }
+    pack_scalar(entry + 2*i, p + 3*i, groups - i);
+}
+
+
+/* the AVX2 kernels do eight groups at once, four in each 128-bit
+   half, since the byte shuffle doesn't cross halves */
+__attribute__((target("avx2")))
+static void unpack_avx2(const uint8_t *p, uint16_t *entry, size_t groups)
+{
+    const __m256i shuffle = _mm256_setr_epi8(UNPACK_SHUFFLE, UNPACK_SHUFFLE);
+    const __m256i even = _mm256_set1_epi32(0x00000fff);
+    const __m256i odd = _mm256_set1_epi32(0xffff0000);
+    __m256i v;
+    size_t i;
+
+    for (i = 0; i + 10 <= groups; i += 8)
+    {
+	v = _mm256_inserti128_si256(
+	    _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(p + 3*i))),
+	    _mm_loadu_si128((const __m128i*)(p + 3*i + 12)), 1);
+	v = _mm256_shuffle_epi8(v, shuffle);
+	v = _mm256_or_si256(_mm256_and_si256(v, even),
+			    _mm256_and_si256(_mm256_srli_epi16(v, 4), odd));
+	_mm256_storeu_si256((__m256i*)(entry + 2*i), v);
+    }
+    unpack_ssse3(p + 3*i, entry + 2*i, groups - i);
+}
+
+
+__attribute__((target("avx2")))
+static void pack_avx2(const uint16_t *entry, uint8_t *p, size_t groups)
+{
+    const __m256i shuffle = _mm256_setr_epi8(PACK_SHUFFLE, PACK_SHUFFLE);
+    const __m256i gather = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    const __m256i mask = _mm256_set1_epi16(0x0fff);
+    const __m256i low = _mm256_set1_epi32(0x00000fff);
+    const __m256i high = _mm256_set1_epi32(0x00fff000);
+    __m256i v;
+    size_t i;
+
+    for (i = 0; i + 8 <= groups; i += 8)
+    {
+	v = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(entry + 2*i)), mask);
+	v = _mm256_or_si256(_mm256_and_si256(v, low),
+			    _mm256_and_si256(_mm256_srli_epi32(v, 4), high));
+	/* 12 bytes at the bottom of each half, then the 24 together */
+	v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, shuffle), gather);
+	_mm_storeu_si128((__m128i*)(p + 3*i), _mm256_castsi256_si128(v));
+	_mm_storel_epi64((__m128i*)(p + 3*i + 16), _mm256_extracti128_si256(v, 1));
+    }
+    pack_ssse3(entry + 2*i, p + 3*i, groups - i);
+}
+
+#endif // FAT12_X86
+
+
+/* in order of preference, worst first; the ones a CPU can run are
+   always a prefix */
+static const struct fat12_kernel kernels[] = {
+    { "scalar", unpack_scalar, pack_scalar },
+#ifdef FAT12_X86
+    { "ssse3", unpack_ssse3, pack_ssse3 },
+    { "avx2", unpack_avx2, pack_avx2 },
+#endif
+};
+
+
+/* fat12_kernels returns every kernel this CPU can run, and their
+   number in *n.  The last is the best. */
+const struct fat12_kernel *fat12_kernels(int *n)
+{
+    *n = 1;
+#ifdef FAT12_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3"))
+    {
+	*n = 2;
+	if (__builtin_cpu_supports("avx2"))
+	    *n = 3;
+    }
+#endif
+    return kernels;
+}
+
+
+/* fat12_unpack and fat12_pack call through these.  Each starts out
+   as a resolver which asks the CPU once, points it at the best kernel
+   and goes on through it.  Threads racing on the first call all store
+   the same kernel. */
+static void unpack_resolve(const uint8_t *, uint16_t *, size_t);
+static void pack_resolve(const uint16_t *, uint8_t *, size_t);
+
+static void (*unpack_best)(const uint8_t *, uint16_t *, size_t) = unpack_resolve;
+static void (*pack_best)(const uint16_t *, uint8_t *, size_t) = pack_resolve;
+
+
+static void unpack_resolve(const uint8_t *p, uint16_t *entry, size_t groups)
+{
+    int n;
+    const struct fat12_kernel *k = fat12_kernels(&n);
+
+    __atomic_store_n(&unpack_best, k[n - 1].unpack, __ATOMIC_RELAXED);
+    k[n - 1].unpack(p, entry, groups);
+}
+
+
+static void pack_resolve(const uint16_t *entry, uint8_t *p, size_t groups)
+{
+    int n;
+    const struct fat12_kernel *k = fat12_kernels(&n);
+
+    __atomic_store_n(&pack_best, k[n - 1].pack, __ATOMIC_RELAXED);
+    k[n - 1].pack(entry, p, groups);
+}
+
+
+/* fat12_unpack decodes groups 3-byte groups from p into 2*groups
+   entries */
+void fat12_unpack(const uint8_t *p, uint16_t *entry, size_t groups)
+{
+    __atomic_load_n(&unpack_best, __ATOMIC_RELAXED)(p, entry, groups);
+}
+
+
+/* fat12_pack encodes 2*groups entries into groups 3-byte groups at p */
+void fat12_pack(const uint16_t *entry, uint8_t *p, size_t groups)
+{
+    __atomic_load_n(&pack_best, __ATOMIC_RELAXED)(entry, p, groups);
+}
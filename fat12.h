@@ -0,0 +1,26 @@
+#ifndef __FAT12_H__
+#define __FAT12_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* bulk conversion between a packed FAT12 FAT and an array of 16-bit
+   entries, a 3-byte group to two entries at a time.  There's a plain
+   C kernel and, on x86, SSSE3 and AVX2 ones; fat12_unpack and
+   fat12_pack use the best one the CPU has.  Every kernel gives the
+   same bytes as the plain one.  Packed entries are masked to 12
+   bits. */
+
+struct fat12_kernel {
+    const char *name;
+    void (*unpack)(const uint8_t *, uint16_t *, size_t);
+    void (*pack)(const uint16_t *, uint8_t *, size_t);
+};
+
+/* prototypes for functions in fat12.c */
+
+const struct fat12_kernel *fat12_kernels(int *);
+void fat12_unpack(const uint8_t *, uint16_t *, size_t);
+void fat12_pack(const uint16_t *, uint8_t *, size_t);
+
+#endif // __FAT12_H__
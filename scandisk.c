@@ -12,20 +12,139 @@
 #include <sys/stat.h>
 #include <string.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <getopt.h>
 
 #include "bootsect.h"
 #include "bpb.h"
 #include "direntry.h"
 #include "fat.h"
 #include "dos.h"
+#include "alloc.h"
+#include "bitset.h"
+#include "walk.h"
+#include "stream.h"
+#include "stats.h"
+#include "trace.h"
+
+/*
+ * A file whose chain is longer than its size says, to be cut back once the whole tree
+ * has been seen
+ */
+struct truncation {
+    struct direntry *dirent;
+    uint32_t owner;
+    int clusters;           //what the size says the chain should be
+};
+
+/*
+ * State for one scan of an image.  Sizes, reachability, cross-links and orphans are
+ * all worked out in a single traversal.  Every file and directory met on the way gets
+ * an owner id, and each reached cluster records the id of the entry that reached it
+ * first, so a second owner shows up as a cross-link.
+ */
+struct scan_state {
+    uint32_t total_clusters;
+    uint64_t *reachable;    //clusters reached from the directory tree, one bit each
+    uint64_t *shared;       //reached clusters a second owner also runs into
+    uint32_t *owner;        //owner id of each reached cluster
+    char **owner_path;      //path of each owner id; id 0 is unused
+    uint32_t nowners;
+    uint32_t owner_cap;
+    uint32_t cur_owner;     //owner id of the entry scan_dirent just looked at
+    char path[MAXPATHLEN+1];
+    int pathlen;            //length of the path of the directory being scanned
+    int repair_crosslinks;  //copy shared tails to new clusters
+    FILE *out;              //where the report goes
+    uint32_t size_fixes;    //problems found, for the batch summary
+    uint32_t bad_clusters;
+    uint32_t loops;
+    uint32_t crosslinks;
+    uint32_t orphans;
+    uint32_t bad_starts;
+    int alloc_ready;
+    struct cluster_alloc alloc;
+    struct truncation *truncs;
+    uint32_t ntruncs;
+    uint32_t truncs_cap;
+};
+
+/*
+ * Give the entry whose path is in st->path a new owner id
+ */
+uint32_t new_owner(struct scan_state *st){
+    if(st->nowners + 1 >= st->owner_cap){
+        uint32_t cap = st->owner_cap ? st->owner_cap * 2 : 64;
+        char **paths = realloc(st->owner_path, cap * sizeof(char*));
+        if(paths == NULL){
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        st->owner_path = paths;
+        st->owner_cap = cap;
+    }
+    st->owner_path[++st->nowners] = strdup(st->path);
+    return st->nowners;
+}
+
+/*
+ * Record that cluster belongs to owner id
+ */
+void claim_cluster(struct scan_state *st, uint32_t cluster, uint32_t id){
+    bitset_set(st->reachable, cluster);
+    st->owner[cluster] = id;
+}
+
+/*
+ * Give the file its own copy of the cross-linked tail starting at cluster, linking the
+ * copy after prev (or into the directory entry when the very first cluster is shared).
+ * Returns the number of clusters copied.
+ */
+int copy_shared_tail(struct direntry *dirent, uint32_t prev, uint32_t cluster, uint8_t *image_buf, struct bpb33 *bpb, struct scan_state *st){
+    uint32_t cluster_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    int copied = 0;
+
+    if(!st->alloc_ready){
+        if(alloc_init(&st->alloc, image_buf, bpb) < 0){
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        st->alloc_ready = 1;
+    }
+
+    while(is_valid_cluster(cluster, bpb) && copied < st->total_clusters){
+        //a cluster can be free in the FAT and still be in use by a directory we've
+        //already scanned, so don't hand those out
+        uint32_t copy;
+        do{
+            copy = alloc_cluster(&st->alloc);
+        }while(copy != 0 && bitset_test(st->reachable, copy));
+        if(copy == 0){
+            fprintf(st->out, "\t\tNo free cluster left to copy cluster %d into; left cross-linked.\n",cluster);
+            break;
+        }
+        memcpy(cluster_to_addr(copy, image_buf, bpb), cluster_to_addr(cluster, image_buf, bpb), cluster_size);
+        set_fat_entry(copy, CLUST_EOFS, image_buf, bpb);
+        if(prev == 0){
+            set_start_cluster(dirent, copy, bpb);
+        }else{
+            set_fat_entry(prev, copy, image_buf, bpb);
+        }
+        claim_cluster(st, copy, st->cur_owner);
+        fprintf(st->out, "\t\tCluster %d copied to cluster %d.\n",cluster,copy);
+        copied++;
+        prev = copy;
+        cluster = get_fat_entry(cluster, image_buf, bpb);
+    }
+    return copied;
+}
 
 /*
  * Compare the number of clusters in FAT and the size of metadata, and modify accordingly
  * This is called in FAT_scan
  */
-int check_cluster_number(struct direntry *dirent, uint8_t *image_buf, struct bpb33 *bpb, int clusters_meta, int clusters_fat){
-    uint16_t cluster = getushort(dirent->deStartCluster);
-    uint16_t cluster_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+int check_cluster_number(struct direntry *dirent, uint8_t *image_buf, struct bpb33 *bpb, int clusters_meta, int clusters_fat, struct scan_state *st){
+    uint32_t cluster_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
 
     if(clusters_fat == clusters_meta){ 
         return 1;
@@ -36,23 +155,25 @@ int check_cluster_number(struct direntry *dirent, uint8_t *image_buf, struct bpb
      * modify the cluster chain via the FAT to make it consistent with the directory entry
      */
     else if(clusters_fat > clusters_meta){
-        printf("\t*BAD:\tFile size in the metadata is smaller than the cluster chain length for the file would suggest.\n");       
-                
-        //modify FAT
-        int i = 0;
-        while (is_valid_cluster(cluster,bpb)){            
-            i++;            
-            uint16_t next = get_fat_entry(cluster, image_buf, bpb); 
-            if(i == clusters_meta){
-                set_fat_entry(cluster, (CLUST_EOFS&FAT12_MASK), image_buf, bpb);
-                printf("\t\tCluster %d changed to EOF.\n",cluster);
-            }else if(i > clusters_meta){
-                set_fat_entry(cluster, (CLUST_FREE&FAT12_MASK), image_buf, bpb);
-                printf("\t\tCluster %d freed.\n",cluster);
-            }        
-            cluster = next;
-        }       
-        
+        st->size_fixes++;
+        fprintf(st->out, "\t*BAD:\tFile size in the metadata is smaller than the cluster chain length for the file would suggest.\n");       
+        fprintf(st->out, "\t\tChain to be cut to %d clusters once the scan is done.\n",clusters_meta);
+
+        //a file found later may still run into the tail, so it's cut in cut_chains
+        if(st->ntruncs == st->truncs_cap){
+            uint32_t cap = st->truncs_cap ? st->truncs_cap * 2 : 16;
+            struct truncation *grown = realloc(st->truncs, cap * sizeof(struct truncation));
+            if(grown == NULL){
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+            st->truncs = grown;
+            st->truncs_cap = cap;
+        }
+        st->truncs[st->ntruncs].dirent = dirent;
+        st->truncs[st->ntruncs].owner = st->cur_owner;
+        st->truncs[st->ntruncs].clusters = clusters_meta;
+        st->ntruncs++;
         return 0;
     }
     
@@ -60,44 +181,92 @@ int check_cluster_number(struct direntry *dirent, uint8_t *image_buf, struct bpb
      * If the directory entry file size is greater than the size indicated by the cluster chain, update the directory entry
      */
     else{
-        printf("\t*BAD:\tFile size in the metadata that is larger than the cluster chain for the file would suggest.\n");
+        st->size_fixes++;
+        fprintf(st->out, "\t*BAD:\tFile size in the metadata that is larger than the cluster chain for the file would suggest.\n");
         uint32_t bytes_needed = getulong(dirent->deFileSize);
-        int new_filesize = clusters_fat * cluster_size;
-        printf("\t\tFile size in metadata modified from %d(%d clusters) to %d(%d clusters).\n",bytes_needed,clusters_meta,new_filesize,clusters_fat);  
+        uint32_t new_filesize = clusters_fat * cluster_size;
+        fprintf(st->out, "\t\tFile size in metadata modified from %u(%d clusters) to %u(%d clusters).\n",bytes_needed,clusters_meta,new_filesize,clusters_fat);  
         
-        //update the 8-bit unsigned integers in directory entry
-        dirent->deFileSize[0] =  (u_int8_t) (new_filesize % 256);
-        dirent->deFileSize[1] = (u_int8_t) (new_filesize / 256);
+        //all four bytes, since FAT16/32 files can be bigger than 64K
+        putulong(dirent->deFileSize, new_filesize);
         
         return 0;
     }
 }
 
 /*
- * Scan through valid cluster chain, look for bad clusters, and check cluster numbers
+ * Scan through valid cluster chain, look for bad clusters, loops and cross-links,
+ * check cluster numbers and claim the clusters for the file
  * This is called in scan_dirent
  */
 
-void FAT_scan(struct direntry *dirent, uint8_t *image_buf, struct bpb33 *bpb, int option, int arr[]){
-    uint16_t cluster = getushort(dirent->deStartCluster);
+void FAT_scan(struct direntry *dirent, uint8_t *image_buf, struct bpb33 *bpb, struct scan_state *st){
+    uint32_t cluster = get_start_cluster(dirent, bpb);
     uint32_t bytes_needed = getulong(dirent->deFileSize);
-    uint16_t cluster_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t cluster_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t prev = 0;
+    int crosslinked = 0;
     
     int clusters_meta = (bytes_needed + cluster_size - 1) / cluster_size;   //number of clusters in metadata
     int clusters_fat = 0;                                                   //number of clusters in FAT   
+    struct trace_span span;
+    trace_begin(&span, TRACE_DETAIL, "file", "file");
+    trace_arg(&span, "cluster", cluster);
     
     //go through the cluster chain of FAT and increment the number of clusters in FAT    
     while(is_valid_cluster(cluster,bpb)){
-        if(option==0){
-            clusters_fat++; 
-        }else if(option==1){
-            arr[cluster]=0;
+        if(bitset_test(st->reachable, cluster)){
+            uint32_t other = st->owner[cluster];
+            if(other == st->cur_owner){
+                //the chain loops back on itself, so end it here
+                st->loops++;
+                fprintf(st->out, "\t*BAD:\tCluster chain loops back to cluster %d.\n",cluster);
+                if(prev != 0){
+                    set_fat_entry(prev, CLUST_EOFS, image_buf, bpb);
+                    fprintf(st->out, "\t\tCluster %d changed to EOF.\n",prev);
+                }
+                break;
+            }
+
+            //the rest of the chain is shared with another file or directory
+            crosslinked = 1;
+            st->crosslinks++;
+            uint32_t shared = cluster;
+            int n = 0;
+            while(is_valid_cluster(shared, bpb) && n < st->total_clusters){
+                fprintf(st->out, "\t*BAD:\tCluster %d is cross-linked: used by %s and %s.\n",
+                       shared, st->owner_path[st->cur_owner],
+                       st->owner_path[bitset_test(st->reachable, shared) ? st->owner[shared] : other]);
+                n++;
+                shared = get_fat_entry(shared, image_buf, bpb);
+            }
+            int copied = 0;
+            if(st->repair_crosslinks){
+                copied = copy_shared_tail(dirent, prev, cluster, image_buf, bpb, st);
+                clusters_fat += copied;
+                crosslinked = 0;
+            }else{
+                clusters_fat += n;
+            }
+            //whatever is still shared mustn't be freed by cutting the first owner's chain
+            if(copied < n){
+                shared = cluster;
+                for(int k = 0; k < n; k++){
+                    bitset_set(st->shared, shared);
+                    shared = get_fat_entry(shared, image_buf, bpb);
+                }
+            }
+            break;
         }
+        claim_cluster(st, cluster, st->cur_owner);
+        clusters_fat++; 
         
         //if the next cluster is bad, we change the pointer of the current cluster
-        uint16_t next = get_fat_entry(cluster, image_buf, bpb);
-        if(get_fat_entry(next, image_buf, bpb) == (CLUST_BAD&FAT12_MASK)){
-            printf("\t*BAD:\tBad cluster %d detected and removed from chain.\n",next);
+        uint32_t next = get_fat_entry(cluster, image_buf, bpb);
+        prev = cluster;
+        if(is_valid_cluster(next, bpb) && get_fat_entry(next, image_buf, bpb) == CLUST_BAD){
+            fprintf(st->out, "\t*BAD:\tBad cluster %d detected and removed from chain.\n",next);
+            st->bad_clusters++;
             set_fat_entry(cluster, next+1, image_buf, bpb);
             cluster = next+1;
         }else{
@@ -105,32 +274,37 @@ void FAT_scan(struct direntry *dirent, uint8_t *image_buf, struct bpb33 *bpb, in
         }
         
     }
-    if(option==0){        
-        check_cluster_number(dirent, image_buf, bpb, clusters_meta, clusters_fat);
+    STATS_CHAIN(clusters_fat);
+    trace_arg(&span, "clusters", clusters_fat);
+    trace_end(&span);
+    if(crosslinked){
+        //fixing the size could free clusters the other owner still uses
+        fprintf(st->out, "\t\tLeft as is; run with -x to give it its own copy of the shared clusters.\n");
+        return;
     }
-          
+    check_cluster_number(dirent, image_buf, bpb, clusters_meta, clusters_fat, st);
 }
 
-void print_indent(int indent){
-    for (int i = 0; i < indent*4; i++)
-	    printf(" ");
+void print_indent(FILE *out, int indent){
+    fprintf(out, "%*s", indent*4, "");
 }
 
 /*
  * Go through the metadata, check if the starting cluster number is larger or equal to 2, and print out useful information about the directory entry
  */
-uint16_t scan_dirent(struct direntry *dirent, uint8_t *image_buf, struct bpb33 *bpb, int indent, int option, int arr[]){
-    uint16_t followclust = 0;
+uint32_t scan_dirent(struct direntry *dirent, uint8_t *image_buf, struct bpb33 *bpb, int indent, struct scan_state *st){
+    uint32_t followclust = 0;
 
     int i;
     char name[9];
     char extension[4];
     uint32_t size;
-    uint16_t file_cluster;
+    uint32_t file_cluster;
     name[8] = ' ';
     extension[3] = ' ';
     memcpy(name, &(dirent->deName[0]), 8);
     memcpy(extension, dirent->deExtension, 3);
+    STATS_ADD(dirents, 1);
     if (name[0] == SLOT_EMPTY){
     	return followclust;
     }
@@ -160,22 +334,26 @@ uint16_t scan_dirent(struct direntry *dirent, uint8_t *image_buf, struct bpb33 *
 	        break;
     }
 
+    //full path of this entry, for reporting cross-links
+    if ((dirent->deAttributes & ATTR_DIRECTORY) != 0 || strlen(extension) == 0){
+        snprintf(st->path + st->pathlen, sizeof(st->path) - st->pathlen, "/%s", name);
+    }else{
+        snprintf(st->path + st->pathlen, sizeof(st->path) - st->pathlen, "/%s.%s", name, extension);
+    }
+
     if ((dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN){
     }else if ((dirent->deAttributes & ATTR_VOLUME) != 0){
-        if(option==0){
-        	printf("Volume: %s\n", name);
-        }
+        fprintf(st->out, "Volume: %s\n", name);
     
     }else if ((dirent->deAttributes & ATTR_DIRECTORY) != 0){
         // don't deal with hidden directories; MacOS makes these
         // for trash directories and such; just ignore them.
 	    if ((dirent->deAttributes & ATTR_HIDDEN) != ATTR_HIDDEN){
-	        if(option==0){
-        	    print_indent(indent);
-        	    printf("%s/ (directory)\n", name);
-        	}
-            file_cluster = getushort(dirent->deStartCluster);
+	        print_indent(st->out, indent);
+	        fprintf(st->out, "%s/ (directory)\n", name);
+            file_cluster = get_start_cluster(dirent, bpb);
             followclust = file_cluster;
+            st->cur_owner = new_owner(st);
         }
         
     }else{
@@ -189,65 +367,404 @@ uint16_t scan_dirent(struct direntry *dirent, uint8_t *image_buf, struct bpb33 *
     	int arch = (dirent->deAttributes & ATTR_ARCHIVE) == ATTR_ARCHIVE;
 
 	    size = getulong(dirent->deFileSize);
-	    if(option==0){
-	        print_indent(indent);
-	        printf("%s.%s (%u bytes) (starting cluster %d) %c%c%c%c\n", 
-	               name, extension, size, getushort(dirent->deStartCluster),
-	               ro?'r':' ', 
-                       hidden?'h':' ', 
-                       sys?'s':' ', 
-                       arch?'a':' ');
-            if(getushort(dirent->deStartCluster)<2){
-	            printf("\t*BAD:\tStarting cluster number smaller than 2.\n");
-	        }
-        }                   
-        FAT_scan(dirent, image_buf, bpb, option, arr);        
+	    print_indent(st->out, indent);
+	    fprintf(st->out, "%s.%s (%u bytes) (starting cluster %d) %c%c%c%c\n", 
+	           name, extension, size, get_start_cluster(dirent, bpb),
+	           ro?'r':' ', 
+                   hidden?'h':' ', 
+                   sys?'s':' ', 
+                   arch?'a':' ');
+        if(get_start_cluster(dirent, bpb)<2){
+	        fprintf(st->out, "\t*BAD:\tStarting cluster number smaller than 2.\n");
+	        st->bad_starts++;
+	    }
+        st->cur_owner = new_owner(st);
+        FAT_scan(dirent, image_buf, bpb, st);        
     }
     return followclust;
 }
 
-void follow_dir(uint16_t cluster, int indent, uint8_t *image_buf, struct bpb33* bpb, int option, int arr[]){
+/*
+ * Claim one cluster of a directory for its owner.  Returns 0 if the directory loops
+ * back on itself or runs into somebody else's clusters, and the scan should stop there.
+ */
+int claim_dir_cluster(uint32_t cluster, uint32_t self, struct scan_state *st){
+    if(bitset_test(st->reachable, cluster)){
+        if(st->owner[cluster] != self){
+            st->crosslinks++;
+            st->path[st->pathlen] = '\0';
+            fprintf(st->out, "\t*BAD:\tCluster %d is cross-linked: used by %s and %s.\n",
+                   cluster, st->path, st->owner_path[st->owner[cluster]]);
+        }
+        return 0;
+    }
+    claim_cluster(st, cluster, self);
+    return 1;
+}
+
+void follow_dir(uint32_t cluster, int indent, uint8_t *image_buf, struct bpb33* bpb, struct scan_state *st);
+
+/*
+ * Scan a directory's chain from cluster on.  Returns the number of clusters scanned.
+ */
+uint32_t follow_chain(uint32_t cluster, uint32_t self, int indent, uint8_t *image_buf, struct bpb33* bpb, struct scan_state *st){
+    uint32_t n = 0;
     while (is_valid_cluster(cluster, bpb)){
+        //directory clusters are reachable too
+        if(!claim_dir_cluster(cluster, self, st)){
+            break;
+        }
+
         struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
 
         int numDirEntries = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) / sizeof(struct direntry);
         int i = 0;
 	    for ( ; i < numDirEntries; i++){            
-            uint16_t followclust = scan_dirent(dirent, image_buf, bpb, indent, option, arr); //do not need
+            uint32_t followclust = scan_dirent(dirent, image_buf, bpb, indent, st);
             if (followclust){
-                follow_dir(followclust, indent+1, image_buf, bpb, option, arr);
+                follow_dir(followclust, indent+1, image_buf, bpb, st);
             }
             dirent++;
     	}
 	cluster = get_fat_entry(cluster, image_buf, bpb);
+        n++;
     }
+    return n;
+}
+
+/*
+ * Scan a directory.  scan_dirent has just left the directory's path in st->path and
+ * its owner id in st->cur_owner.
+ */
+void follow_dir(uint32_t cluster, int indent, uint8_t *image_buf, struct bpb33* bpb, struct scan_state *st){
+    uint32_t self = st->cur_owner;
+    int saved_pathlen = st->pathlen;
+    st->pathlen = strlen(st->path);
+
+    struct trace_span span;
+    trace_begin(&span, TRACE_DETAIL, "dir", "directory");
+    trace_arg(&span, "cluster", cluster);
+    trace_arg(&span, "clusters", follow_chain(cluster, self, indent, image_buf, bpb, st));
+    trace_end(&span);
+
+    st->pathlen = saved_pathlen;
+    st->path[saved_pathlen] = '\0';
 }
 
 /*
- * Option 0 is used when we want to compare and modify the number of cluters in metadata and FAT.
- * Option 1 is used when we want to find orphaned clusters.
+ * On FAT32 the root directory is a cluster chain of its own.  Claim all of it before
+ * the traversal starts, ending the chain early if it loops back on itself.
  */
-void traverse_root(uint8_t *image_buf, struct bpb33* bpb, int option, int arr[]){
-    uint16_t cluster = 0;
+void claim_root(uint8_t *image_buf, struct bpb33* bpb, struct scan_state *st){
+    uint32_t cluster = root_cluster(bpb);
+    uint32_t prev = 0;
+
+    strcpy(st->path, "/");
+    uint32_t self = new_owner(st);
+    st->path[0] = '\0';
 
-    struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    while(is_valid_cluster(cluster, bpb)){
+        if(bitset_test(st->reachable, cluster)){
+            st->loops++;
+            fprintf(st->out, "\t*BAD:\tRoot directory cluster chain loops back to cluster %d.\n",cluster);
+            set_fat_entry(prev, CLUST_EOFS, image_buf, bpb);
+            fprintf(st->out, "\t\tCluster %d changed to EOF.\n",prev);
+            break;
+        }
+        claim_cluster(st, cluster, self);
+        prev = cluster;
+        cluster = get_fat_entry(cluster, image_buf, bpb);
+    }
+}
 
+void scan_root_entries(struct direntry *dirent, int n, uint8_t *image_buf, struct bpb33* bpb, struct scan_state *st){
     int i = 0;
-    for ( ; i < bpb->bpbRootDirEnts; i++){
-        uint16_t followclust = scan_dirent(dirent, image_buf, bpb, 0, option, arr);
+    for ( ; i < n; i++){
+        uint32_t followclust = scan_dirent(dirent, image_buf, bpb, 0, st);
         if (is_valid_cluster(followclust, bpb))
-            follow_dir(followclust, 1, image_buf, bpb, option, arr);
+            follow_dir(followclust, 1, image_buf, bpb, st);
         dirent++;
     }
 }
 
+/*
+ * Walk the whole tree once: print it, fix file sizes against cluster chains and mark
+ * every cluster that can be reached
+ */
+void traverse_root(uint8_t *image_buf, struct bpb33* bpb, struct scan_state *st){
+    uint32_t cluster = root_cluster(bpb);
+
+    if(cluster == MSDOSFSROOT){
+        struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+        scan_root_entries(dirent, bpb->bpbRootDirEnts, image_buf, bpb, st);
+        return;
+    }
+
+    //FAT32: claim_root has already claimed the chain and broken any loop in it
+    int numDirEntries = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) / sizeof(struct direntry);
+    while(is_valid_cluster(cluster, bpb)){
+        struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+        scan_root_entries(dirent, numDirEntries, image_buf, bpb, st);
+        cluster = get_fat_entry(cluster, image_buf, bpb);
+    }
+}
+
+/*
+ * Parallel traversal.  Reading the directories is spread over walk_tree's threads,
+ * which only record what they find as a stream of events in tree order.  The checks
+ * and repairs then run over that stream on one thread, in the same order as
+ * traverse_root, since what gets repaired depends on what was seen first.  Wherever
+ * a repair has changed a directory chain since it was read, the replay carries on
+ * with follow_chain instead.
+ */
+enum { EV_DIR_BEGIN, EV_DIR_CLUSTER, EV_ENTRY, EV_DIR_END };
+
+struct scan_event {
+    int type;
+    int depth;
+    uint32_t cluster;
+    struct direntry *dirent;
+};
+
+struct scan_walk {
+    struct bpb33 *bpb;
+    uint32_t max_dirs;      //more directories than this means the tree is tangled
+    uint32_t ndirs;
+    int overflow;
+    char *events;
+    size_t len;
+    size_t cap;
+};
+
+struct replay_frame {
+    uint32_t self;
+    int saved_pathlen;
+    int indent;
+    uint32_t start;
+    uint32_t cur;           //last cluster replayed, 0 if none yet
+    int ghost;              //a subtree the scan isn't taking, no state to restore
+};
+
+/*
+ * The subdirectory scan_dirent would descend into, without its side effects
+ */
+uint32_t dir_child(struct direntry *dirent, struct bpb33 *bpb){
+    uint8_t c = dirent->deName[0];
+    if(c == SLOT_EMPTY || c == SLOT_DELETED || c == 0x2E){
+        return 0;
+    }
+    if((dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN ||
+       (dirent->deAttributes & ATTR_VOLUME) != 0){
+        return 0;
+    }
+    if((dirent->deAttributes & ATTR_DIRECTORY) != 0 &&
+       (dirent->deAttributes & ATTR_HIDDEN) != ATTR_HIDDEN){
+        return get_start_cluster(dirent, bpb);
+    }
+    return 0;
+}
+
+void put_event(struct walk_buf *out, int type, int depth, uint32_t cluster, struct direntry *dirent){
+    struct scan_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = type;
+    ev.depth = depth;
+    ev.cluster = cluster;
+    ev.dirent = dirent;
+    walk_write(out, &ev, sizeof(ev));
+}
+
+uint32_t walk_entry(struct direntry *dirent, int depth, struct walk_buf *out, void *arg){
+    struct scan_walk *w = arg;
+    uint8_t c = dirent->deName[0];
+    if(c == SLOT_EMPTY || c == SLOT_DELETED || c == 0x2E){
+        return 0;
+    }
+    put_event(out, EV_ENTRY, depth, 0, dirent);
+    if(__atomic_load_n(&w->overflow, __ATOMIC_RELAXED)){
+        return 0;
+    }
+    return dir_child(dirent, w->bpb);
+}
+
+void walk_dir_begin(uint32_t cluster, int depth, struct walk_buf *out, void *arg){
+    struct scan_walk *w = arg;
+    //directories reached from several places can make the tree blow up; leave
+    //those to the serial scan
+    if(__atomic_add_fetch(&w->ndirs, 1, __ATOMIC_RELAXED) > w->max_dirs){
+        __atomic_store_n(&w->overflow, 1, __ATOMIC_RELAXED);
+    }
+    put_event(out, EV_DIR_BEGIN, depth, cluster, NULL);
+}
+
+void walk_dir_cluster(uint32_t cluster, int depth, struct walk_buf *out, void *arg){
+    put_event(out, EV_DIR_CLUSTER, depth, cluster, NULL);
+}
+
+void walk_dir_end(uint32_t cluster, int depth, struct walk_buf *out, void *arg){
+    put_event(out, EV_DIR_END, depth, cluster, NULL);
+}
+
+void walk_sink(const char *data, size_t len, void *arg){
+    struct scan_walk *w = arg;
+    if(w->len + len > w->cap){
+        size_t cap = w->cap ? w->cap * 2 : 4096;
+        while(w->len + len > cap){
+            cap *= 2;
+        }
+        char *grown = realloc(w->events, cap);
+        if(grown == NULL){
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        w->events = grown;
+        w->cap = cap;
+    }
+    memcpy(w->events + w->len, data, len);
+    w->len += len;
+}
+
+void replay_events(struct scan_event *ev, size_t nev, uint8_t *image_buf, struct bpb33 *bpb, struct scan_state *st){
+    struct replay_frame *stack = NULL;
+    int depth = 0, cap = 0;
+    int skip = 0;           //events left to skip, counted in nested directories
+    uint32_t want = 0;      //directory the last entry wants scanned
+    int want_indent = 0;
+
+    for(size_t k = 0; k < nev; k++, ev++){
+        struct replay_frame *f = depth ? &stack[depth-1] : NULL;
+
+        if(skip){
+            if(ev->type == EV_DIR_BEGIN){
+                skip++;
+            }else if(ev->type == EV_DIR_END && --skip == 0){
+                if(!f->ghost){
+                    st->pathlen = f->saved_pathlen;
+                    st->path[f->saved_pathlen] = '\0';
+                }
+                depth--;
+            }
+            continue;
+        }
+
+        if(want && !(ev->type == EV_DIR_BEGIN && ev->cluster == want)){
+            follow_dir(want, want_indent, image_buf, bpb, st);
+            want = 0;
+        }
+
+        switch(ev->type){
+        case EV_ENTRY: {
+            uint32_t followclust = scan_dirent(ev->dirent, image_buf, bpb, ev->depth, st);
+            if(is_valid_cluster(followclust, bpb)){
+                want = followclust;
+                want_indent = ev->depth + 1;
+            }
+            break;
+        }
+        case EV_DIR_BEGIN:
+            if(depth == cap){
+                cap = cap ? cap * 2 : 16;
+                stack = realloc(stack, cap * sizeof(struct replay_frame));
+                if(stack == NULL){
+                    fprintf(stderr, "Out of memory\n");
+                    exit(1);
+                }
+            }
+            f = &stack[depth++];
+            memset(f, 0, sizeof(*f));
+            f->indent = ev->depth;
+            f->start = ev->cluster;
+            if(want == ev->cluster){
+                f->self = st->cur_owner;
+                f->saved_pathlen = st->pathlen;
+                st->pathlen = strlen(st->path);
+                want = 0;
+            }else{
+                f->ghost = 1;
+                skip = 1;
+            }
+            break;
+        case EV_DIR_CLUSTER: {
+            uint32_t expected = f->cur ? get_fat_entry(f->cur, image_buf, bpb) : f->start;
+            if(ev->cluster != expected){
+                //a repair changed the chain after it was read
+                follow_chain(expected, f->self, f->indent, image_buf, bpb, st);
+                skip = 1;
+            }else if(!claim_dir_cluster(ev->cluster, f->self, st)){
+                skip = 1;
+            }else{
+                f->cur = ev->cluster;
+            }
+            break;
+        }
+        case EV_DIR_END: {
+            uint32_t next = f->cur ? get_fat_entry(f->cur, image_buf, bpb) : f->start;
+            if(is_valid_cluster(next, bpb)){
+                follow_chain(next, f->self, f->indent, image_buf, bpb, st);
+            }
+            st->pathlen = f->saved_pathlen;
+            st->path[f->saved_pathlen] = '\0';
+            depth--;
+            break;
+        }
+        }
+    }
+    if(want){
+        follow_dir(want, want_indent, image_buf, bpb, st);
+    }
+    free(stack);
+}
+
+void traverse_root_parallel(uint8_t *image_buf, struct bpb33* bpb, struct scan_state *st, int nthreads){
+    struct scan_walk w;
+    struct walk_ops ops;
+
+    memset(&w, 0, sizeof(w));
+    w.bpb = bpb;
+    w.max_dirs = st->total_clusters;
+    memset(&ops, 0, sizeof(ops));
+    ops.entry = walk_entry;
+    ops.dir_begin = walk_dir_begin;
+    ops.dir_cluster = walk_dir_cluster;
+    ops.dir_end = walk_dir_end;
+    ops.sink = walk_sink;
+    struct trace_span span;
+    trace_begin(&span, TRACE_PHASES, "step", "walk");
+    walk_tree(image_buf, bpb, nthreads, &ops, &w);
+    trace_arg(&span, "events", w.len / sizeof(struct scan_event));
+    trace_arg(&span, "threads", nthreads);
+    trace_end(&span);
+
+    if(w.overflow){
+        trace_begin(&span, TRACE_PHASES, "step", "traverse");
+        traverse_root(image_buf, bpb, st);
+    }else{
+        trace_begin(&span, TRACE_PHASES, "step", "replay");
+        replay_events((struct scan_event*)w.events, w.len / sizeof(struct scan_event),
+                      image_buf, bpb, st);
+    }
+    trace_end(&span);
+    free(w.events);
+}
+
 
 void usage(char *progname) {
-    fprintf(stderr, "usage: %s <imagename>\n", progname);
+    fprintf(stderr, "usage: %s [-x] [-j threads] [--stats] [--trace=file [--trace-detail]] <imagename>\n", progname);
+    fprintf(stderr, "       %s -b [-x] [-j threads] [-f listfile] [--stats] [--trace=file] [imagename ...]\n", progname);
+    fprintf(stderr, "\t<imagename> - reads the image from stdin; repairs are checked but not saved\n");
+    fprintf(stderr, "\t-x\tgive cross-linked files their own copy of the shared clusters\n");
+    fprintf(stderr, "\t-b\tcheck many images (named on the command line, in listfile, or on stdin,\n");
+    fprintf(stderr, "\t\tone per line) in parallel, printing one tab-separated record per image;\n");
+    fprintf(stderr, "\t\texits 1 if any image had problems or couldn't be checked\n");
+    fprintf(stderr, "\t-j\tnumber of threads reading the directory tree, or with -b the number\n");
+    fprintf(stderr, "\t\tof images checked at once (default: one per CPU)\n");
+    fprintf(stderr, "\t--stats\tprint operation counts and times to stderr\n");
+    fprintf(stderr, "\t--trace\twrite the phases' times as a Chrome trace-event file, for\n");
+    fprintf(stderr, "\t\tchrome://tracing or Perfetto; --trace-detail adds every directory and file\n");
     exit(1);
 }
 
-void write_dirent(struct direntry *dirent, char *filename, uint16_t start_cluster, uint32_t size)
+void write_dirent(struct direntry *dirent, char *filename, uint32_t start_cluster, uint32_t size, struct bpb33 *bpb)
 {
     char *p, *p2;
     char *uppername;
@@ -299,91 +816,517 @@ void write_dirent(struct direntry *dirent, char *filename, uint16_t start_cluste
 
     /* set the attributes and file size */
     dirent->deAttributes = ATTR_NORMAL;
-    putushort(dirent->deStartCluster, start_cluster);
+    set_start_cluster(dirent, start_cluster, bpb);
     putulong(dirent->deFileSize, size);
 
 }
 
-void create_dirent(struct direntry *dirent, char *filename, 
-		   uint16_t start_cluster, uint32_t size,
-		   uint8_t *image_buf, struct bpb33* bpb)
+/* create_dirent writes the entry into the first free one of the nslots slots from
+   dirent on.  Returns 0, or -1 if they're all in use. */
+int create_dirent(struct direntry *dirent, int nslots, char *filename, 
+		  uint32_t start_cluster, uint32_t size,
+		  uint8_t *image_buf, struct bpb33* bpb)
 {
-    while (1) 
+    int i;
+
+    for (i = 0; i < nslots; i++, dirent++) 
     {
 	if (dirent->deName[0] == SLOT_EMPTY) 
 	{
 	    /* we found an empty slot at the end of the directory */
-	    write_dirent(dirent, filename, start_cluster, size);
-	    dirent++;
+	    write_dirent(dirent, filename, start_cluster, size, bpb);
 
 	    /* make sure the next dirent is set to be empty, just in
-	       case it wasn't before */
-	    memset((uint8_t*)dirent, 0, sizeof(struct direntry));
-	    dirent->deName[0] = SLOT_EMPTY;
-	    return;
+	       case it wasn't before, unless this was the last slot */
+	    if (i + 1 < nslots) 
+	    {
+		dirent++;
+		memset((uint8_t*)dirent, 0, sizeof(struct direntry));
+		dirent->deName[0] = SLOT_EMPTY;
+	    }
+	    return 0;
 	}
 
 	if (dirent->deName[0] == SLOT_DELETED) 
 	{
 	    /* we found a deleted entry - we can just overwrite it */
-	    write_dirent(dirent, filename, start_cluster, size);
-	    return;
+	    write_dirent(dirent, filename, start_cluster, size, bpb);
+	    return 0;
 	}
-	dirent++;
     }
+    return -1;
 }
 
 /*
- * Go through metadata and save orphans
+ * A free root directory slot for create_dirent, with the number of slots from it to
+ * the end of the fixed FAT12/16 root or of its FAT32 cluster in *nslots.  In a FAT32
+ * root an empty slot at the very end of a cluster isn't used, since the end of the
+ * directory couldn't be marked after it.  Returns NULL if the root is full.
  */
-void check_unassigned(uint8_t *image_buf, struct bpb33* bpb){
-    
-    int total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
-    int clusters_status[total_clusters];
-    for(int i=2; i<total_clusters; i++){
-        if(get_fat_entry(i, image_buf, bpb) == (CLUST_FREE&FAT12_MASK) || get_fat_entry(i, image_buf, bpb) == (CLUST_BAD&FAT12_MASK)){
-		    clusters_status[i]=0;	
-	    }else{
-	        clusters_status[i]=1;
-	    }  
-    }
-    traverse_root(image_buf,bpb,1,clusters_status);
-    
-    int clusters_unassigned[total_clusters];
-    int num_orphans = 0;
-    printf("\n");
-    for(int i=5; i<total_clusters; i++){
-        if(clusters_status[i]==1){
-            clusters_unassigned[num_orphans++] = i;
+struct direntry *root_slot(uint8_t *image_buf, struct bpb33* bpb, struct scan_state *st, int *nslots){
+    uint32_t cluster = root_cluster(bpb);
+    if(cluster == MSDOSFSROOT){
+        struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+        for(int i=0; i<bpb->bpbRootDirEnts; i++){
+            if(dirent[i].deName[0] == SLOT_DELETED || dirent[i].deName[0] == SLOT_EMPTY){
+                *nslots = bpb->bpbRootDirEnts - i;
+                return &dirent[i];
+            }
+        }
+        return NULL;
+    }
+
+    int numDirEntries = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) / sizeof(struct direntry);
+    int steps = 0;
+    while(is_valid_cluster(cluster, bpb) && steps++ < st->total_clusters){
+        struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+        for(int i=0; i<numDirEntries; i++){
+            if(dirent[i].deName[0] == SLOT_DELETED ||
+               (dirent[i].deName[0] == SLOT_EMPTY && i+1 < numDirEntries)){
+                *nslots = numDirEntries - i;
+                return &dirent[i];
+            }
         }
+        cluster = get_fat_entry(cluster, image_buf, bpb);
     }
-    for(int j=0; j<num_orphans; j++){
+    return NULL;
+}
+
+/*
+ * Cut the chains check_cluster_number found too long, now that every owner has been
+ * seen.  A chain that runs into a cluster another file or directory also uses is left
+ * whole, since cutting it would free clusters the other one still needs.
+ */
+void cut_chains(uint8_t *image_buf, struct bpb33* bpb, struct scan_state *st){
+    for(uint32_t t=0; t<st->ntruncs; t++){
+        struct truncation *tr = &st->truncs[t];
+        uint32_t cluster = get_start_cluster(tr->dirent, bpb);
+        int i = 0;
+
+        //a file that shares its chain mustn't lose any of it
+        while(is_valid_cluster(cluster, bpb) && i < st->total_clusters &&
+              !bitset_test(st->shared, cluster) && st->owner[cluster] == tr->owner){
+            cluster = get_fat_entry(cluster, image_buf, bpb);
+            i++;
+        }
+        if(is_valid_cluster(cluster, bpb)){
+            fprintf(st->out, "%s: cluster chain left as is, since cluster %d is cross-linked.\n",
+                    st->owner_path[tr->owner], cluster);
+            continue;
+        }
+
+        fprintf(st->out, "%s: cluster chain cut to %d clusters.\n", st->owner_path[tr->owner], tr->clusters);
+        cluster = get_start_cluster(tr->dirent, bpb);
+        i = 0;
+        while (is_valid_cluster(cluster,bpb)){            
+            i++;            
+            uint32_t next = get_fat_entry(cluster, image_buf, bpb); 
+            if(i == tr->clusters){
+                set_fat_entry(cluster, CLUST_EOFS, image_buf, bpb);
+                fprintf(st->out, "\t\tCluster %d changed to EOF.\n",cluster);
+            }else if(i > tr->clusters){
+                set_fat_entry(cluster, CLUST_FREE, image_buf, bpb);
+                fprintf(st->out, "\t\tCluster %d freed.\n",cluster);
+            }        
+            cluster = next;
+        }
+    }
+}
+
+/*
+ * Sweep the FAT once for clusters that are in use but weren't reached from the tree,
+ * and save the orphans
+ */
+void check_unassigned(uint8_t *image_buf, struct bpb33* bpb, struct scan_state *st){
+    
+    uint32_t num_orphans = 0;
+    struct trace_span span;
+    trace_begin(&span, TRACE_PHASES, "step", "FAT sweep");
+    fprintf(st->out, "\n");
+    for(uint32_t i=CLUST_FIRST; i<st->total_clusters; i++){
+        if(bitset_test(st->reachable, i)){
+            continue;
+        }
+        uint32_t entry = get_fat_entry(i, image_buf, bpb);
+        if(entry == CLUST_FREE || entry == CLUST_BAD){
+            continue;
+        }
+        //FOUND1.DAT to FOUND999.DAT, then F0001000.CHK on, so every name is a
+        //distinct 8.3 one; the root is full long before they run out
         char name[MAXFILENAME];
-        sprintf(name,"FOUND%d.DAT",j+1);
-        printf("*BAD:\tCluster %d is unassigned but not freed. Now in directory as %s.\n",clusters_unassigned[j],name);  
-        struct direntry *dirent = (struct direntry*)cluster_to_addr(0, image_buf, bpb);
+        if(++num_orphans < 1000){
+            snprintf(name,sizeof(name),"FOUND%u.DAT",num_orphans);
+        }else{
+            snprintf(name,sizeof(name),"F%07u.CHK",num_orphans % 10000000);
+        }
+        st->orphans++;
+        fprintf(st->out, "*BAD:\tCluster %d is unassigned but not freed. Now in directory as %s.\n",i,name);  
+        int nslots = 0;
+        struct direntry *dirent = root_slot(image_buf, bpb, st, &nslots);
         long size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec; 
-        create_dirent(dirent, name, clusters_unassigned[j], size, image_buf, bpb);
+        if(dirent == NULL || create_dirent(dirent, nslots, name, i, size, image_buf, bpb) < 0){
+            fprintf(st->out, "\tRoot directory full; no room for it.\n");
+        }
+        //the new file is one cluster long, so its chain has to end here too, or it
+        //would be cross-linked with whatever the orphan pointed at
+        if(!is_end_of_file(entry)){
+            set_fat_entry(i, CLUST_EOFS, image_buf, bpb);
+        }
     }
-    
+    trace_arg(&span, "clusters", st->total_clusters - CLUST_FIRST);
+    trace_arg(&span, "orphans", num_orphans);
+    trace_end(&span);
 }
 
-int main(int argc, char** argv) {
+/*
+ * Release everything scan_state allocated
+ */
+void free_scan_state(struct scan_state *st){
+    for(uint32_t i=1; i<=st->nowners; i++){
+        free(st->owner_path[i]);
+    }
+    free(st->owner_path);
+    free(st->owner);
+    free(st->reachable);
+    free(st->shared);
+    free(st->truncs);
+    if(st->alloc_ready){
+        alloc_destroy(&st->alloc);
+    }
+}
+
+/*
+ * Result of checking one image, for the batch summary
+ */
+struct scan_result {
+    char *image;
+    int done;
+    int error;              //nonzero if the image couldn't be checked
+    char errmsg[128];
+    uint32_t size_fixes;
+    uint32_t bad_clusters;
+    uint32_t loops;
+    uint32_t crosslinks;
+    uint32_t orphans;
+    uint32_t bad_starts;
+};
+
+/*
+ * Check and repair one image, with nthreads threads reading the directory tree, and
+ * write the report to out.  Returns 0, or -1 with res->errmsg set if the image
+ * couldn't be checked at all.
+ */
+int scan_image(char *image, FILE *out, int repair_crosslinks, int nthreads, struct scan_result *res){
     uint8_t *image_buf;
-    int fd;
+    struct fat_volume *vol;
     struct bpb33* bpb;
-    if(argc < 2){
-    	usage(argv[0]);
-    }   
-    
-    image_buf = mmap_file(argv[1], &fd);
-    bpb = check_bootsector(image_buf);
+    int err;
+
+    //"-" streams the image in from stdin, keeping just the directories.
+    //stdin can only be read once, even in batch mode
+    static int stdin_used = 0;
+    stats_phase("open");
+    if(strcmp(image, "-") == 0){
+        if(__atomic_exchange_n(&stdin_used, 1, __ATOMIC_RELAXED)){
+            snprintf(res->errmsg, sizeof(res->errmsg), "stdin has already been read");
+            res->error = 1;
+            return -1;
+        }
+        err = stream_open(stdin, 0, NULL, NULL, &vol);
+    }else{
+        err = fat_open(image, FAT_POPULATE, &vol);
+    }
+    if(err < 0){
+        snprintf(res->errmsg, sizeof(res->errmsg), "%s", fat_strerror(err));
+        res->error = 1;
+        return -1;
+    }
+    image_buf = vol->image_buf;
+    bpb = vol->bpb;
+    if(volume_size(bpb) > vol->size){
+        snprintf(res->errmsg, sizeof(res->errmsg), "bad boot sector");
+        res->error = 1;
+        fat_close(vol);
+        return -1;
+    }
                                 
-    printf("\n");
-    int empty[1] = {0};
-    traverse_root(image_buf, bpb, 0, empty);
+    struct scan_state st;
+    memset(&st, 0, sizeof(st));
+    st.total_clusters = total_clusters(bpb);
+    st.reachable = bitset_alloc(st.total_clusters);
+    st.shared = bitset_alloc(st.total_clusters);
+    st.owner = calloc(st.total_clusters, sizeof(uint32_t));
+    st.repair_crosslinks = repair_crosslinks;
+    st.out = out;
+    if(st.reachable == NULL || st.shared == NULL || st.owner == NULL){
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    fprintf(out, "\n");
+    stats_phase("scan");
+    if(fat_type(bpb) == 32){
+        claim_root(image_buf, bpb, &st);
+    }
+    if(nthreads > 1){
+        traverse_root_parallel(image_buf, bpb, &st, nthreads);
+    }else{
+        traverse_root(image_buf, bpb, &st);
+    }
+    cut_chains(image_buf, bpb, &st);
+
+    stats_phase("orphans");
+    check_unassigned(image_buf, bpb, &st);
+
+    res->size_fixes = st.size_fixes;
+    res->bad_clusters = st.bad_clusters;
+    res->loops = st.loops;
+    res->crosslinks = st.crosslinks;
+    res->orphans = st.orphans;
+    res->bad_starts = st.bad_starts;
+
+    free_scan_state(&st);
+    stats_phase("close");
+    fat_close(vol);
+    return 0;
+}
+
+/*
+ * Batch mode: a fixed pool of workers takes images off a shared list, and the main
+ * thread prints one record per image, in list order, as each one finishes
+ */
+struct batch {
+    struct scan_result *results;
+    int nimages;
+    int next;               //next image to hand out
+    int repair_crosslinks;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+};
+
+void *batch_worker(void *arg){
+    struct batch *b = arg;
+    //the detailed report isn't wanted in batch mode, only the counts
+    FILE *out = fopen("/dev/null", "w");
+    int open_errno = errno;
+
+    while(1){
+        pthread_mutex_lock(&b->lock);
+        int i = b->next++;
+        pthread_mutex_unlock(&b->lock);
+        if(i >= b->nimages){
+            break;
+        }
+
+        //the pool already keeps every thread busy, so each image is walked serially
+        struct trace_span span;
+        trace_begin(&span, TRACE_PHASES, "image", "image");
+        if(out == NULL){
+            snprintf(b->results[i].errmsg, sizeof(b->results[i].errmsg),
+                     "cannot open /dev/null: %s", strerror(open_errno));
+            b->results[i].error = 1;
+        }else{
+            scan_image(b->results[i].image, out, b->repair_crosslinks, 1, &b->results[i]);
+        }
+        trace_arg(&span, "index", i);
+        trace_arg(&span, "orphans", b->results[i].orphans);
+        trace_arg(&span, "crosslinks", b->results[i].crosslinks);
+        trace_arg(&span, "size_fixes", b->results[i].size_fixes);
+        trace_end(&span);
+
+        pthread_mutex_lock(&b->lock);
+        b->results[i].done = 1;
+        pthread_cond_broadcast(&b->done);
+        pthread_mutex_unlock(&b->lock);
+    }
+    if(out != NULL){
+        fclose(out);
+    }
+    return NULL;
+}
+
+uint32_t result_problems(struct scan_result *res){
+    return res->size_fixes + res->bad_clusters + res->loops +
+           res->crosslinks + res->orphans + res->bad_starts;
+}
+
+void print_result(struct scan_result *res){
+    uint32_t problems = result_problems(res);
+    printf("%s\t%s\t%u\t%u\t%u\t%u\t%u\t%u\t%s\n", res->image,
+           res->error ? "error" : (problems ? "problems" : "ok"),
+           res->size_fixes, res->bad_clusters, res->loops, res->crosslinks,
+           res->orphans, res->bad_starts, res->error ? res->errmsg : "-");
+}
+
+/*
+ * Read image names, one per line
+ */
+int read_image_list(FILE *f, char ***images, int *nimages){
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int max = *nimages;
 
-    check_unassigned(image_buf, bpb);
-    unmmap_file(image_buf, &fd);
+    while((len = getline(&line, &cap, f)) != -1){
+        while(len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')){
+            line[--len] = '\0';
+        }
+        if(len == 0){
+            continue;
+        }
+        if(*nimages == max){
+            max = max ? max * 2 : 64;
+            char **grown = realloc(*images, max * sizeof(char*));
+            if(grown == NULL){
+                free(line);
+                return -1;
+            }
+            *images = grown;
+        }
+        (*images)[(*nimages)++] = strdup(line);
+    }
+    free(line);
     return 0;
 }
+
+/*
+ * Returns nonzero if any image had problems or couldn't be checked
+ */
+int run_batch(char **images, int nimages, int nthreads, int repair_crosslinks){
+    struct batch b;
+    int failed = 0;
+
+    memset(&b, 0, sizeof(b));
+    b.results = calloc(nimages ? nimages : 1, sizeof(struct scan_result));
+    b.nimages = nimages;
+    b.repair_crosslinks = repair_crosslinks;
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.done, NULL);
+    for(int i=0; i<nimages; i++){
+        b.results[i].image = images[i];
+    }
+
+    if(nthreads > nimages){
+        nthreads = nimages;
+    }
+    pthread_t *workers = calloc(nthreads ? nthreads : 1, sizeof(pthread_t));
+    for(int t=0; t<nthreads; t++){
+        pthread_create(&workers[t], NULL, batch_worker, &b);
+    }
+
+    printf("#image\tstatus\tsize_fixes\tbad_clusters\tloops\tcrosslinks\torphans\tbad_starts\terror\n");
+    for(int i=0; i<nimages; i++){
+        pthread_mutex_lock(&b.lock);
+        while(!b.results[i].done){
+            pthread_cond_wait(&b.done, &b.lock);
+        }
+        pthread_mutex_unlock(&b.lock);
+        print_result(&b.results[i]);
+        fflush(stdout);
+        failed |= b.results[i].error || result_problems(&b.results[i]) > 0;
+    }
+
+    for(int t=0; t<nthreads; t++){
+        pthread_join(workers[t], NULL);
+    }
+    free(workers);
+    free(b.results);
+    pthread_mutex_destroy(&b.lock);
+    pthread_cond_destroy(&b.done);
+    return failed;
+}
+
+int main(int argc, char** argv) {
+    int repair_crosslinks = 0;
+    int batch = 0;
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    char *listfile = NULL;
+    char *tracefile = NULL;
+    int trace_detail = TRACE_PHASES;
+    int c;
+    static struct option options[] = {
+        { "stats", no_argument, NULL, 's' },
+        { "trace", required_argument, NULL, 't' },
+        { "trace-detail", no_argument, NULL, 'T' },
+        { NULL, 0, NULL, 0 }
+    };
+    while((c = getopt_long(argc, argv, "xbj:f:", options, NULL)) != -1){
+        if(c == 'x'){
+            repair_crosslinks = 1;
+        }else if(c == 'b'){
+            batch = 1;
+        }else if(c == 'j'){
+            nthreads = atoi(optarg);
+        }else if(c == 'f'){
+            batch = 1;
+            listfile = optarg;
+        }else if(c == 's'){
+            stats_start();
+        }else if(c == 't'){
+            tracefile = optarg;
+        }else if(c == 'T'){
+            trace_detail = TRACE_DETAIL;
+        }else{
+            usage(argv[0]);
+        }
+    }
+    if(tracefile != NULL && trace_open(tracefile, trace_detail) < 0){
+        fprintf(stderr, "Cannot write trace %s: %s\n", tracefile, strerror(errno));
+        exit(1);
+    }
+    if(nthreads < 1){
+        nthreads = 1;
+    }
+
+    if(!batch){
+        if(optind >= argc){
+            usage(argv[0]);
+        }
+        struct scan_result res;
+        memset(&res, 0, sizeof(res));
+        if(scan_image(argv[optind], stdout, repair_crosslinks, nthreads, &res) < 0){
+            fprintf(stderr, "Cannot check disk image %s: %s\n", argv[optind], res.errmsg);
+            exit(1);
+        }
+        fflush(stdout);
+        stats_print(stderr);
+        trace_close();
+        return 0;
+    }
+
+    //images come from the command line, a list file, or stdin
+    char **images = NULL;
+    int nimages = 0;
+    if(optind < argc){
+        nimages = argc - optind;
+        images = malloc(nimages * sizeof(char*));
+        for(int i=0; i<nimages; i++){
+            images[i] = strdup(argv[optind+i]);
+        }
+    }
+    if(listfile != NULL || optind >= argc){
+        FILE *f = listfile ? fopen(listfile, "r") : stdin;
+        if(f == NULL){
+            fprintf(stderr, "Cannot open image list %s: %s\n", listfile, strerror(errno));
+            exit(1);
+        }
+        if(read_image_list(f, &images, &nimages) < 0){
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        if(f != stdin){
+            fclose(f);
+        }
+    }
+
+    //the images are checked on other threads, so this is the only phase
+    stats_phase("batch");
+    int failed = run_batch(images, nimages, nthreads, repair_crosslinks);
+    for(int i=0; i<nimages; i++){
+        free(images[i]);
+    }
+    free(images);
+    stats_print(stderr);
+    trace_close();
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,50 @@
+#ifndef __SPARSE_H__
+#define __SPARSE_H__
+
+#include <stdint.h>
+
+/* sparse container: a disk image with its free clusters left out.
+   It starts with everything before the data area of the volume -
+   boot sector, reserved sectors, FATs and root directory - byte for
+   byte as in the image, so the offsets of all of those are the same.
+   Where the data area would start there's a sparse_header, then a
+   bitmap saying which clusters are in the container (bit i of byte j
+   for cluster CLUST_FIRST + 8j + i).  The clusters that are follow,
+   packed in cluster order from packed_offset, and then whatever the
+   image had after its last whole cluster, from tail_offset.
+
+   A cluster's place among the packed ones is the number of bits set
+   before its own in the bitmap, so a run of clusters that are all
+   there is a run in the container too.
+
+   All the fields are little-endian, and split into 32-bit halves
+   where they need more. */
+
+#define SPARSE_MAGIC "FATSPARS"
+#define SPARSE_VERSION 1
+
+/* the packed clusters start on a boundary this size, so they can be
+   mapped (or reflinked) a page at a time */
+#define SPARSE_ALIGN 4096
+
+struct sparse_header {
+    uint8_t magic[8];		/* SPARSE_MAGIC */
+    uint8_t version[4];
+    uint8_t cluster_size[4];
+    uint8_t clusters[4];	/* highest cluster number + 1 */
+    uint8_t npresent[4];	/* clusters packed */
+    uint8_t image_size[8];	/* of the image it was made from */
+    uint8_t packed_offset[8];
+    uint8_t tail_start[8];	/* where the tail goes in the image */
+    uint8_t tail_offset[8];	/* and where it is in the container */
+};
+
+/* whether the i'th bit of a bitmap (cluster CLUST_FIRST + i) is set */
+#define SPARSE_PRESENT(bitmap, i) (((bitmap)[(i) / 8] >> ((i) % 8)) & 1)
+
+#define get64(x) ((uint64_t)(uint32_t)getulong(x) \
+		  | ((uint64_t)(uint32_t)getulong((uint8_t*)(x) + 4) << 32))
+#define put64(p, v) (putulong(p, (uint32_t)(v)), \
+		     putulong((uint8_t*)(p) + 4, (uint32_t)((uint64_t)(v) >> 32)))
+
+#endif // __SPARSE_H__
@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "stats.h"
+#include "trace.h"
+
+
+int stats_enabled = 0;
+static int stats_printing;
+
+/* every thread's counters, so they can be added up at the end.  They
+   outlive their threads. */
+struct stats_block {
+    struct fat_stats stats;
+    struct stats_block *next;
+};
+
+static struct stats_block *blocks;
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct fat_stats *local;
+
+/* if a block can't be had, counts go here, racily */
+static struct fat_stats spare;
+
+/* wall and CPU time, and page faults, for each phase of the run.
+   Phases are the main thread's: a phase started anywhere else is
+   part of whatever that thread is doing. */
+#define STATS_PHASES 16
+
+struct phase {
+    const char *name;
+    double wall, cpu;		/* seconds */
+    long minflt, majflt;
+};
+
+static struct phase phases[STATS_PHASES];
+static int nphases;
+static struct phase *current;
+static struct phase start;	/* of the current phase, as absolute values */
+static pthread_t main_thread;
+
+/* the current phase as a trace span, and the counts when it began */
+static struct trace_span phase_span;
+static struct fat_stats phase_counts;
+
+
+struct fat_stats *stats_local(void)
+{
+    struct stats_block *b;
+
+    if (local != NULL)
+	return local;
+    b = calloc(1, sizeof(*b));
+    if (b == NULL)
+	return &spare;
+    pthread_mutex_lock(&blocks_lock);
+    b->next = blocks;
+    blocks = b;
+    pthread_mutex_unlock(&blocks_lock);
+    local = &b->stats;
+    return local;
+}
+
+
+/* stats_chain records a chain of length clusters */
+void stats_chain(uint32_t length)
+{
+    struct fat_stats *s = stats_local();
+    int bucket;
+
+    s->chains++;
+    if (length == 0)
+	return;
+    bucket = 31 - __builtin_clz(length);
+    if (bucket >= STATS_CHAIN_BUCKETS)
+	bucket = STATS_CHAIN_BUCKETS - 1;
+    s->chain_lengths[bucket]++;
+}
+
+
+/* now fills in p with the time and faults so far */
+static void now(struct phase *p)
+{
+    struct timespec ts;
+    struct rusage ru;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    getrusage(RUSAGE_SELF, &ru);
+    p->wall = ts.tv_sec + ts.tv_nsec / 1e9;
+    p->cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+	+ ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    p->minflt = ru.ru_minflt;
+    p->majflt = ru.ru_majflt;
+}
+
+
+/* stats_total adds up every thread's counters */
+static void stats_total(struct fat_stats *total)
+{
+    struct stats_block *b;
+    int i;
+
+    *total = spare;
+    pthread_mutex_lock(&blocks_lock);
+    for (b = blocks; b != NULL; b = b->next)
+    {
+	total->fat_reads += b->stats.fat_reads;
+	total->fat_writes += b->stats.fat_writes;
+	total->clusters += b->stats.clusters;
+	total->dirents += b->stats.dirents;
+	total->bytes_copied += b->stats.bytes_copied;
+	total->chains += b->stats.chains;
+	for (i = 0; i < STATS_CHAIN_BUCKETS; i++)
+	    total->chain_lengths[i] += b->stats.chain_lengths[i];
+    }
+    pthread_mutex_unlock(&blocks_lock);
+}
+
+
+/* stats_count turns counting and phases on, from the thread that'll
+   mark the phases, without stats_print printing anything */
+void stats_count(void)
+{
+    main_thread = pthread_self();
+    stats_enabled = 1;
+}
+
+
+/* stats_start turns counting on for stats_print */
+void stats_start(void)
+{
+    stats_count();
+    stats_printing = 1;
+}
+
+
+/* stats_phase ends the current phase, and starts the one called name
+   (if it isn't NULL).  A phase that comes round again adds to what
+   it had. */
+void stats_phase(const char *name)
+{
+    struct phase t;
+    int i;
+
+    if (!stats_enabled || !pthread_equal(pthread_self(), main_thread))
+	return;
+    now(&t);
+    if (current != NULL)
+    {
+	current->wall += t.wall - start.wall;
+	current->cpu += t.cpu - start.cpu;
+	current->minflt += t.minflt - start.minflt;
+	current->majflt += t.majflt - start.majflt;
+	current = NULL;
+    }
+    if (phase_span.active)
+    {
+	struct fat_stats total;
+
+	stats_total(&total);
+	trace_arg(&phase_span, "clusters", total.clusters - phase_counts.clusters);
+	trace_arg(&phase_span, "fat_reads", total.fat_reads - phase_counts.fat_reads);
+	trace_arg(&phase_span, "fat_writes", total.fat_writes - phase_counts.fat_writes);
+	trace_arg(&phase_span, "dirents", total.dirents - phase_counts.dirents);
+	trace_end(&phase_span);
+	phase_span.active = 0;
+    }
+    if (name == NULL)
+	return;
+
+    trace_begin(&phase_span, TRACE_PHASES, "phase", name);
+    if (phase_span.active)
+	stats_total(&phase_counts);
+
+    for (i = 0; i < nphases && strcmp(phases[i].name, name) != 0; i++)
+	;
+    if (i == nphases)
+    {
+	if (nphases == STATS_PHASES)
+	    return;
+	phases[nphases++].name = name;
+    }
+    current = &phases[i];
+    start = t;
+}
+
+
+/* stats_print ends the current phase and writes out everything
+   counted */
+void stats_print(FILE *out)
+{
+    struct fat_stats total;
+    struct phase sum;
+    struct rusage ru;
+    int i, j, last;
+
+    if (!stats_enabled)
+	return;
+    stats_phase(NULL);
+    if (!stats_printing)
+	return;
+
+    stats_total(&total);
+
+    fprintf(out, "FAT reads:          %llu\n", (unsigned long long)total.fat_reads);
+    fprintf(out, "FAT writes:         %llu\n", (unsigned long long)total.fat_writes);
+    fprintf(out, "clusters touched:   %llu\n", (unsigned long long)total.clusters);
+    fprintf(out, "directory entries:  %llu\n", (unsigned long long)total.dirents);
+    fprintf(out, "bytes copied:       %llu\n", (unsigned long long)total.bytes_copied);
+    fprintf(out, "chains followed:    %llu\n", (unsigned long long)total.chains);
+    for (last = STATS_CHAIN_BUCKETS - 1; last > 0 && total.chain_lengths[last] == 0; last--)
+	;
+    for (i = 0; i <= last && total.chains > 0; i++)
+    {
+	char range[32];
+
+	if (i == 0)
+	    snprintf(range, sizeof(range), "1");
+	else
+	    snprintf(range, sizeof(range), "%u-%u", 1u << i, (1u << i) * 2 - 1);
+	fprintf(out, "  %20s clusters: %llu\n", range,
+		(unsigned long long)total.chain_lengths[i]);
+    }
+
+    memset(&sum, 0, sizeof(sum));
+    fprintf(out, "%-12s %10s %10s %10s %10s\n", "phase", "wall ms", "cpu ms",
+	    "minflt", "majflt");
+    for (j = 0; j <= nphases; j++)
+    {
+	struct phase *p = j < nphases ? &phases[j] : &sum;
+
+	fprintf(out, "%-12s %10.3f %10.3f %10ld %10ld\n", j < nphases ? p->name : "total",
+		p->wall * 1000, p->cpu * 1000, p->minflt, p->majflt);
+	if (j < nphases)
+	{
+	    sum.wall += p->wall;
+	    sum.cpu += p->cpu;
+	    sum.minflt += p->minflt;
+	    sum.majflt += p->majflt;
+	}
+    }
+    getrusage(RUSAGE_SELF, &ru);
+    fprintf(out, "peak RSS:           %ld KB\n", ru.ru_maxrss);
+}
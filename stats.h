@@ -0,0 +1,50 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* operation counters, for the tools' --stats and --trace.  Until
+   stats_start or stats_count is
+   called every STATS_ macro is a test of one flag that's never set.
+   After it, each thread counts into its own fat_stats, so the threads
+   of a walk don't fight over cache lines, and stats_print adds them
+   up. */
+
+/* chain lengths, in powers of two: 1, 2-3, 4-7, ... */
+#define STATS_CHAIN_BUCKETS 29
+
+struct fat_stats {
+    uint64_t fat_reads;		/* get_fat_entry */
+    uint64_t fat_writes;	/* set_fat_entry */
+    uint64_t clusters;		/* cluster_to_addr: clusters looked at */
+    uint64_t dirents;		/* directory entries read */
+    uint64_t bytes_copied;	/* file data in or out */
+    uint64_t chains;		/* chains followed to the end */
+    uint64_t chain_lengths[STATS_CHAIN_BUCKETS];
+};
+
+extern int stats_enabled;
+
+#define STATS_ADD(field, n)						\
+    do {								\
+	if (__builtin_expect(stats_enabled, 0))				\
+	    stats_local()->field += (n);				\
+    } while (0)
+
+#define STATS_CHAIN(length)						\
+    do {								\
+	if (__builtin_expect(stats_enabled, 0))				\
+	    stats_chain(length);					\
+    } while (0)
+
+/* prototypes for functions in stats.c */
+
+struct fat_stats *stats_local(void);
+void stats_chain(uint32_t);
+void stats_count(void);
+void stats_start(void);
+void stats_phase(const char *);
+void stats_print(FILE *);
+
+#endif // __STATS_H__
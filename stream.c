@@ -0,0 +1,350 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "bitset.h"
+#include "dirindex.h"
+#include "stream.h"
+#include "stats.h"
+
+
+/* what's known about a chain, kept against its first cluster */
+#define CHAIN_UNKNOWN	0	/* nothing points to it yet */
+#define CHAIN_DIR	1
+#define CHAIN_KEEP	2	/* a file keep_file wants */
+#define CHAIN_DROP	3	/* a file it doesn't */
+
+struct stream {
+    FILE *in;
+    uint8_t *image_buf;
+    struct bpb33 *bpb;
+    uint32_t clusters;		/* highest cluster number + 1 */
+    uint32_t next;		/* the next cluster to arrive */
+    uint32_t *head;		/* first cluster of each cluster's chain, 0 if none */
+    uint32_t *left;		/* per chain: how many clusters haven't arrived */
+    uint8_t *kind;		/* per chain: CHAIN_* */
+    char **path;		/* per directory, if keep_file needs paths */
+    stream_keep_fn keep_file;
+    void *arg;
+    size_t page_size;
+};
+
+static void parse_dir(struct stream *s, uint32_t head);
+
+
+/* claim_chain makes the chain starting at c the owner of every
+   cluster on it that isn't owned yet.  One that is means chains are
+   cross-linked, and the first to get there keeps it. */
+static void claim_chain(struct stream *s, uint32_t c)
+{
+    uint32_t next;
+
+    for (next = c; is_valid_cluster(next, s->bpb) && s->head[next] == 0;
+	 next = get_fat_entry(next, s->image_buf, s->bpb))
+    {
+	s->head[next] = c;
+	if (next >= s->next)
+	    s->left[c]++;
+    }
+}
+
+
+/* find_chains works out from the FAT which chain every cluster is on.
+   A chain starts at any cluster in use that no other points to;
+   clusters that are only reachable round a loop aren't on one. */
+static int find_chains(struct stream *s)
+{
+    uint64_t *pointed_to;
+    uint32_t c, next;
+
+    pointed_to = bitset_alloc(s->clusters);
+    if (pointed_to == NULL)
+	return -ENOMEM;
+    for (c = CLUST_FIRST; c < s->clusters; c++)
+    {
+	next = get_fat_entry(c, s->image_buf, s->bpb);
+	if (is_valid_cluster(next, s->bpb))
+	    bitset_set(pointed_to, next);
+    }
+
+    for (c = CLUST_FIRST; c < s->clusters; c++)
+    {
+	next = get_fat_entry(c, s->image_buf, s->bpb);
+	if (bitset_test(pointed_to, c) || next == CLUST_FREE || next == CLUST_BAD)
+	    continue;
+	claim_chain(s, c);
+    }
+    free(pointed_to);
+    return 0;
+}
+
+
+/* release gives back the memory behind a cluster that was kept before
+   it was known not to be needed.  Only whole pages can go, so with
+   clusters smaller than a page it mostly stays. */
+static void release(struct stream *s, uint32_t cluster)
+{
+    uintptr_t start, end;
+
+    start = (uintptr_t)cluster_to_addr(cluster, s->image_buf, s->bpb);
+    end = start + (size_t)s->bpb->bpbBytesPerSec * s->bpb->bpbSecPerClust;
+    start = (start + s->page_size - 1) & ~(uintptr_t)(s->page_size - 1);
+    end &= ~(uintptr_t)(s->page_size - 1);
+    if (end > start)
+	madvise((void*)start, end - start, MADV_DONTNEED);
+}
+
+
+/* classify records what the chain starting at head is.  A chain two
+   entries point to is whatever the first one said. */
+static void classify(struct stream *s, uint32_t head, int kind, const char *path)
+{
+    uint32_t c, steps = 0;
+
+    if (s->kind[head] != CHAIN_UNKNOWN)
+	return;
+    s->kind[head] = kind;
+
+    if (kind == CHAIN_DIR)
+    {
+	if (s->path != NULL)
+	    s->path[head] = strdup(path);
+	if (s->left[head] == 0)
+	    parse_dir(s, head);
+    }
+    else if (kind == CHAIN_DROP)
+    {
+	for (c = head; is_valid_cluster(c, s->bpb) && s->head[c] == head
+		 && steps++ < s->clusters;
+	     c = get_fat_entry(c, s->image_buf, s->bpb))
+	{
+	    if (c < s->next)
+		release(s, c);
+	}
+    }
+}
+
+
+/* parse_entries classifies the chains of the live entries among n
+   starting at dirent, which are in the directory called dirpath.
+   Returns 1 if it reached the end-of-directory marker, 0 if not. */
+static int parse_entries(struct stream *s, struct direntry *dirent, int n,
+			 const char *dirpath)
+{
+    char name[MAXFILENAME], path[MAXPATHLEN+1];
+    uint32_t start;
+    int i, kind;
+
+    path[0] = '\0';
+    for (i = 0; i < n; i++, dirent++)
+    {
+	uint8_t c = dirent->deName[0];
+
+	STATS_ADD(dirents, 1);
+	if (c == SLOT_EMPTY)
+	    return 1;
+	if (c == SLOT_DELETED || c == '.')
+	    continue;
+	if ((dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN
+	    || (dirent->deAttributes & ATTR_VOLUME))
+	    continue;
+
+	/* an entry that points into the middle of a chain leaves it
+	   unknown, which keeps it.  One that points to a cluster the FAT
+	   says is free starts a chain there - but if the cluster has
+	   already gone past, it's been thrown away. */
+	start = get_start_cluster(dirent, s->bpb);
+	if (!is_valid_cluster(start, s->bpb))
+	    continue;
+	if (s->head[start] == 0)
+	    claim_chain(s, start);
+	if (s->head[start] != start)
+	    continue;
+
+	if (s->path != NULL)
+	{
+	    dirent_name(dirent, name);
+	    if (dirpath[0] == '\0')
+		snprintf(path, sizeof(path), "%s", name);
+	    else
+		snprintf(path, sizeof(path), "%s/%s", dirpath, name);
+	}
+
+	if (dirent->deAttributes & ATTR_DIRECTORY)
+	    kind = CHAIN_DIR;
+	else if (s->keep_file != NULL && s->keep_file(path, s->arg))
+	    kind = CHAIN_KEEP;
+	else
+	    kind = CHAIN_DROP;
+	classify(s, start, kind, path);
+    }
+    return 0;
+}
+
+
+/* parse_dir reads the directory starting at head, all of which has
+   arrived */
+static void parse_dir(struct stream *s, uint32_t head)
+{
+    const char *dirpath = (s->path != NULL && s->path[head] != NULL) ? s->path[head] : "";
+    uint32_t c, steps = 0;
+    int nents;
+
+    nents = (s->bpb->bpbBytesPerSec * s->bpb->bpbSecPerClust) / sizeof(struct direntry);
+    for (c = head; is_valid_cluster(c, s->bpb) && s->head[c] == head
+	     && steps++ < s->clusters;
+	 c = get_fat_entry(c, s->image_buf, s->bpb))
+    {
+	if (parse_entries(s, (struct direntry*)cluster_to_addr(c, s->image_buf, s->bpb),
+			  nents, dirpath))
+	    break;
+    }
+}
+
+
+/* read_clusters reads the data area in order, keeping what's needed */
+static int read_clusters(struct stream *s)
+{
+    size_t cluster_size = (size_t)s->bpb->bpbBytesPerSec * s->bpb->bpbSecPerClust;
+    uint8_t *scratch, *dst;
+    uint32_t c, h, next;
+    int keep, rv = 0;
+
+    scratch = malloc(cluster_size);
+    if (scratch == NULL)
+	return -ENOMEM;
+
+    for (c = CLUST_FIRST; c < s->clusters; c++)
+    {
+	h = s->head[c];
+	if (h != 0)
+	{
+	    keep = s->kind[h] != CHAIN_DROP;
+	}
+	else
+	{
+	    /* in use, but on no chain: nothing can say it isn't needed */
+	    next = get_fat_entry(c, s->image_buf, s->bpb);
+	    keep = next != CLUST_FREE && next != CLUST_BAD;
+	}
+	dst = keep ? cluster_to_addr(c, s->image_buf, s->bpb) : scratch;
+	if (fread(dst, 1, cluster_size, s->in) < cluster_size)
+	{
+	    rv = ferror(s->in) ? -EIO : -FAT_ESHORT;
+	    break;
+	}
+	s->next = c + 1;
+
+	if (h != 0 && --s->left[h] == 0 && s->kind[h] == CHAIN_DIR)
+	    parse_dir(s, h);
+    }
+    free(scratch);
+    return rv;
+}
+
+
+/* stream_open reads a whole disk image from in, keeping the parts
+   described in stream.h, and makes a volume of it.  flags are as for
+   fat_open.  Returns 0 with the new volume in *volp, or a negative
+   error for fat_strerror. */
+int stream_open(FILE *in, int flags, stream_keep_fn keep_file, void *arg,
+		struct fat_volume **volp)
+{
+    struct fat_volume *vol;
+    struct stream s;
+    uint8_t sector[512], *image_buf;
+    uint64_t size;
+    size_t data_offset;
+    uint32_t c;
+    int rv;
+
+    if (fread(sector, 1, sizeof(sector), in) < sizeof(sector))
+	return ferror(in) ? -EIO : -FAT_ENOTIMAGE;
+    rv = fat_layout(sector, &size, &data_offset);
+    if (rv < 0)
+	return rv;
+    if (data_offset < sizeof(sector) || data_offset > size || size > SIZE_MAX)
+	return -FAT_EBOOTSECT;
+
+    /* room for the whole volume, but only what's written to takes up
+       any memory */
+    image_buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (image_buf == MAP_FAILED)
+	return -errno;
+    memcpy(image_buf, sector, sizeof(sector));
+    if (fread(image_buf + sizeof(sector), 1, data_offset - sizeof(sector), in)
+	< data_offset - sizeof(sector))
+    {
+	munmap(image_buf, size);
+	return ferror(in) ? -EIO : -FAT_ESHORT;
+    }
+    rv = fat_attach(image_buf, size, -1, flags, &vol);
+    if (rv < 0)
+	return rv;
+
+    memset(&s, 0, sizeof(s));
+    s.in = in;
+    s.image_buf = vol->image_buf;
+    s.bpb = vol->bpb;
+    s.clusters = total_clusters(vol->bpb);
+    s.keep_file = keep_file;
+    s.arg = arg;
+    s.page_size = sysconf(_SC_PAGESIZE);
+    s.head = calloc(s.clusters, sizeof(uint32_t));
+    s.left = calloc(s.clusters, sizeof(uint32_t));
+    s.kind = calloc(s.clusters, sizeof(uint8_t));
+    if (keep_file != NULL)
+	s.path = calloc(s.clusters, sizeof(char*));
+    if (s.head == NULL || s.left == NULL || s.kind == NULL
+	|| (keep_file != NULL && s.path == NULL))
+	rv = -ENOMEM;
+    if (rv == 0)
+	rv = find_chains(&s);
+
+    if (rv == 0)
+    {
+	/* the root is the one directory nothing points to */
+	if (fat_type(vol->bpb) != 32)
+	    parse_entries(&s, (struct direntry*)root_dir_addr(s.image_buf, s.bpb),
+			  s.bpb->bpbRootDirEnts, "");
+	else if (is_valid_cluster(root_cluster(s.bpb), s.bpb)
+		 && s.head[root_cluster(s.bpb)] == root_cluster(s.bpb))
+	    classify(&s, root_cluster(s.bpb), CHAIN_DIR, "");
+	rv = read_clusters(&s);
+    }
+
+    /* whatever follows the last cluster isn't needed, but the writer
+       shouldn't see the pipe close on it */
+    if (rv == 0)
+	while (fread(sector, 1, sizeof(sector), in) > 0)
+	    ;
+
+    if (s.path != NULL)
+    {
+	for (c = 0; c < s.clusters; c++)
+	    free(s.path[c]);
+	free(s.path);
+    }
+    free(s.head);
+    free(s.left);
+    free(s.kind);
+    if (rv < 0)
+    {
+	fat_close(vol);
+	return rv;
+    }
+
+    if (flags & FAT_RDONLY)
+	mprotect(vol->image_buf, vol->size, PROT_READ);
+    *volp = vol;
+    return 0;
+}
@@ -0,0 +1,34 @@
+#ifndef __STREAM_H__
+#define __STREAM_H__
+
+#include <stdio.h>
+
+struct fat_volume;
+
+/* reading a disk image that can only be read once, front to back,
+   such as a pipe.  The boot sector, FATs and root directory come
+   first, so the whole FAT is known before any cluster arrives.  The
+   volume is laid out in anonymous memory like a mapped image, but a
+   cluster only takes up memory if it's kept:
+
+   - directories always are, and each one is read as soon as its last
+     cluster arrives, which says whose the clusters it points to are
+   - a file's clusters are kept if keep_file says so (never, if it's
+     NULL)
+   - clusters that arrive before anything says whose they are are kept
+     in case they're a directory's, and given back if they turn out
+     not to be
+
+   What's thrown away reads as zeroes.  Writes to the volume are lost
+   when it's closed. */
+
+/* keep_file is passed the path of every file found, in the form
+   path lookups use: components NAME.EXT, upper case, separated by
+   '/', without a leading one */
+typedef int (*stream_keep_fn)(const char *path, void *arg);
+
+/* prototypes for functions in stream.c */
+
+int stream_open(FILE *, int, stream_keep_fn, void *, struct fat_volume **);
+
+#endif // __STREAM_H__
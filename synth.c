@@ -0,0 +1,695 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "alloc.h"
+#include "synth.h"
+
+
+struct synth_dir {
+    uint32_t first;		/* MSDOSFSROOT for a FAT12/16 root */
+    uint32_t last;		/* cluster new entries go in */
+    uint32_t used;		/* entries in it */
+    uint32_t parent;
+    int depth;
+};
+
+struct synth_file {
+    struct direntry *dirent;
+    uint32_t dir;
+    uint32_t number;		/* F<number>.DAT */
+    uint32_t size;
+    uint32_t nclusters;
+    uint32_t last;		/* last cluster so far */
+    uint32_t done;		/* clusters so far */
+    int damaged;
+};
+
+struct synth {
+    const struct synth_spec *spec;
+    uint8_t *image_buf;
+    struct bpb33 *bpb;
+    struct cluster_alloc alloc;
+    uint32_t rng;
+    uint32_t cluster_size;
+    uint32_t per_cluster;	/* directory entries */
+    struct synth_dir *dirs;
+    uint32_t ndirs;
+    int deepest;
+    struct synth_file *files;
+    uint32_t nfiles;
+};
+
+
+void synth_defaults(struct synth_spec *spec)
+{
+    memset(spec, 0, sizeof(*spec));
+    spec->fat_type = 16;
+    spec->size = 32 << 20;
+    spec->files = 100;
+    spec->dirs = 10;
+    spec->max_depth = 4;
+    spec->tree = SYNTH_TREE_RANDOM;
+    spec->min_size = 1;		/* scandisk takes empty files for damage */
+    spec->max_size = 64 << 10;
+    spec->size_dist = SYNTH_SIZE_LOG;
+    spec->layout = SYNTH_CONTIGUOUS;
+    spec->interleave = 4;
+    spec->chunk = 4;
+    spec->fill = TRUE;
+    spec->seed = 1;
+}
+
+
+/* xorshift, so a seed gives the same image everywhere */
+static uint32_t next_random(struct synth *s)
+{
+    uint32_t x = s->rng;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return s->rng = x;
+}
+
+
+static uint32_t random_below(struct synth *s, uint32_t n)
+{
+    return n == 0 ? 0 : next_random(s) % n;
+}
+
+
+/* geometry picks the layout of a volume for spec: sectors per
+   cluster, reserved sectors, root directory entries and sectors per
+   FAT.  Returns 0, or -EINVAL if no layout of that size can be that
+   type of FAT. */
+static int geometry(const struct synth_spec *spec, uint32_t *spc, uint32_t *res,
+		    uint32_t *rootents, uint32_t *fatsecs, uint32_t *total)
+{
+    static const uint32_t spc12[] = { 1, 2, 4, 8, 16, 32, 64, 128, 0 };
+    static const uint32_t spc32[] = { 8, 4, 2, 1, 0 };
+    uint32_t one[2] = { spec->sectors_per_cluster, 0 };
+    const uint32_t *try;
+    uint32_t root_secs, clusters = 0;
+    uint64_t meta;
+    int i;
+
+    if (spec->size / 512 > 0xffffffff)
+	return -EINVAL;
+    *total = spec->size / 512;
+    *res = spec->fat_type == 32 ? 32 : 1;
+    *rootents = 0;
+    if (spec->fat_type != 32)
+	*rootents = ((spec->root_entries > 0 ? spec->root_entries : 512) + 15) & ~15;
+    root_secs = *rootents * sizeof(struct direntry) / 512;
+
+    try = spec->sectors_per_cluster > 0 ? one : spec->fat_type == 32 ? spc32 : spc12;
+    for (i = 0; try[i] != 0; i++)
+    {
+	*spc = try[i];
+	for (*fatsecs = 1; ; (*fatsecs)++)
+	{
+	    meta = *res + 2 * (uint64_t)*fatsecs + root_secs;
+	    if (meta >= *total)
+		break;
+	    clusters = (*total - meta) / *spc;
+	    if ((uint64_t)(clusters + CLUST_FIRST) * spec->fat_type / 8 + 1
+		<= (uint64_t)*fatsecs * 512)
+		break;
+	}
+	if (meta >= *total)
+	    continue;
+	if ((spec->fat_type == 12 && clusters < 4085)
+	    || (spec->fat_type == 16 && clusters >= 4085 && clusters < 65525)
+	    || (spec->fat_type == 32 && clusters >= 65525
+		&& clusters < (FAT32_MASK & CLUST_RSRVDS) - CLUST_FIRST))
+	    return 0;
+    }
+    return -EINVAL;
+}
+
+
+/* format makes an empty volume, with nothing but a FAT32 root
+   directory on it */
+static int format(const struct synth_spec *spec, struct fat_volume **volp)
+{
+    struct bootsector33 *bs;
+    struct byte_bpb710 *bpb;
+    uint8_t *image_buf;
+    uint32_t spc, res, rootents, fatsecs, total;
+    uint16_t sector_size = 512;
+    size_t size;
+    int err;
+
+    err = geometry(spec, &spc, &res, &rootents, &fatsecs, &total);
+    if (err < 0)
+	return err;
+    size = (size_t)total * sector_size;
+
+    image_buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (image_buf == MAP_FAILED)
+	return -errno;
+    bs = (struct bootsector33*)image_buf;
+    bs->bsJump[0] = 0xeb;
+    bs->bsJump[1] = 0x3c;
+    bs->bsJump[2] = 0x90;
+    memcpy(bs->bsOemName, "DOSSYNTH", 8);
+    bs->bsBootSectSig0 = BOOTSIG0;
+    bs->bsBootSectSig1 = BOOTSIG1;
+    bpb = (struct byte_bpb710*)bs->bsBPB;
+    putushort(bpb->bpbBytesPerSec, sector_size);
+    bpb->bpbSecPerClust = spc;
+    putushort(bpb->bpbResSectors, res);
+    bpb->bpbFATs = 2;
+    putushort(bpb->bpbRootDirEnts, rootents);
+    bpb->bpbMedia = 0xf8;
+    if (spec->fat_type != 32 && total < 0x10000)
+	putushort(bpb->bpbSectors, total);
+    else
+	putulong(bpb->bpbHugeSectors, total);
+    if (spec->fat_type != 32)
+    {
+	putushort(bpb->bpbFATsecs, fatsecs);
+    }
+    else
+    {
+	putulong(bpb->bpbBigFATsecs, fatsecs);
+	putulong(bpb->bpbRootClust, CLUST_FIRST);
+    }
+
+    err = fat_attach(image_buf, size, -1, 0, volp);
+    if (err < 0)
+	return err;
+
+    /* the two reserved entries (the first is the media byte, 0xf8,
+       with the rest of its bits set), then the root */
+    set_fat_entry(0, CLUST_EOFS, (*volp)->image_buf, (*volp)->bpb);
+    set_fat_entry(1, CLUST_EOFE, (*volp)->image_buf, (*volp)->bpb);
+    if (spec->fat_type == 32)
+	set_fat_entry(CLUST_FIRST, CLUST_EOFE, (*volp)->image_buf, (*volp)->bpb);
+    return 0;
+}
+
+
+/* take_cluster allocates a cluster where the layout says.  Returns 0
+   if the volume is full. */
+static uint32_t take_cluster(struct synth *s)
+{
+    uint32_t c;
+
+    if (s->spec->layout == SYNTH_RANDOM && s->alloc.nfree > 0)
+    {
+	c = CLUST_FIRST + random_below(s, s->alloc.total_clusters - CLUST_FIRST);
+	if (alloc_take(&s->alloc, c) == 0)
+	    return c;
+	s->alloc.next_free = c;
+    }
+    return alloc_cluster(&s->alloc);
+}
+
+
+/* put_entry fills in a directory entry, dated some time this century */
+static void put_entry(struct synth *s, struct direntry *dirent, const char *name,
+		      const char *ext, int attr, uint32_t start, uint32_t size)
+{
+    uint16_t date, time;
+
+    memset(dirent, 0, sizeof(*dirent));
+    memset(dirent->deName, ' ', 8);
+    memset(dirent->deExtension, ' ', 3);
+    memcpy(dirent->deName, name, strlen(name));
+    memcpy(dirent->deExtension, ext, strlen(ext));
+    dirent->deAttributes = attr;
+    set_start_cluster(dirent, start, s->bpb);
+    putulong(dirent->deFileSize, size);
+
+    date = ((20 + random_below(s, 25)) << DD_YEAR_SHIFT)
+	| ((1 + random_below(s, 12)) << DD_MONTH_SHIFT)
+	| ((1 + random_below(s, 28)) << DD_DAY_SHIFT);
+    time = (random_below(s, 24) << DT_HOURS_SHIFT)
+	| (random_below(s, 60) << DT_MINUTES_SHIFT)
+	| (random_below(s, 30) << DT_2SECONDS_SHIFT);
+    putushort(dirent->deCDate, date);
+    putushort(dirent->deCTime, time);
+    putushort(dirent->deMDate, date);
+    putushort(dirent->deMTime, time);
+    putushort(dirent->deADate, date);
+}
+
+
+/* add_entry finds the slot for a new entry at the end of directory d,
+   growing it if it has to.  Returns NULL if there's no room. */
+static struct direntry *add_entry(struct synth *s, struct synth_dir *d)
+{
+    uint32_t c;
+
+    if (d->first == MSDOSFSROOT)
+    {
+	if (d->used == s->bpb->bpbRootDirEnts)
+	    return NULL;
+	return (struct direntry*)root_dir_addr(s->image_buf, s->bpb) + d->used++;
+    }
+    if (d->used == s->per_cluster)
+    {
+	c = take_cluster(s);
+	if (c == 0)
+	    return NULL;
+	set_fat_entry(d->last, c, s->image_buf, s->bpb);
+	set_fat_entry(c, CLUST_EOFE, s->image_buf, s->bpb);
+	memset(cluster_to_addr(c, s->image_buf, s->bpb), 0, s->cluster_size);
+	d->last = c;
+	d->used = 0;
+    }
+    return (struct direntry*)cluster_to_addr(d->last, s->image_buf, s->bpb) + d->used++;
+}
+
+
+/* dir_path writes the path of directory d into path, and returns its
+   length */
+static int dir_path(struct synth *s, uint32_t d, char *path, size_t len)
+{
+    int n;
+
+    if (d == 0)
+    {
+	path[0] = '\0';
+	return 0;
+    }
+    n = dir_path(s, s->dirs[d].parent, path, len);
+    return n + snprintf(path + n, len - n, "%sD%07u", n > 0 ? "/" : "", d);
+}
+
+
+static const char *file_path(struct synth *s, struct synth_file *f)
+{
+    static char path[MAXPATHLEN * 4];
+    int n;
+
+    n = dir_path(s, f->dir, path, sizeof(path));
+    snprintf(path + n, sizeof(path) - n, "%sF%07u.DAT", n > 0 ? "/" : "", f->number);
+    return path;
+}
+
+
+/* pick_parent chooses where the next directory goes, for spec->tree */
+static uint32_t pick_parent(struct synth *s)
+{
+    uint32_t d, i, start;
+    int depth, tries;
+
+    switch (s->spec->tree)
+    {
+    case SYNTH_TREE_DEEP:
+	d = s->ndirs - 1;
+	return s->dirs[d].depth < s->spec->max_depth ? d : 0;
+
+    case SYNTH_TREE_EVEN:
+	depth = 1 + random_below(s, s->spec->max_depth);
+	if (depth > s->deepest + 1)
+	    depth = s->deepest + 1;
+	for (tries = 0; tries < 64; tries++)
+	{
+	    d = random_below(s, s->ndirs);
+	    if (s->dirs[d].depth == depth - 1)
+		return d;
+	}
+	start = random_below(s, s->ndirs);
+	for (i = 0; i < s->ndirs; i++)
+	{
+	    d = (start + i) % s->ndirs;
+	    if (s->dirs[d].depth == depth - 1)
+		return d;
+	}
+	return 0;
+
+    default:
+	for (tries = 0; tries < 64; tries++)
+	{
+	    d = random_below(s, s->ndirs);
+	    if (s->dirs[d].depth < s->spec->max_depth)
+		return d;
+	}
+	return 0;
+    }
+}
+
+
+static int make_dirs(struct synth *s)
+{
+    struct synth_dir *d, *parent;
+    struct direntry *dirent;
+    uint32_t c, p;
+    char name[16];
+
+    s->dirs[0].first = s->dirs[0].last = root_cluster(s->bpb);
+    s->ndirs = 1;
+
+    while (s->ndirs <= s->spec->dirs)
+    {
+	p = pick_parent(s);
+	parent = &s->dirs[p];
+	c = take_cluster(s);
+	if (c == 0)
+	    return -ENOSPC;
+	set_fat_entry(c, CLUST_EOFE, s->image_buf, s->bpb);
+	memset(cluster_to_addr(c, s->image_buf, s->bpb), 0, s->cluster_size);
+
+	/* a full FAT12/16 root puts it under the first directory instead */
+	dirent = add_entry(s, parent);
+	if (dirent == NULL && p == 0 && s->ndirs > 1)
+	{
+	    p = 1;
+	    parent = &s->dirs[p];
+	    dirent = add_entry(s, parent);
+	}
+	if (dirent == NULL)
+	    return -ENOSPC;
+	snprintf(name, sizeof(name), "D%07u", s->ndirs);
+	put_entry(s, dirent, name, "", ATTR_DIRECTORY, c, 0);
+
+	d = &s->dirs[s->ndirs];
+	d->first = d->last = c;
+	d->parent = p;
+	d->depth = parent->depth + 1;
+	if (d->depth > s->deepest)
+	    s->deepest = d->depth;
+	dirent = (struct direntry*)cluster_to_addr(c, s->image_buf, s->bpb);
+	put_entry(s, dirent, ".", "", ATTR_DIRECTORY, c, 0);
+	put_entry(s, dirent + 1, "..", "", ATTR_DIRECTORY, p == 0 ? 0 : parent->first, 0);
+	d->used = 2;
+	s->ndirs++;
+    }
+    return 0;
+}
+
+
+/* file_size draws a size for spec->size_dist */
+static uint32_t file_size(struct synth *s)
+{
+    uint32_t lo = s->spec->min_size, hi = s->spec->max_size, bits, top, bottom;
+    int b, blo = 0, bhi = 0;
+
+    if (hi <= lo)
+	return lo;
+    if (s->spec->size_dist != SYNTH_SIZE_LOG)
+	return lo + random_below(s, hi - lo + 1);
+
+    /* pick how many bits, then a size with that many */
+    for (bits = lo; bits > 0; bits >>= 1)
+	blo++;
+    for (bits = hi; bits > 0; bits >>= 1)
+	bhi++;
+    b = blo + random_below(s, bhi - blo + 1);
+    bottom = b == 0 ? 0 : 1u << (b - 1);
+    top = b >= 32 ? 0xffffffff : (1u << b) - 1;
+    if (bottom < lo)
+	bottom = lo;
+    if (top > hi)
+	top = hi;
+    return bottom + random_below(s, top - bottom + 1);
+}
+
+
+/* make_entries creates every file's directory entry, empty for now */
+static int make_entries(struct synth *s)
+{
+    struct synth_file *f;
+    struct direntry *dirent;
+    char name[16];
+    uint32_t i;
+
+    for (i = 0; i < s->spec->files; i++)
+    {
+	f = &s->files[i];
+	f->number = i + 1;
+	f->size = file_size(s);
+	f->nclusters = (f->size + s->cluster_size - 1) / s->cluster_size;
+	f->dir = random_below(s, s->ndirs);
+	dirent = add_entry(s, &s->dirs[f->dir]);
+	if (dirent == NULL && f->dir == 0 && s->ndirs > 1)
+	{
+	    f->dir = 1 + random_below(s, s->ndirs - 1);
+	    dirent = add_entry(s, &s->dirs[f->dir]);
+	}
+	if (dirent == NULL)
+	    return -ENOSPC;
+	snprintf(name, sizeof(name), "F%07u", f->number);
+	put_entry(s, dirent, name, "DAT", ATTR_ARCHIVE, 0, f->size);
+	f->dirent = dirent;
+	s->nfiles++;
+    }
+    return 0;
+}
+
+
+/* extend_file adds up to n clusters to the end of f.  Returns 0, or
+   -ENOSPC. */
+static int extend_file(struct synth *s, struct synth_file *f, uint32_t n)
+{
+    uint32_t c, bytes;
+
+    for (; n > 0 && f->done < f->nclusters; n--, f->done++)
+    {
+	c = take_cluster(s);
+	if (c == 0)
+	    return -ENOSPC;
+	if (f->done == 0)
+	    set_start_cluster(f->dirent, c, s->bpb);
+	else
+	    set_fat_entry(f->last, c, s->image_buf, s->bpb);
+	set_fat_entry(c, CLUST_EOFE, s->image_buf, s->bpb);
+	f->last = c;
+
+	if (s->spec->fill)
+	{
+	    bytes = f->size - f->done * s->cluster_size;
+	    if (bytes > s->cluster_size)
+		bytes = s->cluster_size;
+	    memset(cluster_to_addr(c, s->image_buf, s->bpb), (f->number + f->done) & 0xff,
+		   bytes);
+	}
+    }
+    return 0;
+}
+
+
+/* write_files gives the files their clusters.  interleave of them are
+   written at once, each getting chunk clusters in turn; for the other
+   layouts that's one at a time, all in one go. */
+static int write_files(struct synth *s)
+{
+    uint32_t interleave = 1, chunk = 0xffffffff, *slot, next = 0, i, busy;
+    int err = 0;
+
+    if (s->spec->layout == SYNTH_INTERLEAVED)
+    {
+	interleave = s->spec->interleave > 0 ? s->spec->interleave : 1;
+	chunk = s->spec->chunk > 0 ? s->spec->chunk : 1;
+    }
+    slot = malloc(interleave * sizeof(uint32_t));
+    if (slot == NULL)
+	return -ENOMEM;
+    for (i = 0; i < interleave; i++)
+	slot[i] = s->nfiles;
+
+    do
+    {
+	busy = 0;
+	for (i = 0; i < interleave && err == 0; i++)
+	{
+	    while (slot[i] == s->nfiles || s->files[slot[i]].done == s->files[slot[i]].nclusters)
+	    {
+		if (next == s->nfiles)
+		{
+		    slot[i] = s->nfiles;
+		    break;
+		}
+		slot[i] = next++;
+	    }
+	    if (slot[i] == s->nfiles)
+		continue;
+	    busy++;
+	    err = extend_file(s, &s->files[slot[i]], chunk);
+	}
+    } while (busy > 0 && err == 0);
+    free(slot);
+    return err;
+}
+
+
+/* pick_file finds an undamaged file with at least min clusters, or
+   returns NULL */
+static struct synth_file *pick_file(struct synth *s, uint32_t min)
+{
+    struct synth_file *f;
+    uint32_t i, start;
+    int tries;
+
+    for (tries = 0; tries < 64; tries++)
+    {
+	f = &s->files[random_below(s, s->nfiles)];
+	if (!f->damaged && f->nclusters >= min)
+	    return f;
+    }
+    start = random_below(s, s->nfiles);
+    for (i = 0; i < s->nfiles; i++)
+    {
+	f = &s->files[(start + i) % s->nfiles];
+	if (!f->damaged && f->nclusters >= min)
+	    return f;
+    }
+    return NULL;
+}
+
+
+/* nth_cluster returns the n'th cluster of f's chain, from 0 */
+static uint32_t nth_cluster(struct synth *s, struct synth_file *f, uint32_t n)
+{
+    uint32_t c = get_start_cluster(f->dirent, s->bpb);
+
+    while (n-- > 0)
+	c = get_fat_entry(c, s->image_buf, s->bpb);
+    return c;
+}
+
+
+/* damage does what spec says to the finished volume, and logs it */
+static void damage(struct synth *s)
+{
+    const struct synth_spec *spec = s->spec;
+    FILE *log = spec->log;
+    struct synth_file *f, *g;
+    uint32_t i, n, c, first = 0, prev = 0, size;
+
+    for (i = 0; i < spec->orphans; i++)
+    {
+	n = 1 + random_below(s, 4);
+	for (c = 0; n > 0 && (c = take_cluster(s)) != 0; n--)
+	{
+	    if (prev == 0)
+		first = c;
+	    else
+		set_fat_entry(prev, c, s->image_buf, s->bpb);
+	    set_fat_entry(c, CLUST_EOFE, s->image_buf, s->bpb);
+	    prev = c;
+	}
+	if (log != NULL && prev != 0)
+	    fprintf(log, "orphan: chain from cluster %u\n", first);
+	prev = 0;
+    }
+
+    for (i = 0; i < spec->size_mismatches && (f = pick_file(s, 1)) != NULL; i++)
+    {
+	f->damaged = TRUE;
+	if (f->nclusters > 1 && random_below(s, 2))
+	    size = (f->nclusters - 1) * s->cluster_size;
+	else
+	    size = (f->nclusters + 1 + random_below(s, 4)) * s->cluster_size;
+	putulong(f->dirent->deFileSize, size);
+	if (log != NULL)
+	    fprintf(log, "size mismatch: %s is %u bytes, says %u\n", file_path(s, f),
+		    f->size, size);
+    }
+
+    for (i = 0; i < spec->bad_clusters && (f = pick_file(s, 2)) != NULL; i++)
+    {
+	f->damaged = TRUE;
+	c = nth_cluster(s, f, 1 + random_below(s, f->nclusters - 1));
+	set_fat_entry(c, CLUST_BAD, s->image_buf, s->bpb);
+	if (log != NULL)
+	    fprintf(log, "bad cluster: %s runs into cluster %u\n", file_path(s, f), c);
+    }
+
+    for (i = 0; i < spec->crosslinks; i++)
+    {
+	f = pick_file(s, 1);
+	if (f == NULL)
+	    break;
+	f->damaged = TRUE;
+	g = pick_file(s, 2);
+	if (g == NULL)
+	    break;
+	g->damaged = TRUE;
+	c = nth_cluster(s, g, 1 + random_below(s, g->nclusters - 1));
+	set_fat_entry(f->last, c, s->image_buf, s->bpb);
+	if (log != NULL)
+	{
+	    fprintf(log, "cross-link: %s", file_path(s, f));
+	    fprintf(log, " runs into cluster %u of %s\n", c, file_path(s, g));
+	}
+    }
+}
+
+
+/* synth_image builds the volume spec describes, in memory.  Returns 0
+   with the volume in *volp, or a negative error for fat_strerror:
+   -EINVAL if there's no such volume, -ENOSPC if everything doesn't
+   fit on it. */
+int synth_image(const struct synth_spec *spec, struct fat_volume **volp)
+{
+    struct fat_volume *vol;
+    struct synth s;
+    uint8_t *fat;
+    size_t fat_size;
+    int i, err;
+
+    if ((spec->fat_type != 12 && spec->fat_type != 16 && spec->fat_type != 32)
+	|| (spec->dirs > 0 && spec->max_depth < 1)
+	|| spec->dirs >= 0xffffffff || spec->files >= 0xffffffff)
+	return -EINVAL;
+    err = format(spec, &vol);
+    if (err < 0)
+	return err;
+
+    memset(&s, 0, sizeof(s));
+    s.spec = spec;
+    s.image_buf = vol->image_buf;
+    s.bpb = vol->bpb;
+    s.rng = spec->seed * 2654435761u + 1;
+    if (s.rng == 0)
+	s.rng = 1;
+    s.cluster_size = s.bpb->bpbBytesPerSec * s.bpb->bpbSecPerClust;
+    s.per_cluster = s.cluster_size / sizeof(struct direntry);
+    s.dirs = calloc(spec->dirs + 1, sizeof(struct synth_dir));
+    s.files = calloc(spec->files + 1, sizeof(struct synth_file));
+    if (s.dirs == NULL || s.files == NULL || alloc_init(&s.alloc, s.image_buf, s.bpb) < 0)
+	err = -ENOMEM;
+
+    if (err == 0)
+	err = make_dirs(&s);
+    if (err == 0)
+	err = make_entries(&s);
+    if (err == 0)
+	err = write_files(&s);
+    if (err == 0)
+	damage(&s);
+
+    alloc_destroy(&s.alloc);
+    free(s.dirs);
+    free(s.files);
+    if (err < 0)
+    {
+	fat_close(vol);
+	return err;
+    }
+
+    /* every FAT the same */
+    flush_fat(s.image_buf, s.bpb);
+    fat = s.image_buf + (size_t)s.bpb->bpbResSectors * s.bpb->bpbBytesPerSec;
+    fat_size = (cluster_to_addr(CLUST_FIRST, s.image_buf, s.bpb) - fat
+		- (size_t)s.bpb->bpbRootDirEnts * sizeof(struct direntry)) / s.bpb->bpbFATs;
+    for (i = 1; i < s.bpb->bpbFATs; i++)
+	memcpy(fat + i * fat_size, fat, fat_size);
+
+    *volp = vol;
+    return 0;
+}
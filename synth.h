@@ -0,0 +1,63 @@
+#ifndef __SYNTH_H__
+#define __SYNTH_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+struct fat_volume;
+
+/* synthetic volumes, built in memory from a description and a seed.
+   The same synth_spec always gives the same image, byte for byte, so
+   large inputs for benchmarks and regression runs don't have to be
+   kept anywhere.
+
+   Directories are D0000001, D0000002, ... and files F0000001.DAT, ...
+   in the order they were made.  Every cluster of file n is filled
+   with the byte (n + i) & 0xff, i being the cluster's place in the
+   file, and zeroes past the end of the file. */
+
+/* how directories are stacked, up to max_depth deep */
+#define SYNTH_TREE_RANDOM	0	/* under any directory: bushy and shallow */
+#define SYNTH_TREE_EVEN		1	/* as many at each depth */
+#define SYNTH_TREE_DEEP		2	/* each under the last, max_depth at a time */
+
+/* how file sizes are spread between min_size and max_size */
+#define SYNTH_SIZE_UNIFORM	0
+#define SYNTH_SIZE_LOG		1	/* as many of each order of magnitude */
+
+/* where files' clusters go */
+#define SYNTH_CONTIGUOUS	0	/* each file in one run */
+#define SYNTH_INTERLEAVED	1	/* interleave files take chunk clusters in turn */
+#define SYNTH_RANDOM		2	/* anywhere */
+
+struct synth_spec {
+    int fat_type;		/* 12, 16 or 32 */
+    uint64_t size;		/* of the volume, in bytes */
+    int sectors_per_cluster;	/* 0 picks one that suits fat_type */
+    int root_entries;		/* FAT12/16 only; 0 for 512 */
+    uint32_t files;
+    uint32_t dirs;		/* besides the root */
+    int max_depth;
+    int tree;			/* SYNTH_TREE_* */
+    uint32_t min_size, max_size;
+    int size_dist;		/* SYNTH_SIZE_* */
+    int layout;			/* SYNTH_CONTIGUOUS, ... */
+    uint32_t interleave, chunk;
+    int fill;			/* write file contents, or leave them zero */
+    uint32_t seed;
+
+    /* damage done afterwards, for scandisk to find */
+    uint32_t orphans;		/* chains no entry points to */
+    uint32_t size_mismatches;	/* entries whose size doesn't match the chain */
+    uint32_t bad_clusters;	/* chains running into a cluster marked bad */
+    uint32_t crosslinks;	/* chains running into the middle of another */
+
+    FILE *log;			/* where the damage is described, or NULL */
+};
+
+/* prototypes for functions in synth.c */
+
+void synth_defaults(struct synth_spec *);
+int synth_image(const struct synth_spec *, struct fat_volume **);
+
+#endif // __SYNTH_H__
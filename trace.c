@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "stats.h"
+#include "trace.h"
+
+
+int trace_level = TRACE_OFF;
+
+static FILE *trace_file;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static double trace_epoch;
+static int trace_events;
+static int next_tid;
+static __thread int tid;
+
+
+static double now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+
+/* trace_open starts writing spans up to level to filename.  The
+   stats counters are turned on too, since the phase spans carry
+   them.  Returns 0, or -1 with errno set. */
+int trace_open(const char *filename, int level)
+{
+    trace_file = fopen(filename, "w");
+    if (trace_file == NULL)
+	return -1;
+    setvbuf(trace_file, NULL, _IOFBF, 1 << 16);
+    fputs("[", trace_file);
+    trace_epoch = now_us();
+    tid = ++next_tid;
+    trace_level = level;
+    stats_count();
+    return 0;
+}
+
+
+/* trace_close ends the file.  Spans still open are left out. */
+void trace_close(void)
+{
+    if (trace_file == NULL)
+	return;
+    pthread_mutex_lock(&trace_lock);
+    trace_level = TRACE_OFF;
+    fputs("\n]\n", trace_file);
+    fclose(trace_file);
+    trace_file = NULL;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+
+void trace_start(struct trace_span *s, const char *cat, const char *name)
+{
+    s->cat = cat;
+    s->name = name;
+    s->nargs = 0;
+    s->start = now_us();
+}
+
+
+/* trace_emit writes s out as a complete event.  The thread that
+   opened the trace is 1, and the others are numbered in the order they
+   first end a span. */
+void trace_emit(struct trace_span *s)
+{
+    double end = now_us();
+    int i;
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file == NULL)
+    {
+	pthread_mutex_unlock(&trace_lock);
+	return;
+    }
+    if (tid == 0)
+	tid = ++next_tid;
+    fprintf(trace_file, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+	    "\"ts\":%.3f,\"dur\":%.3f", trace_events++ > 0 ? "," : "", s->name, s->cat,
+	    (int)getpid(), tid, s->start - trace_epoch, end - s->start);
+    if (s->nargs > 0)
+    {
+	fputs(",\"args\":{", trace_file);
+	for (i = 0; i < s->nargs; i++)
+	    fprintf(trace_file, "%s\"%s\":%llu", i > 0 ? "," : "", s->arg_names[i],
+		    (unsigned long long)s->args[i]);
+	fputs("}", trace_file);
+    }
+    fputs("}", trace_file);
+    pthread_mutex_unlock(&trace_lock);
+}
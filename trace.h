@@ -0,0 +1,62 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+
+/* spans of time, written as a Chrome trace-event file that
+   chrome://tracing or Perfetto can open.  A span is begun and ended
+   on the same thread, and nests inside whatever span that thread was
+   in.  Each span has a level: a span above trace_level isn't timed or
+   written, and costs one test of it. */
+
+#define TRACE_OFF	0
+#define TRACE_PHASES	1	/* the stats phases, and steps within them */
+#define TRACE_DETAIL	2	/* every directory and file too */
+
+#define TRACE_ARGS 4
+
+struct trace_span {
+    int active;
+    const char *cat;
+    const char *name;
+    double start;		/* microseconds */
+    int nargs;
+    const char *arg_names[TRACE_ARGS];
+    uint64_t args[TRACE_ARGS];
+};
+
+extern int trace_level;
+
+/* prototypes for functions in trace.c */
+
+int trace_open(const char *, int);
+void trace_close(void);
+void trace_start(struct trace_span *, const char *, const char *);
+void trace_emit(struct trace_span *);
+
+static inline void trace_begin(struct trace_span *s, int level, const char *cat,
+			       const char *name)
+{
+    s->active = __builtin_expect(trace_level >= level, 0);
+    if (s->active)
+	trace_start(s, cat, name);
+}
+
+/* trace_arg attaches a number to the span, such as how many clusters
+   it covered */
+static inline void trace_arg(struct trace_span *s, const char *name, uint64_t value)
+{
+    if (s->active && s->nargs < TRACE_ARGS)
+    {
+	s->arg_names[s->nargs] = name;
+	s->args[s->nargs++] = value;
+    }
+}
+
+static inline void trace_end(struct trace_span *s)
+{
+    if (s->active)
+	trace_emit(s);
+}
+
+#endif // __TRACE_H__
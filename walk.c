@@ -0,0 +1,419 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "dirindex.h"
+#include "walk.h"
+#include "stats.h"
+#include "trace.h"
+
+
+struct walk_task {
+    uint32_t cluster;		/* first cluster, MSDOSFSROOT for a FAT12/16 root */
+    int depth;			/* depth of its entries */
+    int cycle;			/* cluster is one of its own ancestors */
+    struct walk_task *parent;
+    char *path;			/* out.path, if it isn't the root */
+    struct walk_buf out;
+};
+
+/* each worker pushes and pops its own tasks at the tail of its deque,
+   and idle workers steal from the head of the others' */
+struct walk_deque {
+    pthread_mutex_t lock;
+    struct walk_task **tasks;
+    int head;
+    int tail;
+    int cap;
+};
+
+struct walk_pool {
+    uint8_t *image_buf;
+    struct bpb33 *bpb;
+    struct walk_ops *ops;
+    void *arg;
+    int nthreads;
+    struct walk_deque *deques;
+    int queued;			/* tasks sitting in a deque */
+    int pending;		/* tasks queued or running */
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle;
+};
+
+struct walk_worker {
+    struct walk_pool *pool;
+    int id;
+};
+
+
+static void *walk_alloc(void *p, size_t size)
+{
+    p = realloc(p, size);
+    if (p == NULL) 
+    {
+	fprintf(stderr, "Out of memory\n");
+	exit(1);
+    }
+    return p;
+}
+
+
+/* walk_reserve makes room for len more bytes of output, and returns
+   where they go.  The caller adds however many it used to out->len. */
+char *walk_reserve(struct walk_buf *out, size_t len)
+{
+    if (out->len + len > out->cap) 
+    {
+	out->cap = out->cap ? out->cap * 2 : 256;
+	while (out->len + len > out->cap)
+	    out->cap *= 2;
+	out->data = walk_alloc(out->data, out->cap);
+    }
+    return out->data + out->len;
+}
+
+
+void walk_write(struct walk_buf *out, const void *data, size_t len)
+{
+    memcpy(walk_reserve(out, len), data, len);
+    out->len += len;
+}
+
+
+void walk_printf(struct walk_buf *out, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(out->data + out->len, out->cap - out->len, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+	return;
+    if (out->len + n + 1 > out->cap) 
+    {
+	/* didn't fit - grow the buffer and format it again */
+	out->cap = out->cap ? out->cap * 2 : 256;
+	while (out->len + n + 1 > out->cap)
+	    out->cap *= 2;
+	out->data = walk_alloc(out->data, out->cap);
+	va_start(ap, fmt);
+	vsnprintf(out->data + out->len, out->cap - out->len, fmt, ap);
+	va_end(ap);
+    }
+    out->len += n;
+}
+
+
+static void push_task(struct walk_deque *dq, struct walk_task *t)
+{
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail == dq->cap) 
+    {
+	if (dq->head > 0) 
+	{
+	    /* slide the live tasks back to the start */
+	    memmove(dq->tasks, dq->tasks + dq->head, 
+		    (dq->tail - dq->head) * sizeof(struct walk_task *));
+	    dq->tail -= dq->head;
+	    dq->head = 0;
+	} 
+	else 
+	{
+	    dq->cap = dq->cap ? dq->cap * 2 : 64;
+	    dq->tasks = walk_alloc(dq->tasks, dq->cap * sizeof(struct walk_task *));
+	}
+    }
+    dq->tasks[dq->tail++] = t;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+
+static struct walk_task *pop_task(struct walk_deque *dq)
+{
+    struct walk_task *t = NULL;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail > dq->head)
+	t = dq->tasks[--dq->tail];
+    if (dq->tail == dq->head)
+	dq->head = dq->tail = 0;
+    pthread_mutex_unlock(&dq->lock);
+    return t;
+}
+
+
+static struct walk_task *steal_task(struct walk_pool *pool, int id)
+{
+    struct walk_task *t = NULL;
+    int k;
+
+    for (k = 1; k < pool->nthreads && t == NULL; k++) 
+    {
+	struct walk_deque *dq = &pool->deques[(id + k) % pool->nthreads];
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail > dq->head)
+	    t = dq->tasks[dq->head++];
+	pthread_mutex_unlock(&dq->lock);
+    }
+    return t;
+}
+
+
+/* spawn makes a task for the subdirectory at cluster, whose entry is
+   dirent, and records where its output goes in the parent's */
+static void spawn(struct walk_pool *pool, int id, struct walk_task *parent,
+		  uint32_t cluster, struct direntry *dirent)
+{
+    struct walk_task *t, *a;
+    struct walk_buf *out = &parent->out;
+    char name[MAXFILENAME];
+    size_t len;
+
+    t = walk_alloc(NULL, sizeof(struct walk_task));
+    memset(t, 0, sizeof(struct walk_task));
+    t->cluster = cluster;
+    t->depth = parent->depth + 1;
+    t->parent = parent;
+
+    dirent_name(dirent, name);
+    len = strlen(out->path);
+    t->path = walk_alloc(NULL, len + strlen(name) + 2);
+    if (len == 0)
+	strcpy(t->path, name);
+    else
+	sprintf(t->path, "%s/%s", out->path, name);
+    t->out.path = t->path;
+
+    /* a directory that contains one of its ancestors would make the
+       walk go round forever */
+    for (a = parent; a != NULL; a = a->parent) 
+    {
+	if (a->cluster == cluster)
+	    t->cycle = 1;
+    }
+
+    if (out->nchildren == out->capchildren) 
+    {
+	out->capchildren = out->capchildren ? out->capchildren * 2 : 8;
+	out->children = walk_alloc(out->children, 
+				   out->capchildren * sizeof(struct walk_child));
+    }
+    out->children[out->nchildren].offset = out->len;
+    out->children[out->nchildren].task = t;
+    out->nchildren++;
+
+    __atomic_add_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+    push_task(&pool->deques[id], t);
+    __atomic_add_fetch(&pool->queued, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_lock(&pool->idle_lock);
+    pthread_cond_signal(&pool->idle);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+
+static void run_task(struct walk_pool *pool, int id, struct walk_task *t)
+{
+    struct walk_ops *ops = pool->ops;
+    struct bpb33 *bpb = pool->bpb;
+    struct direntry *dirent;
+    uint32_t cluster, child;
+    uint32_t steps = 0;
+    uint32_t max_clusters = total_clusters(bpb);
+    int i, nents;
+    int is_root = (t->parent == NULL);
+    struct trace_span span;
+
+    trace_begin(&span, TRACE_DETAIL, "dir", "directory");
+    trace_arg(&span, "cluster", t->cluster);
+    if (t->cluster == MSDOSFSROOT) 
+    {
+	/* the FAT12/16 root directory is a fixed area, not a cluster
+	   chain */
+	dirent = (struct direntry*)cluster_to_addr(MSDOSFSROOT, pool->image_buf, bpb);
+	for (i = 0; i < bpb->bpbRootDirEnts; i++, dirent++) 
+	{
+	    STATS_ADD(dirents, 1);
+	    child = ops->entry(dirent, t->depth, &t->out, pool->arg);
+	    if (is_valid_cluster(child, bpb))
+		spawn(pool, id, t, child, dirent);
+	}
+	trace_end(&span);
+	return;
+    }
+
+    /* a FAT32 root is a chain like any other directory, but it's
+       still the root, so it gets no dir_ calls */
+    if (ops->dir_begin && !is_root)
+	ops->dir_begin(t->cluster, t->depth, &t->out, pool->arg);
+
+    nents = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) / sizeof(struct direntry);
+    cluster = t->cluster;
+    while (is_valid_cluster(cluster, bpb) && steps++ < max_clusters) 
+    {
+	if (ops->dir_cluster && !is_root)
+	    ops->dir_cluster(cluster, t->depth, &t->out, pool->arg);
+	if (t->cycle)
+	    break;
+
+	dirent = (struct direntry*)cluster_to_addr(cluster, pool->image_buf, bpb);
+	for (i = 0; i < nents; i++, dirent++) 
+	{
+	    STATS_ADD(dirents, 1);
+	    child = ops->entry(dirent, t->depth, &t->out, pool->arg);
+	    if (is_valid_cluster(child, bpb))
+		spawn(pool, id, t, child, dirent);
+	}
+	cluster = get_fat_entry(cluster, pool->image_buf, bpb);
+    }
+
+    if (ops->dir_end && !is_root)
+	ops->dir_end(t->cluster, t->depth, &t->out, pool->arg);
+    trace_arg(&span, "clusters", steps);
+    trace_end(&span);
+}
+
+
+static void *walk_worker(void *arg)
+{
+    struct walk_worker *w = arg;
+    struct walk_pool *pool = w->pool;
+    struct walk_task *t;
+    int done;
+
+    while (1) 
+    {
+	t = pop_task(&pool->deques[w->id]);
+	if (t == NULL)
+	    t = steal_task(pool, w->id);
+	if (t != NULL) 
+	{
+	    __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_ACQ_REL);
+	    run_task(pool, w->id, t);
+	    if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL) == 0) 
+	    {
+		/* that was the last one - wake everybody up to leave */
+		pthread_mutex_lock(&pool->idle_lock);
+		pthread_cond_broadcast(&pool->idle);
+		pthread_mutex_unlock(&pool->idle_lock);
+	    }
+	    continue;
+	}
+
+	/* nothing to do, so wait for somebody to spawn a task or for
+	   the walk to finish */
+	pthread_mutex_lock(&pool->idle_lock);
+	while (__atomic_load_n(&pool->queued, __ATOMIC_ACQUIRE) == 0 
+	       && __atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) > 0)
+	    pthread_cond_wait(&pool->idle, &pool->idle_lock);
+	done = __atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) == 0;
+	pthread_mutex_unlock(&pool->idle_lock);
+	if (done)
+	    break;
+    }
+    return NULL;
+}
+
+
+/* emit hands a task's output to the sink, with each child's output
+   spliced in where the child was found, and frees the task */
+static void emit(struct walk_task *t, struct walk_ops *ops, void *arg, int is_root)
+{
+    size_t pos = 0;
+    int i;
+
+    for (i = 0; i < t->out.nchildren; i++) 
+    {
+	struct walk_child *c = &t->out.children[i];
+	if (c->offset > pos)
+	    ops->sink(t->out.data + pos, c->offset - pos, arg);
+	emit(c->task, ops, arg, 0);
+	pos = c->offset;
+    }
+    if (t->out.len > pos)
+	ops->sink(t->out.data + pos, t->out.len - pos, arg);
+
+    free(t->out.data);
+    free(t->out.children);
+    free(t->path);
+    if (!is_root)
+	free(t);
+}
+
+
+/* walk_tree walks the whole directory tree of the image with nthreads
+   threads, calling ops for every directory and entry, then feeds the
+   combined output to ops->sink.  If some threads can't be started
+   the walk just goes ahead with fewer. */
+int walk_tree(uint8_t *image_buf, struct bpb33 *bpb, int nthreads,
+	      struct walk_ops *ops, void *arg)
+{
+    struct walk_pool pool;
+    struct walk_task root;
+    struct walk_worker *workers;
+    pthread_t *threads;
+    int i, started = 0;
+
+    if (nthreads < 1)
+	nthreads = 1;
+
+    memset(&pool, 0, sizeof(pool));
+    pool.image_buf = image_buf;
+    pool.bpb = bpb;
+    pool.ops = ops;
+    pool.arg = arg;
+    pool.nthreads = nthreads;
+    pool.deques = walk_alloc(NULL, nthreads * sizeof(struct walk_deque));
+    memset(pool.deques, 0, nthreads * sizeof(struct walk_deque));
+    for (i = 0; i < nthreads; i++)
+	pthread_mutex_init(&pool.deques[i].lock, NULL);
+    pthread_mutex_init(&pool.idle_lock, NULL);
+    pthread_cond_init(&pool.idle, NULL);
+
+    memset(&root, 0, sizeof(root));
+    root.cluster = root_cluster(bpb);
+    root.out.path = "";
+    push_task(&pool.deques[0], &root);
+    pool.queued = 1;
+    pool.pending = 1;
+
+    workers = walk_alloc(NULL, nthreads * sizeof(struct walk_worker));
+    threads = walk_alloc(NULL, nthreads * sizeof(pthread_t));
+    for (i = 0; i < nthreads; i++) 
+    {
+	workers[i].pool = &pool;
+	workers[i].id = i;
+    }
+
+    /* this thread is worker 0 */
+    for (i = 1; i < nthreads; i++) 
+    {
+	if (pthread_create(&threads[i], NULL, walk_worker, &workers[i]) != 0)
+	    break;
+	started++;
+    }
+    walk_worker(&workers[0]);
+    for (i = 1; i <= started; i++)
+	pthread_join(threads[i], NULL);
+
+    emit(&root, ops, arg, 1);
+
+    for (i = 0; i < nthreads; i++) 
+    {
+	pthread_mutex_destroy(&pool.deques[i].lock);
+	free(pool.deques[i].tasks);
+    }
+    free(pool.deques);
+    free(workers);
+    free(threads);
+    pthread_mutex_destroy(&pool.idle_lock);
+    pthread_cond_destroy(&pool.idle);
+    return 0;
+}
@@ -0,0 +1,61 @@
+#ifndef __WALK_H__
+#define __WALK_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* parallel directory tree walk.  Every directory is a task on a pool
+   of work-stealing threads.  Each task writes into its own walk_buf,
+   and when the walk is over the buffers are stitched together in the
+   order a single-threaded depth-first walk would have produced them,
+   so the output doesn't depend on how the work was scheduled. */
+
+struct direntry;
+struct bpb33;
+struct walk_task;
+
+struct walk_child {
+    size_t offset;		/* where in the parent's output it goes */
+    struct walk_task *task;
+};
+
+/* output of one directory task */
+struct walk_buf {
+    const char *path;		/* of the directory, as dirent_name spells its
+				   components, "" for the root */
+    char *data;
+    size_t len;
+    size_t cap;
+    struct walk_child *children;
+    int nchildren;
+    int capchildren;
+};
+
+struct walk_ops {
+    /* called for every slot of every directory, root entries at depth
+       0.  Returns the first cluster of a subdirectory to descend
+       into, or 0. */
+    uint32_t (*entry)(struct direntry *dirent, int depth,
+		      struct walk_buf *out, void *arg);
+
+    /* optional: called when a subdirectory starting at cluster is
+       entered, for each cluster of its chain, and when it's left.
+       depth is the depth of its entries. */
+    void (*dir_begin)(uint32_t cluster, int depth, struct walk_buf *out, void *arg);
+    void (*dir_cluster)(uint32_t cluster, int depth, struct walk_buf *out, void *arg);
+    void (*dir_end)(uint32_t cluster, int depth, struct walk_buf *out, void *arg);
+
+    /* gets the stitched output, a piece at a time */
+    void (*sink)(const char *data, size_t len, void *arg);
+};
+
+/* prototypes for functions in walk.c */
+
+void walk_write(struct walk_buf *, const void *, size_t);
+char *walk_reserve(struct walk_buf *, size_t);
+void walk_printf(struct walk_buf *, const char *, ...)
+    __attribute__((format(printf, 2, 3)));
+
+int walk_tree(uint8_t *, struct bpb33 *, int, struct walk_ops *, void *);
+
+#endif // __WALK_H__